@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+
+/*
+ * Benchmark harness for transplant, built and run by `make bench'.
+ *
+ * Generates synthetic trees in a scratch directory, then times the program
+ * serializing each one to a file, deserializing that file, and doing both
+ * at once through a pipe.  Every measurement is printed to the standard
+ * output as one JSON object per line, so that results can be kept and
+ * compared between commits; progress goes to the standard error.
+ *
+ * USAGE: transplant_bench [-n SCALE] [-l LABEL] [-s ARGS] [-d ARGS] [-k] BIN
+ *   -n SCALE  Multiply the size of every tree by SCALE (default 1).
+ *   -l LABEL  Label each result with LABEL, such as a commit id.
+ *   -s ARGS   Extra arguments for serializing, such as "-j 4".
+ *   -d ARGS   Extra arguments for deserializing.
+ *   -k        Keep the scratch directory instead of removing it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 64
+#define CHUNK_SIZE (1 << 20)
+
+/*
+ * What a set of runs of the program cost.
+ */
+struct result {
+    double seconds;
+    long readCalls;
+    long writeCalls;
+    long peakRss;
+    int failed;
+};
+
+/*
+ * A synthetic tree: what is in it, and how to make it.
+ */
+struct tree {
+    const char *name;
+    void (*make)(const char *root, int scale);
+    long files;
+    long long bytes;
+};
+
+static char *program;
+static char *label = "";
+static char *serializeArgs[MAX_ARGS];
+static char *deserializeArgs[MAX_ARGS];
+static char serializeText[256];
+static char deserializeText[256];
+static char *chunk;
+static int keep;
+static uint64_t seed = 0x9E3779B97F4A7C15ull;
+
+// Counts for the tree being made
+static long madeFiles;
+static long long madeBytes;
+
+static void die(const char *what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+// Split a string of arguments on spaces into a NULL-terminated list
+static void split_args(char *text, char **list) {
+    int count = 0;
+    for (char *word = strtok(text, " "); word != NULL && count < MAX_ARGS - 1; word = strtok(NULL, " ")) {
+        list[count++] = word;
+    }
+    list[count] = NULL;
+}
+
+// Fill the chunk with bytes that neither compress nor repeat
+static void fill_chunk(size_t length) {
+    for (size_t i = 0; i + 8 <= length; i += 8) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        memcpy(chunk + i, &seed, 8);
+    }
+}
+
+// Write length bytes at offset, a chunk at a time
+static void write_at(int fd, off_t offset, long long length) {
+    while (length > 0) {
+        size_t have = length < CHUNK_SIZE ? length : CHUNK_SIZE;
+        fill_chunk(have);
+        if (pwrite(fd, chunk, have, offset) != (ssize_t)have) {
+            die("pwrite");
+        }
+        offset += have;
+        length -= have;
+    }
+}
+
+static void make_file(const char *path, long long size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        die(path);
+    }
+    write_at(fd, 0, size);
+    close(fd);
+    madeFiles++;
+    madeBytes += size;
+}
+
+static void make_dir(const char *path) {
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        die(path);
+    }
+}
+
+// Many small files spread over a few directories
+static void make_tiny(const char *root, int scale) {
+    char path[PATH_MAX];
+    for (int d = 0; d < 10; d++) {
+        snprintf(path, sizeof(path), "%s/d%d", root, d);
+        make_dir(path);
+        for (int f = 0; f < 2000 * scale; f++) {
+            snprintf(path, sizeof(path), "%s/d%d/f%d", root, d, f);
+            make_file(path, 64 + (f * 37) % 449);
+        }
+    }
+}
+
+// A few large files
+static void make_huge(const char *root, int scale) {
+    char path[PATH_MAX];
+    for (int f = 0; f < 4; f++) {
+        snprintf(path, sizeof(path), "%s/huge%d", root, f);
+        make_file(path, (64LL << 20) * scale);
+    }
+}
+
+// A long chain of directories with a few files at each level
+static void make_deep(const char *root, int scale) {
+    char path[PATH_MAX];
+    char file[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s", root);
+    for (int level = 0; level < 200; level++) {
+        size_t length = strlen(path);
+        snprintf(path + length, sizeof(path) - length, "/l%d", level % 10);
+        make_dir(path);
+        for (int f = 0; f < 5 * scale; f++) {
+            snprintf(file, sizeof(file), "%s/f%d", path, f);
+            make_file(file, 4096);
+        }
+    }
+}
+
+// One directory with a great many entries
+static void make_wide(const char *root, int scale) {
+    char path[PATH_MAX];
+    for (int f = 0; f < 50000 * scale; f++) {
+        snprintf(path, sizeof(path), "%s/entry_with_a_longer_name_%d", root, f);
+        make_file(path, 32);
+    }
+}
+
+// Large files that are mostly holes, with a few data extents each
+static void make_sparse(const char *root, int scale) {
+    char path[PATH_MAX];
+    for (int f = 0; f < 8 * scale; f++) {
+        snprintf(path, sizeof(path), "%s/sparse%d", root, f);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            die(path);
+        }
+        for (int e = 0; e < 4; e++) {
+            write_at(fd, (off_t)e * (64 << 20), 1 << 20);
+        }
+        if (ftruncate(fd, 256LL << 20) == -1) {
+            die("ftruncate");
+        }
+        close(fd);
+        madeFiles++;
+        madeBytes += 256LL << 20;
+    }
+}
+
+static int remove_entry(const char *path, const struct stat *stat_buf, int type, struct FTW *ftw) {
+    return remove(path);
+}
+
+static void remove_tree(const char *path) {
+    if (nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS) == -1 && errno != ENOENT) {
+        die(path);
+    }
+}
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Start the program with the given standard input and output
+static pid_t start(char **args, int in, int out) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        die("fork");
+    }
+    if (pid == 0) {
+        if (in != STDIN_FILENO && dup2(in, STDIN_FILENO) == -1) {
+            _exit(127);
+        }
+        if (out != STDOUT_FILENO && dup2(out, STDOUT_FILENO) == -1) {
+            _exit(127);
+        }
+        execv(program, args);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Read the system call counts of a child that has exited but not been reaped
+static void read_io(pid_t pid, struct result *r) {
+    char path[64];
+    char line[128];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return;
+    }
+    long value;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "syscr: %ld", &value) == 1) {
+            r->readCalls += value;
+        } else if (sscanf(line, "syscw: %ld", &value) == 1) {
+            r->writeCalls += value;
+        }
+    }
+    fclose(f);
+}
+
+// Wait for a child, adding what it cost to the result
+static void finish(pid_t pid, struct result *r) {
+    siginfo_t info;
+    if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == 0) {
+        read_io(pid, r);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        die("wait4");
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        r->failed = 1;
+    }
+    if (usage.ru_maxrss > r->peakRss) {
+        r->peakRss = usage.ru_maxrss;
+    }
+}
+
+// Build the argument list for one direction of the program
+static void build_args(char **args, const char *mode, const char *path, const char *input, char **extra) {
+    int count = 0;
+    args[count++] = program;
+    args[count++] = (char *)mode;
+    args[count++] = "-p";
+    args[count++] = (char *)path;
+    if (input != NULL) {
+        args[count++] = "-i";
+        args[count++] = (char *)input;
+    }
+    for (int i = 0; extra[i] != NULL && count < MAX_ARGS * 2 - 1; i++) {
+        args[count++] = extra[i];
+    }
+    args[count] = NULL;
+}
+
+static void report(struct tree *t, const char *phase, struct result *r) {
+    double seconds = r->seconds > 0 ? r->seconds : 1e-9;
+    printf("{\"label\":\"%s\",\"tree\":\"%s\",\"phase\":\"%s\",\"serialize_args\":\"%s\","
+           "\"deserialize_args\":\"%s\",\"files\":%ld,\"bytes\":%lld,\"seconds\":%.6f,"
+           "\"mb_per_s\":%.2f,\"files_per_s\":%.1f,\"read_syscalls\":%ld,\"write_syscalls\":%ld,"
+           "\"peak_rss_kb\":%ld,\"ok\":%s}\n",
+           label, t->name, phase, serializeText, deserializeText, t->files, t->bytes, r->seconds,
+           t->bytes / seconds / 1e6, t->files / seconds, r->readCalls, r->writeCalls, r->peakRss,
+           r->failed ? "false" : "true");
+    fflush(stdout);
+}
+
+static void bench_tree(const char *scratch, struct tree *t, int scale) {
+    char root[PATH_MAX];
+    char archive[PATH_MAX];
+    char target[PATH_MAX];
+    char *args[MAX_ARGS * 2];
+    char *peerArgs[MAX_ARGS * 2];
+    snprintf(root, sizeof(root), "%s/%s", scratch, t->name);
+    snprintf(archive, sizeof(archive), "%s/%s.bin", scratch, t->name);
+    snprintf(target, sizeof(target), "%s/%s.out", scratch, t->name);
+
+    fprintf(stderr, "bench: making %s\n", t->name);
+    make_dir(root);
+    madeFiles = 0;
+    madeBytes = 0;
+    t->make(root, scale);
+    t->files = madeFiles;
+    t->bytes = madeBytes;
+    sync();
+
+    // Serialize to a file
+    struct result r = {0};
+    int out = open(archive, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) {
+        die(archive);
+    }
+    build_args(args, "-s", root, NULL, serializeArgs);
+    double begin = now();
+    finish(start(args, STDIN_FILENO, out), &r);
+    r.seconds = now() - begin;
+    close(out);
+    report(t, "serialize", &r);
+
+    // Deserialize that file into a fresh directory
+    memset(&r, 0, sizeof(r));
+    remove_tree(target);
+    build_args(args, "-d", target, archive, deserializeArgs);
+    begin = now();
+    finish(start(args, STDIN_FILENO, STDOUT_FILENO), &r);
+    r.seconds = now() - begin;
+    report(t, "deserialize", &r);
+
+    // Both at once through a pipe
+    memset(&r, 0, sizeof(r));
+    remove_tree(target);
+    int pipeFds[2];
+    if (pipe(pipeFds) == -1) {
+        die("pipe");
+    }
+    build_args(args, "-s", root, NULL, serializeArgs);
+    build_args(peerArgs, "-d", target, NULL, deserializeArgs);
+    begin = now();
+    pid_t writer = start(args, STDIN_FILENO, pipeFds[1]);
+    close(pipeFds[1]);
+    pid_t reader = start(peerArgs, pipeFds[0], STDOUT_FILENO);
+    close(pipeFds[0]);
+    finish(writer, &r);
+    finish(reader, &r);
+    r.seconds = now() - begin;
+    report(t, "round_trip", &r);
+
+    if (!keep) {
+        remove_tree(target);
+        unlink(archive);
+        remove_tree(root);
+    }
+}
+
+int main(int argc, char **argv) {
+    int scale = 1;
+    int option;
+    while ((option = getopt(argc, argv, "n:l:s:d:k")) != -1) {
+        switch (option) {
+        case 'n':
+            scale = atoi(optarg);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 's':
+            snprintf(serializeText, sizeof(serializeText), "%s", optarg);
+            split_args(optarg, serializeArgs);
+            break;
+        case 'd':
+            snprintf(deserializeText, sizeof(deserializeText), "%s", optarg);
+            split_args(optarg, deserializeArgs);
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            fprintf(stderr, "USAGE: %s [-n SCALE] [-l LABEL] [-s ARGS] [-d ARGS] [-k] BIN\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || scale < 1) {
+        fprintf(stderr, "USAGE: %s [-n SCALE] [-l LABEL] [-s ARGS] [-d ARGS] [-k] BIN\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    program = realpath(argv[optind], NULL);
+    if (program == NULL) {
+        die(argv[optind]);
+    }
+    chunk = malloc(CHUNK_SIZE);
+    if (chunk == NULL) {
+        die("malloc");
+    }
+
+    const char *tmp = getenv("TMPDIR");
+    char scratch[PATH_MAX];
+    snprintf(scratch, sizeof(scratch), "%s/transplant_bench.XXXXXX", tmp != NULL ? tmp : "/tmp");
+    if (mkdtemp(scratch) == NULL) {
+        die("mkdtemp");
+    }
+
+    struct tree trees[] = {
+        {"tiny", make_tiny},
+        {"huge", make_huge},
+        {"deep", make_deep},
+        {"wide", make_wide},
+        {"sparse", make_sparse},
+    };
+    for (size_t i = 0; i < sizeof(trees) / sizeof(trees[0]); i++) {
+        bench_tree(scratch, trees + i, scale);
+    }
+
+    if (keep) {
+        fprintf(stderr, "bench: kept %s\n", scratch);
+    } else {
+        remove_tree(scratch);
+    }
+    free(chunk);
+    free(program);
+    return EXIT_SUCCESS;
+}
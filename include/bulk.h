@@ -0,0 +1,93 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Bulk data path used for FILE_DATA payloads.
+ *
+ * Payload bytes are moved in large blocks rather than one character at a
+ * time.  When both ends are plain file descriptors the kernel is asked to
+ * move the bytes itself (copy_file_range(2), sendfile(2) or splice(2),
+ * whichever the descriptors allow), so the data never has to be copied
+ * into user space.  If none of those apply (for example the output is a
+ * terminal) the copy falls back to read(2)/write(2) on a block buffer.
+ */
+
+/*
+ * Size of the blocks used by the buffered fallback paths.
+ */
+#define BULK_BLOCK_SIZE (1 << 20)
+
+/*
+ * Payloads smaller than this are copied through stdio instead of flushing
+ * stdout and switching to the descriptor path, since for small files the
+ * extra write(2) for the flush would cost more than it saves.
+ */
+#define BULK_MIN_DIRECT (64 << 10)
+
+/*
+ * @brief  Copy exactly count bytes from one file descriptor to another.
+ * @details  Bytes are taken from the current offset of in_fd and written at
+ * the current offset of out_fd, both of which are advanced.  The zero-copy
+ * system calls are tried first and abandoned for the rest of the run as soon
+ * as the kernel reports that they are not supported for these descriptors.
+ *
+ * @param in_fd  The descriptor to read from.
+ * @param out_fd  The descriptor to write to.
+ * @param count  The number of bytes to copy.
+ * @return 0 in case of success, -1 if an I/O error occurs or in_fd reaches
+ * end of file before count bytes have been copied.
+ */
+int bulk_copy(int in_fd, int out_fd, off_t count);
+
+/*
+ * @brief  Copy exactly count bytes from a given offset of a regular file.
+ * @details  The bytes are written at the current offset of out_fd, which is
+ * advanced; the offset of in_fd is left alone.  Where offset and the offset
+ * of out_fd are both multiples of the block size of in_fd, the whole blocks
+ * are cloned with FICLONERANGE, so on file systems with shared extents
+ * (Btrfs, XFS) nothing is copied at all.  The rest is moved by
+ * copy_file_range(2), or through user space where that does not work.
+ *
+ * @param in_fd  The file to copy from.
+ * @param offset  Where in in_fd the bytes start.
+ * @param out_fd  The descriptor to write to.
+ * @param count  The number of bytes to copy.
+ * @return 0 in case of success, -1 if an I/O error occurs or in_fd ends
+ * before count bytes have been copied.
+ */
+int bulk_copy_range(int in_fd, off_t offset, int out_fd, off_t count);
+
+/*
+ * @brief  Copy exactly count bytes from one stdio stream to another.
+ * @details  The copy is done in BULK_BLOCK_SIZE blocks with fread(3) and
+ * fwrite(3), so it cooperates with any data already buffered in either stream.
+ *
+ * @param in  The stream to read from.
+ * @param out  The stream to write to.
+ * @param count  The number of bytes to copy.
+ * @return 0 in case of success, -1 if an I/O error occurs or in reaches
+ * end of file before count bytes have been copied.
+ */
+int bulk_stream_copy(FILE *in, FILE *out, off_t count);
+
+/*
+ * @brief  Write all of a buffer to a file descriptor, retrying short writes.
+ *
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int bulk_write(int fd, const void *buf, size_t len);
+
+/*
+ * @brief  Read exactly count bytes from a descriptor that cannot seek and drop them.
+ * @details  A pipe is spliced into /dev/null, so the bytes are never copied
+ * into user space; anything else is read into the block buffer.
+ *
+ * @return 0 in case of success, -1 if an I/O error occurs or fd reaches end
+ * of file first.
+ */
+int bulk_discard(int fd, off_t count);
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Checkpoints for resuming an interrupted run, selected with --resume FILE.
+ *
+ * Every CHECKPOINT_BYTES of stream or CHECKPOINT_ENTRIES entries, once the
+ * regular file just handled is complete, the run records in FILE how many
+ * DIRECTORY_ENTRY records of the stream are behind it, the pathname of the
+ * last of them, and for -s where in the output the stream stands.  The file
+ * holds a single line:
+ *
+ *   transplant-checkpoint KIND ENTRIES BASE TOTAL CRC LENGTH PATH
+ *
+ * KIND is `s' or `d' for the run that wrote it, BASE the offset of the
+ * output at which the stream starts, TOTAL the bytes of stream written (-s)
+ * or of file contents restored (-d), CRC the checksum of the stream so far
+ * if it has one, in hexadecimal, and PATH the pathname relative to the
+ * serialized directory, exactly LENGTH bytes long.  It is replaced by
+ * renaming, so it is always whole, and removed when the run completes.
+ *
+ * A run started again with the same FILE walks the stream or the tree the
+ * same way, and the entries before the checkpoint are replayed rather than
+ * done again: -d skips their contents, seeking over them where the input
+ * allows, and -s does not read them.  The last of them has to have the
+ * recorded pathname, or the stream or the tree is not the one the
+ * checkpoint was made for and the run fails.
+ *
+ * -s carries on the stream in its output, cut back to where the checkpoint
+ * was made, when the output is a regular file holding that much of it, so
+ * the result is the stream an uninterrupted run would have written.  Failing
+ * that, or from a checkpoint made by -d, it sends the whole tree again with
+ * UNCHANGED records in place of the contents sent before.
+ *
+ * Checkpoints guard against the program being stopped, not against the
+ * machine losing power: nothing is synced to disk for them.
+ */
+
+/*
+ * How often a checkpoint is made, in bytes of stream and in entries,
+ * whichever comes first.
+ */
+#define CHECKPOINT_BYTES (256 << 20)
+#define CHECKPOINT_ENTRIES 10000
+
+/*
+ * Kinds of run.
+ */
+#define CHECKPOINT_SERIALIZE 's'
+#define CHECKPOINT_DESERIALIZE 'd'
+
+/*
+ * Where a run stood.
+ */
+struct checkpoint {
+    int kind;
+    uint64_t entries;
+    uint64_t base;
+    uint64_t total;
+    uint32_t crc;
+};
+
+/*
+ * @brief  Start keeping checkpoints in a file, loading the one already there.
+ *
+ * @param file  The pathname of the checkpoint file.
+ * @param resume  Filled in with the checkpoint found, if any.
+ * @return 1 if a checkpoint was loaded, 0 if there was none, -1 if the file
+ * cannot be read or is malformed.
+ */
+int checkpoint_open(char *file, struct checkpoint *resume);
+
+/*
+ * @brief  Tell whether an entry is to be replayed.
+ *
+ * @param index  The number of DIRECTORY_ENTRY records before it in the stream.
+ * @param path  Its pathname relative to the serialized directory.
+ * @param length  The number of bytes in path.
+ * @return 1 if the entry was done before the checkpoint, 0 if it was not, -1
+ * if it is the last one done but its pathname is not the one recorded.
+ */
+int checkpoint_replay(uint64_t index, const char *path, size_t length);
+
+/*
+ * @brief  Count the bytes toward the next checkpoint from zero.
+ * @details  checkpoint_open() takes the total of a checkpoint it loads as
+ * that of the last one made, for a run that carries it on.  A run that starts
+ * its count over instead, as -s does when it sends the whole tree again,
+ * calls this after it.
+ */
+void checkpoint_restart();
+
+/*
+ * @brief  Tell whether it is time for another checkpoint.
+ *
+ * @param entries  The number of DIRECTORY_ENTRY records done.
+ * @param total  The bytes of stream (-s) or file contents (-d) done,
+ * including those done before a checkpoint resumed from.
+ * @return 1 if checkpoint_save() should be called, 0 otherwise.
+ */
+int checkpoint_due(uint64_t entries, uint64_t total);
+
+/*
+ * @brief  Record a checkpoint.
+ *
+ * @param state  Where the run stands.
+ * @param path  The pathname of the last entry done, relative to the
+ * serialized directory.
+ * @param length  The number of bytes in path.
+ * @return 0 in case of success, -1 if the file cannot be written.
+ */
+int checkpoint_save(struct checkpoint *state, const char *path, size_t length);
+
+/*
+ * @brief  Stop keeping checkpoints.
+ *
+ * @param success  Nonzero if the run completed, in which case the checkpoint
+ * file is removed.  Otherwise it is left for the next run to resume from.
+ */
+void checkpoint_finish(int success);
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct hash_state;
+
+/*
+ * Compressed file contents, selected with -s -z.
+ *
+ * The contents of a regular file are cut into blocks of COMPRESS_BLOCK_SIZE
+ * bytes, each compressed on its own with a built-in LZ77 codec in the style
+ * of LZ4, and emitted as a run of COMPRESSED_BLOCK records in place of the
+ * FILE_DATA record (see format.h).  Since blocks are independent they
+ * can be produced by different threads and decoded as they arrive.  In a
+ * checksummed stream the run is followed by the CHECKSUM record of the file,
+ * whose CRC is that of the contents as they were before compression.
+ */
+
+/*
+ * Number of bytes of file contents in every block except the last.
+ */
+#define COMPRESS_BLOCK_SIZE (64 << 10)
+
+/*
+ * Size of the raw length at the start of a COMPRESSED_BLOCK record's data.
+ */
+#define BLOCK_LENGTH_SIZE 4
+
+/*
+ * @brief  Compress a block with the built-in codec.
+ *
+ * @param src  The bytes to compress, at most COMPRESS_BLOCK_SIZE of them.
+ * @param length  The number of bytes in src.
+ * @param dst  Where to put the compressed bytes, with room for length of them.
+ * @return The size of the compressed block, or 0 if it would not be smaller
+ * than length.
+ */
+size_t lz_compress(const char *src, size_t length, char *dst);
+
+/*
+ * @brief  Decompress a block made by lz_compress().
+ *
+ * @param src  The compressed bytes.
+ * @param length  The number of bytes in src.
+ * @param dst  Where to put the bytes.
+ * @param capacity  The number of bytes dst has room for.
+ * @return The number of bytes produced, or -1 if the block is malformed.
+ */
+long lz_decompress(const char *src, size_t length, char *dst, size_t capacity);
+
+/*
+ * @brief  Largest number of bytes compress_records() can produce.
+ */
+size_t compress_bound(size_t length);
+
+/*
+ * @brief  Encode file contents held in memory as COMPRESSED_BLOCK records.
+ *
+ * @param data  The contents, which must start on a block boundary of the file.
+ * @param length  The number of bytes in data; if more contents follow it must
+ * be a multiple of COMPRESS_BLOCK_SIZE.
+ * @param depth  The depth of the records.
+ * @param last  Nonzero if data runs to the end of the file, so that the run
+ * of records is terminated.
+ * @param out  Where to put the records, with room for compress_bound(length).
+ * @return The number of bytes of records produced.
+ */
+size_t compress_records(const char *data, size_t length, uint32_t depth, int last, char *out);
+
+/*
+ * @brief  Emit the rest of a file as COMPRESSED_BLOCK records.
+ *
+ * @param fd  The file, positioned on a block boundary.
+ * @param length  The number of bytes left in the file.
+ * @param depth  The depth of the records.
+ * @param state  A content hash to add the bytes to, or NULL.
+ * @param crc  The CRC-32C of the contents before the block boundary, which
+ * the CHECKSUM record after the run carries on from, 0 at the start.
+ * @return 0 in case of success, -1 if an I/O error occurs or the file ends
+ * early.
+ */
+int put_compressed(int fd, off_t length, uint32_t depth, struct hash_state *state, uint32_t crc);
+
+/*
+ * @brief  Emit file contents held in memory as COMPRESSED_BLOCK records.
+ *
+ * @param data  The whole of the file.
+ * @param length  The number of bytes in data.
+ * @param depth  The depth of the records.
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int put_compressed_data(const char *data, size_t length, uint32_t depth);
+
+/*
+ * @brief  Read the next COMPRESSED_BLOCK record and decode it.
+ *
+ * @param depth  The depth the record must have.
+ * @param data  Set to the decoded bytes, valid until the next call into the
+ * reader or this function.  May be NULL if the bytes are not wanted, in which
+ * case they are not decoded unless the stream is being checked.  Then the
+ * last block of the run is also checked against the CHECKSUM record after
+ * it, which is read too.
+ * @param last  Set to nonzero if this block ends the run.
+ * @return The number of decoded bytes, or -1 if the record is malformed or
+ * the input ends.
+ */
+long read_block(uint32_t depth, char **data, int *last);
+
+/*
+ * @brief  Read a whole run of COMPRESSED_BLOCK records.
+ * @details  The decoded contents are written to fd, or copied to dest, or
+ * if fd is -1 and dest is NULL just skipped.
+ *
+ * @param depth  The depth the records must have.
+ * @param fd  A descriptor to write the contents to, or -1.
+ * @param dest  Memory to copy the contents to, or NULL.
+ * @param capacity  The number of bytes dest has room for.
+ * @return The number of bytes in the file, or -1 if a record is malformed,
+ * the input ends, an I/O error occurs or dest is too small.
+ */
+long restore_blocks(uint32_t depth, int fd, char *dest, size_t capacity);
+
+#endif
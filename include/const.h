@@ -17,16 +17,96 @@
 
 #define USAGE(program_name, retcode) do { \
 fprintf(stderr, "USAGE: %s %s\n", program_name, \
-"[-h] -s|-d [-c] [-p DIR]\n" \
+"[-h] -s|-d|-l|-V [-c] [-p DIR] [-j N] [-a] [--stats] [--progress] [--resume FILE] [-x] [-o ORDER] [-z] [-u] [-H] [-S] [-k] [--align] [--nocache] [--direct] [--readahead N] [-L] [-m FILE] [-b FILE] [-i FILE] [--only PATH...]\n" \
 "   -h       Help: displays this help menu.\n" \
 "   -s       Serialize: traverse tree of files, output serialized data.\n" \
 "   -d       Deserialize: read serialized data, reconstruct tree of files.\n" \
+"   -l       List: print the mode, size and pathname of every entry of serialized\n" \
+"            data without restoring it, skipping over the contents of files.\n" \
+"   -V       Verify: check serialized data without restoring it, its structure,\n" \
+"            the sizes of files and any checksums.  Given with -l, also list it.\n" \
+"            -l and -V take -i FILE, --stats and --progress as -d does.\n" \
 "            Optional additional parameter for both -s and -d:\n" \
 "               -p DIR       DIR is a pathname that specifies the source directory\n" \
 "                            for serialization or the target directory for deserialization.\n" \
 "                            If this parameter is not present, the pathname `.`\n" \
 "                            (referring to the current working directory) is assumed.\n" \
-"            Optional additional parameter for -d:\n" \
+"               -j N         Use N worker threads.  With -s they read file contents\n" \
+"                            concurrently and the output is identical to that of a\n" \
+"                            single-threaded run; with -d they create and write the\n" \
+"                            restored files while the input is still being parsed.\n" \
+"               -a           Batch file system operations through io_uring: with -s\n" \
+"                            the entries of a directory are stat'ed together and small\n" \
+"                            files read ahead; with -d directories are created, and\n" \
+"                            small files created and written, without waiting for\n" \
+"                            each.  Falls back to the ordinary system calls where\n" \
+"                            io_uring is unavailable.\n" \
+"               --stats      Print on the standard error, at the end, the records\n" \
+"                            by type, the bytes and files processed, and the time\n" \
+"                            spent walking, on metadata, reading, writing and copying.\n" \
+"               --progress   Print the files, bytes and throughput so far on the\n" \
+"                            standard error every second while the run lasts.\n" \
+"               --resume FILE  Keep checkpoints in FILE, and if an interrupted run\n" \
+"                            left one there, carry on from it: -d skips the files\n" \
+"                            already restored and overwrites the rest; -s appends\n" \
+"                            to the stream in its output if that is a file it can\n" \
+"                            cut back (open it with >>), and otherwise sends the\n" \
+"                            tree again without the contents already sent, for\n" \
+"                            -d -c to apply.  Not with -x, -m or -b.  Use -o name\n" \
+"                            so that the tree is walked in the same order again.\n" \
+"            Optional additional parameters for -s:\n" \
+"               -x           Append an index of every entry to the output, so that\n" \
+"                            a reader can find an entry without parsing the stream.\n" \
+"               -o ORDER     Emit the entries of each directory sorted, ORDER being\n" \
+"                            `name' (bytewise, so identical trees serialize to\n" \
+"                            identical bytes) or `inode' (which reads files in\n" \
+"                            roughly their order on disk).\n" \
+"               -z           Compress the contents of files in independent blocks\n" \
+"                            with the built-in codec.  -d detects and decompresses\n" \
+"                            them without being told.\n" \
+"               -u           Store each distinct file content once: a file identical\n" \
+"                            to one already emitted is recorded as a reference to it.\n" \
+"               -H           Record further names of a file with several hard links\n" \
+"                            as links to the first, which -d recreates as hard links.\n" \
+"                            Without it every name carries the contents in full.\n" \
+"               -S           Send only the data of files with holes, which -d\n" \
+"                            restores with the holes again.  Without it the holes\n" \
+"                            are sent as the zeros they read as.\n" \
+"               -k           Add a CRC-32C of the contents of each file and of the\n" \
+"                            whole stream, which -d checks without being told.\n" \
+"               --align      Start the contents of each file of 64 KiB or more on a\n" \
+"                            4 KiB boundary of the output.  -d -i FILE then copies\n" \
+"                            them out of FILE within the file system, which shares\n" \
+"                            the blocks instead where it can (Btrfs, XFS).\n" \
+"               --nocache    Read files without leaving them in the page cache, so\n" \
+"                            that serializing a large tree does not evict the data\n" \
+"                            of other programs.\n" \
+"               --direct     Read files of 1 MiB or more with O_DIRECT, bypassing\n" \
+"                            the page cache entirely; smaller ones as with --nocache.\n" \
+"               --readahead N  Read N MiB ahead with --nocache or --direct (default 8).\n" \
+"               -m FILE      Write a manifest of what was serialized to FILE.\n" \
+"               -b FILE      Serialize incrementally against the manifest FILE of an\n" \
+"                            earlier run: only new and changed files have their\n" \
+"                            contents emitted, and removed entries are recorded.\n" \
+"                            Restore the result with -d -c over that run's tree.\n" \
+"                            -j cannot be combined with -u, -m, -b or --resume.\n" \
+"            Optional additional parameters for -d:\n" \
+"               -i FILE      Read the serialized data from FILE instead of the\n" \
+"                            standard input.  Regular files, including a redirected\n" \
+"                            standard input, are memory-mapped rather than read.\n" \
+"               --only PATH...  Restore only the entries named by the PATHs, which\n" \
+"                            are relative to the serialized directory and may use\n" \
+"                            shell wildcards.  Naming a directory restores all of it.\n" \
+"                            The data of other files is skipped, not written, and\n" \
+"                            with -i FILE written by -s -x, PATHs without wildcards\n" \
+"                            are found through its index instead of by reading.  A\n" \
+"                            hard link, or a file stored once with -u, is restored\n" \
+"                            only if the earlier name it refers to is selected too.\n" \
+"               -L           Restore a file recorded as a reference by hard-linking\n" \
+"                            the earlier file when their modes agree, not copying it.\n" \
+"               --nocache    Push restored files to disk as they are written and drop\n" \
+"                            them from the page cache once they are there, so that a\n" \
+"                            large restore does not evict everything else cached.\n" \
 "               -c           ``clobber'': the program will overwrite existing files,\n" \
 "                            rather than terminating with an error, and it will ignore\n" \
 "                            errors that result when attempts is made to create directories\n" \
@@ -35,10 +115,40 @@ exit(retcode); \
 } while(0)
 
 /* Options info, set by validargs. */
-int global_options;
+extern int global_options;
 
 /*
- * The following variables have been provided for you.
+ * Bits of global_options for -j and for the -s options whose state only the
+ * single-threaded serializer keeps, which validargs does not let -j go with.
+ */
+#define OPTION_JOBS 0x10
+#define OPTION_MANIFEST 0x100
+#define OPTION_BASE 0x200
+#define OPTION_DEDUP 0x800
+#define OPTION_BY_NAME 0x4000
+#define OPTION_BY_INODE 0x8000
+#define OPTION_RESUME 0x400000
+#define OPTION_SERIAL_ONLY (OPTION_MANIFEST | OPTION_BASE | OPTION_DEDUP | OPTION_RESUME)
+
+/* Number of worker threads selected with -j, set by validargs. */
+extern int worker_count;
+
+/* Bytes read ahead with --nocache or --direct, set by validargs. */
+extern size_t read_window;
+
+/* File named with -i, or NULL to read standard input, set by validargs. */
+extern char *input_path;
+
+/* Checkpoint file named with --resume, or NULL, set by validargs. */
+extern char *checkpoint_path;
+
+/* Manifests named with -m and -b, or NULL, set by validargs. */
+extern char *manifest_path;
+extern char *base_path;
+
+/*
+ * The following variables have been provided for you, and are defined in
+ * const.c so that every file including this one shares a single copy.
  * You MUST use them for their stated purposes, because you are not permitted
  * to declare any arrays (or use any array brackets at all) in your own code.
  */
@@ -46,7 +156,7 @@ int global_options;
 /*
  * Buffer to hold a pathname component read from stdin.
  */
-char name_buf[NAME_MAX];
+extern char name_buf[NAME_MAX];
 
 /*
  * Buffer to hold the pathname of the current file or directory,
@@ -54,13 +164,13 @@ char name_buf[NAME_MAX];
  * (starting with '/') or a relative path (not starting with '/').
  * relative path.
  */
-char path_buf[PATH_MAX];
+extern char path_buf[PATH_MAX];
 
 /*
  * Current length of the path in path_buf, not including the terminating
  * null byte.
  */
-int path_length;
+extern int path_length;
 
 /*
  * Below this line are specifications for functions that MUST occur in your program.
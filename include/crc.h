@@ -0,0 +1,58 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C (the Castagnoli polynomial, as used by iSCSI and ext4), used to
+ * check serialized data for corruption.
+ *
+ * The CRC instructions of SSE4.2 or ARMv8 are used when the processor has
+ * them, running three independent lanes of CRC_LANE_SIZE bytes each so that
+ * the latency of one instruction is hidden behind the other two, and the
+ * lanes are then joined as crc32c_combine() does.  Elsewhere a table-driven
+ * version that handles eight bytes per step is used.  All of them give the
+ * same results.
+ */
+
+/*
+ * Bytes given to each lane.  Pieces shorter than three lanes are done in a
+ * single one.
+ */
+#define CRC_LANE_SIZE (16 << 10)
+
+/*
+ * @brief  Extend a CRC with more data.
+ * @details  crc32c(crc32c(0, a, m), b, n) equals the CRC of a followed by b.
+ *
+ * @param crc  The CRC of the data so far, or 0 to start a new one.
+ * @param data  The next bytes.
+ * @param length  The number of bytes.
+ * @return The CRC of the data so far followed by these bytes.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+/*
+ * @brief  Join the CRCs of two pieces of data that follow each other.
+ * @details  Takes time proportional to the logarithm of length, without
+ * looking at the data again.
+ *
+ * @param first  The CRC of the first piece.
+ * @param second  The CRC of the second piece, started from 0.
+ * @param length  The number of bytes in the second piece.
+ * @return The CRC of the two pieces one after the other.
+ */
+uint32_t crc32c_combine(uint32_t first, uint32_t second, uint64_t length);
+
+/*
+ * @brief  Extend a CRC with zero bytes, as for a hole in a file.
+ * @details  Takes time proportional to the logarithm of length.
+ *
+ * @param crc  The CRC of the data so far, or 0 to start a new one.
+ * @param length  The number of zero bytes.
+ * @return The CRC of the data so far followed by length zero bytes.
+ */
+uint32_t crc32c_zeros(uint32_t crc, uint64_t length);
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Deduplication of file contents, selected with -s -u.
+ *
+ * Every regular file whose contents are emitted is remembered by its size
+ * and content hash, together with its pathname.  A later file of a size
+ * that has been seen is hashed before it is emitted, and if an earlier file
+ * has the same size and hash, and the two compare equal byte for byte, a
+ * REFERENCE record naming the earlier file is emitted instead of the
+ * contents (see format.h).  Files of a size not seen before cannot be
+ * duplicates, so they are read only once, hashed on their way out.
+ *
+ * Memory is bounded: once DEDUP_TABLE_MAX contents or DEDUP_NAMES_MAX bytes
+ * of pathnames are remembered, later files are still matched against them
+ * but no longer remembered themselves.
+ *
+ * On the reading side a REFERENCE is restored by copying the earlier file,
+ * which the kernel may do by sharing extents, or with -d -L by hard-linking
+ * it when the two modes agree.  The earlier file has to have been restored,
+ * so with --only a reference is skipped unless its file is selected too.
+ */
+
+/*
+ * Most file contents, and separately most hard-linked files, remembered.
+ */
+#define DEDUP_TABLE_MAX (1 << 19)
+
+/*
+ * Most bytes of pathnames remembered.
+ */
+#define DEDUP_NAMES_MAX (64 << 20)
+
+/*
+ * @brief  Start remembering file contents.
+ *
+ * @param root  The serialized directory, which pathnames are relative to.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int dedup_begin(const char *root);
+
+/*
+ * @brief  Look for an earlier file with the same contents as an open file.
+ * @details  A reference is only worth it if it is smaller than the contents,
+ * so earlier files with pathnames no shorter than size are not returned.
+ *
+ * @param fd  The file, which is read with pread(2) only.
+ * @param size  The size of the file.
+ * @param hash  Set to the content hash of the file if a match is found.
+ * @param original  Set to the pathname of the earlier file, which stays valid
+ * until dedup_end().
+ * @param originalLength  Set to the length of that pathname.
+ * @return 1 if a match was found, 0 if not, -1 if an I/O error occurs.
+ */
+int dedup_find(int fd, off_t size, uint64_t *hash, const char **original, size_t *originalLength);
+
+/*
+ * @brief  Remember the contents of a file that has just been emitted.
+ * @details  Does nothing before dedup_begin() or once memory is used up.
+ *
+ * @param size  The size of the file.
+ * @param hash  The content hash of the file.
+ * @param path  The pathname relative to the serialized directory.
+ * @param length  The number of bytes in path.
+ */
+void dedup_add(off_t size, uint64_t hash, const char *path, size_t length);
+
+/*
+ * Hard links.  Every regular file with more than one link is remembered by
+ * device and inode number under the pathname it was first seen at, and later
+ * sightings are emitted as HARD_LINK records naming that pathname, so that
+ * the contents are emitted and restored only once.  This is always done,
+ * with or without -u, under the same limits on memory, and as with -u the
+ * earlier pathname has to be restored for a link to it to be.
+ */
+
+/*
+ * @brief  Look for an earlier pathname of a file with several links.
+ *
+ * @param dev  The device the file is on.
+ * @param ino  The inode number of the file.
+ * @param original  Set to the earlier pathname, which stays valid until the
+ * next dedup_link_add() or dedup_end().
+ * @param originalLength  Set to the length of that pathname.
+ * @param hash  Set to the content hash given when it was remembered.
+ * @return 1 if the file was seen before, 0 if not.
+ */
+int dedup_link_find(dev_t dev, ino_t ino, const char **original, size_t *originalLength, uint64_t *hash);
+
+/*
+ * @brief  Remember the pathname of a file with several links.
+ * @details  Does nothing if the file is already remembered or memory is
+ * used up.
+ *
+ * @param dev  The device the file is on.
+ * @param ino  The inode number of the file.
+ * @param hash  The content hash of the file, or 0 if it is not known.
+ * @param path  The pathname relative to the serialized directory.
+ * @param length  The number of bytes in path.
+ */
+void dedup_link_add(dev_t dev, ino_t ino, uint64_t hash, const char *path, size_t length);
+
+/*
+ * @brief  Forget everything remembered.
+ */
+void dedup_end();
+
+/*
+ * @brief  Restore a file from the REFERENCE or HARD_LINK record being read.
+ * @details  Reads the pathname that follows the header, which must not be
+ * absolute or contain "..", and creates path as a hard link to that file, or
+ * with a copy of its contents if it cannot be linked, following the same
+ * rules as deserialize_file(), including the ``clobber'' option.  A
+ * REFERENCE is only linked with -L and when the file already has the
+ * permission bits of mode.  Nothing is created if the earlier file is
+ * outside the --only selection, as it has not been restored.
+ *
+ * @param path  The pathname of the file to create.
+ * @param rootLength  The length of the target directory's name in path.
+ * @param type  The type of the record.
+ * @param nameLength  The length of the pathname in the record.
+ * @param mode  The permission bits the file is to have.
+ * @return 0 in case of success, 1 if the earlier file was not selected, -1
+ * otherwise.
+ */
+int dedup_restore(char *path, int rootLength, int type, uint64_t nameLength, mode_t mode);
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include "transplant.h"
+
+/*
+ * Records added to the serialized format described in transplant.h, by the
+ * options that write them.  Readers accept all of them whatever options
+ * they are given.
+ */
+#define INDEX 6
+#define INDEX_FOOTER 7
+#define UNCHANGED 8
+#define DELETED 9
+#define COMPRESSED_BLOCK 10
+#define REFERENCE 11
+#define HARD_LINK 12
+#define SPARSE_DATA 13
+#define CHECKSUM 14
+#define PADDING 15
+
+/*
+ * The number of record types in the extended format, NUM_RECORD_TYPES
+ * counting only the original ones.
+ */
+#define NUM_FORMAT_RECORD_TYPES 16
+
+/*
+ * The type byte earlier writers put in the END_OF_TRANSMISSION record, which
+ * is otherwise the same header-only record at depth 0.  Readers still accept
+ * it at the end of a stream.
+ */
+#define LEGACY_END_OF_TRANSMISSION 0x10
+
+/*
+ * Incremental serializations, made against the manifest of an earlier run,
+ * describe changes to be applied on top of the tree that run restored.  They
+ * use two more kinds of record:
+ *
+ * An UNCHANGED record takes the place of the FILE_DATA record after the
+ * DIRECTORY_ENTRY of a regular file whose contents have not changed.  It
+ * consists only of a header, at the same depth as the FILE_DATA record would
+ * have been, and tells the reader to keep the file that is already there.
+ *
+ * A DELETED record may occur wherever a DIRECTORY_ENTRY record may.  Its data
+ * is the name of an entry of the current directory, which is to be removed
+ * together with anything below it.  A DELETED record also precedes the
+ * DIRECTORY_ENTRY of an entry that has changed between file and directory.
+ */
+
+/*
+ * Compressed serializations replace the FILE_DATA record of a regular file
+ * with a run of COMPRESSED_BLOCK records at the same depth.  The data of each
+ * is a 4-byte big-endian count of the file bytes the block stands for,
+ * followed by those bytes compressed.  If the compressed form would not be
+ * smaller the bytes are stored as they are, which a reader recognises by the
+ * stored size being equal to the count.  Every block but the last stands for
+ * exactly 65536 bytes of the file; the last stands for fewer, possibly none,
+ * and so ends the run.  The st_size in the DIRECTORY_ENTRY is that of the
+ * original file.
+ */
+
+/*
+ * A SPARSE_DATA record takes the place of the FILE_DATA record of a regular
+ * file with holes and carries only the parts of it that hold data.  It is only
+ * written when asked for (-s -S).  Its data is:
+ *
+ *   8 bytes: the size of the file.
+ *   8 bytes: the number of data extents, N.
+ *   N extents of 16 bytes each: the offset and the length of the extent.
+ *   The contents of the extents, one after another.
+ *
+ * The extents are in increasing order of offset and do not overlap.  All
+ * other bytes of the file are zero.  All fields are big-endian.
+ */
+
+/*
+ * Deduplicated serializations replace the FILE_DATA record of a regular file
+ * whose contents were already emitted with a REFERENCE record at the same
+ * depth.  Its data is the pathname of the earlier file, relative to the
+ * serialized directory with components separated by '/', without a
+ * terminator.  The earlier file precedes the reference in the stream, so a
+ * reader restoring the tree in order has always written it by then.
+ *
+ * A HARD_LINK record has the same form.  It takes the place of the FILE_DATA
+ * record of a regular file that is another link to the same file as the
+ * earlier pathname, and tells the reader to recreate it with link(2).
+ * Serializers only write it when asked to (-s -H); otherwise each name of
+ * the file carries its contents, as in the original format.
+ */
+
+/*
+ * A PADDING record may occur wherever a DIRECTORY_ENTRY record may, at the
+ * same depth.  Its data means nothing and is skipped.  Serializers use it to
+ * make the contents of the file whose entry follows start at a block
+ * boundary of the stream, so that a reader with the stream in a file can
+ * have the file system share those blocks with the restored file instead
+ * of copying them.
+ */
+
+/*
+ * Checksummed serializations begin with a START_OF_TRANSMISSION record whose
+ * data is a 4-byte big-endian word of flags, with STREAM_CHECKSUMS set.  In
+ * them every FILE_DATA record, run of COMPRESSED_BLOCK records and
+ * SPARSE_DATA record is followed by a CHECKSUM record at the same depth,
+ * whose data is the CRC-32C of the contents of the file as they are restored,
+ * before compression and with any holes read as zeros, and the
+ * END_OF_TRANSMISSION record carries the CRC-32C of every byte between the
+ * end of the START_OF_TRANSMISSION record and its own start.  Both CRCs are
+ * 4 bytes, big-endian.  Flags that a reader does not know make it reject the
+ * stream.
+ */
+#define STREAM_FLAGS_SIZE 4
+#define STREAM_CHECKSUMS 0x1
+#define CHECKSUM_SIZE 4
+
+/*
+ * Optional records that follow the outermost END_OF_DIRECTORY record and
+ * precede END_OF_TRANSMISSION.  A reader that does not know them can stop at
+ * the END_OF_DIRECTORY record, as the tree is complete at that point.
+ *
+ * An INDEX record (depth 0) lists every DIRECTORY_ENTRY in the stream,
+ * sorted bytewise by pathname, so that a reader with random access can find
+ * an entry by binary search.  Its data is:
+ *
+ *   8 bytes: the number of entries, N.
+ *   N slots of INDEX_SLOT_SIZE bytes each:
+ *     8 bytes: offset in the stream of the DIRECTORY_ENTRY record.
+ *     8 bytes: size of the contents of a regular file, as its FILE_DATA,
+ *       COMPRESSED_BLOCK or SPARSE_DATA records give them, or 0 if there
+ *       are none (a directory, or an UNCHANGED, REFERENCE or HARD_LINK).
+ *     8 bytes: offset of the pathname within the name area below.
+ *     4 bytes: size of the DIRECTORY_ENTRY record.
+ *     4 bytes: length of the pathname.
+ *   The name area: the pathnames, relative to the serialized directory with
+ *   components separated by '/', without terminators.
+ *
+ * An INDEX_FOOTER record (depth 0, size INDEX_FOOTER_SIZE) immediately
+ * precedes END_OF_TRANSMISSION, so it always starts INDEX_FOOTER_SIZE +
+ * HEADER_SIZE bytes from the end of the stream, or CHECKSUM_SIZE bytes more
+ * if the stream is checksummed.  Its data is the offset and
+ * the size of the INDEX record.  All fields are big-endian.
+ */
+#define INDEX_SLOT_SIZE 32
+#define INDEX_FOOTER_SIZE 32
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Streaming 64-bit content hash (XXH64 with seed 0), used to recognise file
+ * contents that have been seen before.  Data can be fed in pieces of any
+ * size and the result is the same as hashing it in one go.
+ */
+
+struct hash_state {
+    uint64_t lanes[4];
+    uint64_t total;
+    unsigned char pending[32];
+    size_t pendingLength;
+};
+
+/*
+ * @brief  Start a new hash.
+ */
+void hash_init(struct hash_state *state);
+
+/*
+ * @brief  Add length bytes of data to the hash.
+ */
+void hash_update(struct hash_state *state, const void *data, size_t length);
+
+/*
+ * @brief  Return the hash of everything added so far.
+ */
+uint64_t hash_final(const struct hash_state *state);
+
+/*
+ * @brief  Hash the first size bytes of an open file.
+ * @details  The file is read with pread(2), so its offset is left alone.
+ *
+ * @param fd  The file to hash.
+ * @param size  The number of bytes to hash.
+ * @param hash  Set to the hash of those bytes.
+ * @return 0 in case of success, -1 if an I/O error occurs or the file is
+ * shorter than size.
+ */
+int hash_fd(int fd, off_t size, uint64_t *hash);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef HELPERS_H
+#define HELPERS_H
+
+/*
+ * Small helpers shared by the serializer and deserializer modules.
+ */
+
+// Compare two strings (0 for same, -1 for not)
+int stringCompare(char *string1, char *string2);
+
+// Length of a string including its null terminator
+int stringLength(char *string1);
+
+// Parse a non-negative decimal number (-1 if not a number)
+long stringToLong(char *string1);
+
+#endif
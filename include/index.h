@@ -0,0 +1,93 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Archive index (table of contents), selected with -s -x.
+ *
+ * While an index is being built the record writer reports every
+ * DIRECTORY_ENTRY it emits, together with its offset in the output, and
+ * the size of the contents that follow it.  The pathname of each entry is
+ * reconstructed from the depths and names seen so far, so the serial and
+ * the multi-threaded serializers are covered alike.  At the end the entries are sorted by pathname and
+ * written as an INDEX record followed by an INDEX_FOOTER record, as described
+ * in format.h.
+ *
+ * On the reading side index_load() finds the footer from the end of a
+ * seekable archive and reads just the index, after which index_find() looks
+ * up a pathname by binary search.  -d --only uses it to go straight to the
+ * selected entries.
+ */
+
+/*
+ * Location of one entry, as found in the index.
+ */
+struct index_entry {
+    uint64_t entry_offset;
+    uint64_t data_size;
+    uint32_t entry_size;
+};
+
+/*
+ * @brief  Start collecting index entries from the record writer.
+ *
+ * @return 0 in case of success, -1 otherwise.
+ */
+int index_begin();
+
+/*
+ * @brief  Note a DIRECTORY_ENTRY record about to be written.
+ * @details  Does nothing unless index_begin() has been called.
+ *
+ * @param depth  The depth of the record.
+ * @param name  The name in the record, without a terminator.
+ * @param nameLength  The number of bytes in name.
+ * @param offset  The offset of the record in the output.
+ * @param size  The size of the record.
+ * @return 0 in case of success, -1 if memory runs out.
+ */
+int index_add(uint32_t depth, const char *name, size_t nameLength, uint64_t offset, uint32_t size);
+
+/*
+ * @brief  Note the size of the contents of the latest entry.
+ * @details  Called for FILE_DATA by the record writer and for compressed
+ * and sparse contents by their writers, with the size of the file they
+ * restore rather than of the records.
+ */
+void index_data(uint64_t size);
+
+/*
+ * @brief  Emit the INDEX and INDEX_FOOTER records and stop collecting.
+ * @details  Does nothing unless index_begin() has been called.
+ *
+ * @return 0 in case of success, -1 otherwise.
+ */
+int index_finish();
+
+/*
+ * @brief  Load the index of a seekable archive.
+ *
+ * @param fd  The archive, which is read with pread(2) only.
+ * @return 0 in case of success, -1 if the archive has no index or an I/O
+ * error occurs.
+ */
+int index_load(int fd);
+
+/*
+ * @brief  Look up a pathname in the loaded index.
+ *
+ * @param path  The pathname relative to the serialized directory.
+ * @param length  The number of bytes in path.
+ * @param entry  Filled in with the location of the entry.
+ * @return 0 if the pathname was found, -1 otherwise.
+ */
+int index_find(const char *path, size_t length, struct index_entry *entry);
+
+/*
+ * @brief  Release the loaded index.
+ */
+void index_unload();
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef LIST_H
+#define LIST_H
+
+/*
+ * Listing and verifying serialized data without restoring it, selected with
+ * -l and -V.
+ *
+ * The stream is walked record by record as -d walks it, but nothing is
+ * created.  -l prints a line for every entry on the standard output:
+ *
+ *   MODE SIZE PATH
+ *
+ * MODE in the form ls -l gives it, SIZE the st_size recorded for the entry
+ * and PATH its pathname relative to the serialized directory, followed for
+ * a regular file by what stands in for its contents when that is not the
+ * contents themselves: "-> PATH" for a hard link, "= PATH" for a file stored
+ * once with -u, or "unchanged" in an incremental stream.  Entries removed
+ * since the run an incremental stream was made against are listed as
+ * "deleted" in place of MODE and SIZE.
+ *
+ * Listing only reads the record headers, entry names and the maps of
+ * sparse files.  Contents are seeked over when the input is a file, even a
+ * checksummed one, and drained from a pipe into /dev/null without being
+ * copied out, so listing an archive on disk costs about one read per entry.
+ *
+ * -V checks the stream instead: the magic and nesting of every record, that
+ * names are single pathname components, that the contents of each regular
+ * file, whether whole, compressed or sparse, come to the size its entry
+ * records, and that the stream ends properly.  A checksummed stream has
+ * every byte read and checked against its checksums.  The first problem
+ * found is reported on the standard error with the pathname of the entry
+ * it is in.
+ */
+
+/*
+ * @brief  List or verify the serialized data read from the -i FILE, or from
+ * the standard input.
+ *
+ * @param print  Nonzero to print a line for every entry.
+ * @param verify  Nonzero to check the stream as a whole.
+ * @return 0 in case of success, -1 if the input cannot be read or the
+ * stream is malformed.
+ */
+int list_archive(int print, int verify);
+
+#endif
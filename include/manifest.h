@@ -0,0 +1,112 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Manifests for incremental serialization, selected with -s -m FILE and
+ * -s -b FILE.
+ *
+ * A manifest describes every entry a serialization emitted, one line each:
+ *
+ *   MODE SIZE MTIME_SEC MTIME_NSEC INODE HASH LENGTH PATH
+ *
+ * MODE is octal, HASH is the 16-digit hexadecimal content hash of a regular
+ * file (0 for a directory) and the other numbers are decimal.  PATH is the
+ * pathname relative to the serialized directory, exactly LENGTH bytes long
+ * and followed by a newline, so it may contain any byte.
+ *
+ * A later run given the manifest as its base emits UNCHANGED in place of the
+ * contents of regular files whose metadata still match, or whose contents
+ * still hash the same, and DELETED for entries that have gone.
+ */
+
+/*
+ * An entry of the base manifest.
+ */
+struct manifest_entry {
+    mode_t mode;
+    off_t size;
+    int64_t mtime_sec;
+    long mtime_nsec;
+    uint64_t ino;
+    uint64_t hash;
+    const char *path;
+    size_t path_length;
+    size_t parent_length;
+    int seen;
+};
+
+/*
+ * @brief  Load the manifest of an earlier run to serialize against.
+ *
+ * @param file  The pathname of the manifest.
+ * @return 0 in case of success, -1 if it cannot be read or is malformed.
+ */
+int manifest_load(char *file);
+
+/*
+ * @brief  Look up an entry of the base manifest.
+ *
+ * @param path  The pathname relative to the serialized directory.
+ * @param length  The number of bytes in path.
+ * @return The entry, or NULL if there is none or no manifest was loaded.
+ */
+struct manifest_entry *manifest_find(const char *path, size_t length);
+
+/*
+ * @brief  Check whether a regular file still has the contents recorded.
+ * @details  Matching mode, size, modification time and inode number are taken
+ * as proof.  If only the time or inode differ the file is hashed and compared.
+ *
+ * @param entry  The entry of the base manifest.
+ * @param stat_buf  The current metadata of the file.
+ * @param path  The pathname to open the file by.
+ * @return 1 if the contents are unchanged, 0 otherwise.
+ */
+int manifest_unchanged(struct manifest_entry *entry, struct stat *stat_buf, char *path);
+
+/*
+ * @brief  Emit DELETED records for the entries of a directory not seen again.
+ *
+ * @param dir  The pathname of the directory relative to the serialized one,
+ * empty for the serialized directory itself.
+ * @param dirLength  The number of bytes in dir.
+ * @param depth  The depth of the records.
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int manifest_emit_deleted(const char *dir, size_t dirLength, uint32_t depth);
+
+/*
+ * @brief  Start writing the manifest of this run.
+ *
+ * @param file  The pathname of the manifest, which is replaced.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int manifest_create(char *file);
+
+/*
+ * @brief  Add an entry to the manifest being written.
+ * @details  Does nothing unless manifest_create() has been called.
+ *
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int manifest_add(const char *path, size_t length, struct stat *stat_buf, uint64_t hash);
+
+/*
+ * @brief  Finish the manifest being written.
+ *
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int manifest_close();
+
+/*
+ * @brief  Remove a file or directory together with anything below it.
+ *
+ * @return 0 if it is gone, including if it was never there, -1 otherwise.
+ */
+int remove_tree(char *path);
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/*
+ * Multi-threaded serialization and deserialization, selected with -j N.
+ *
+ * Serialization:
+ *
+ * A walker thread traverses the tree in the same depth-first order as
+ * serialize_directory(), stat'ing entries ahead of the output, while a pool
+ * of workers opens regular files and reads their contents into bounded
+ * buffers.  The calling thread is the only one that writes to stdout and it
+ * emits the records strictly in traversal order, so the output is byte for
+ * byte the same as that of the single-threaded path.
+ */
+
+/*
+ * Largest number of workers accepted by -j.
+ */
+#define PARALLEL_MAX_WORKERS 256
+
+/*
+ * Number of traversal entries the walker may run ahead of the writer.
+ */
+#define PARALLEL_WINDOW 1024
+
+/*
+ * Most of a single file a worker reads ahead.  Anything beyond this is
+ * streamed by the writer straight from the file when its turn comes.
+ */
+#define PARALLEL_PREFETCH_MAX (1 << 20)
+
+/*
+ * Prefetched or queued bytes allowed in flight per worker.
+ */
+#define PARALLEL_WORKER_BUDGET (8 << 20)
+
+/*
+ * @brief  Serialize the directory in path_buf using a pool of worker threads.
+ * @details  Produces exactly the records serialize_directory(depth) would,
+ * from START_OF_DIRECTORY through the matching END_OF_DIRECTORY.
+ *
+ * @param depth  The depth of the top-level directory records.
+ * @param workers  The number of threads reading file contents.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int serialize_parallel(int depth, int workers);
+
+/*
+ * Deserialization:
+ *
+ * The thread parsing stdin keeps creating directories itself, so a directory
+ * always exists before any file inside it is handed out.  Complete payloads
+ * of regular files up to PARALLEL_PREFETCH_MAX bytes are passed to a pool of
+ * writer threads which create the file, write it and set its mode, while the
+ * parser moves on to the next record.  Larger files are written by the parser
+ * directly.  Directory modes are applied only after every write has landed,
+ * so that a read-only directory does not lock out its own contents.
+ *
+ * With -a the pool runs no threads if the io_uring engine can be started:
+ * each payload is queued on the ring as an openat/write/close chain, and
+ * each directory as a mkdirat that the writes queued after it wait for.
+ * Both are created with their final mode when the umask lets them be, and
+ * since io_uring cannot change a mode, the parser only falls back to a
+ * chmod for those it does not, once they have completed.
+ */
+
+/*
+ * @brief  Start the writer pool used by deserialization.
+ *
+ * @param workers  The number of writer threads, if the ring is not used.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int restore_pool_start(int workers);
+
+/*
+ * @brief  Queue a file to be created and written by the writer pool.
+ * @details  The file is created following the same rules as deserialize_file(),
+ * including the ``clobber'' option, and its mode is set once its contents have
+ * been written.  Blocks while the queued payloads exceed the pool's budget.
+ *
+ * @param path  The pathname of the file, copied by the pool.
+ * @param mode  The permission bits to set on the file.
+ * @param data  The file contents, which the pool takes ownership of and frees.
+ * @param length  The number of bytes in data.
+ * @return 0 in case of success, -1 if the pool has already failed.
+ */
+int restore_pool_submit(char *path, mode_t mode, char *data, size_t length);
+
+/*
+ * @brief  Read the contents of a file from the input and queue it as
+ * restore_pool_submit() does.
+ * @details  The buffer they are read into is the pool's, so the parser
+ * allocates nothing.
+ *
+ * @param path  The pathname of the file, copied by the pool.
+ * @param mode  The permission bits to set on the file.
+ * @param depth  The depth of the records holding the contents.
+ * @param length  The number of bytes in the file.
+ * @param compressed  Nonzero if the contents are a run of COMPRESSED_BLOCK
+ * records rather than the payload of a FILE_DATA record already read.
+ * @return 0 in case of success, -1 if the input is malformed or ends, or the
+ * pool has failed.
+ */
+int restore_pool_read(char *path, mode_t mode, int depth, size_t length, int compressed);
+
+/*
+ * @brief  Queue a directory to be created on the ring.
+ * @details  It is created following the same rules as deserialization,
+ * including the ``clobber'' option.  Files and directories queued after it
+ * may go inside it by their whole pathname, but anything done to them
+ * outside the pool has to wait for restore_pool_settle() first.
+ *
+ * @param path  The pathname of the directory, copied by the pool.
+ * @param mode  The mode the directory is to end up with.
+ * @return 0 if it was queued, 1 if the pool is not on the ring and the
+ * caller has to make the directory itself, -1 if the pool has failed.
+ */
+int restore_pool_mkdir(char *path, mode_t mode);
+
+/*
+ * @brief  Wait until every directory queued on the ring so far exists.
+ *
+ * @return 0 in case of success, -1 if the pool has failed.
+ */
+int restore_pool_settle();
+
+/*
+ * @brief  Record a mode to be applied once all queued writes are done.
+ *
+ * @param path  The pathname, copied by the pool.
+ * @param mode  The permission bits to set.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int restore_pool_chmod(char *path, mode_t mode);
+
+/*
+ * @brief  Record a mode to be applied once all queued writes are done, for an
+ * entry the pool did not create itself.
+ * @details  Unlike restore_pool_chmod(), this never assumes the ring already
+ * made a directory with its mode, so it suits those made above selected entries.
+ *
+ * @param path  The pathname, copied by the pool.
+ * @param mode  The permission bits to set.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int restore_pool_defer_mode(char *path, mode_t mode);
+
+/*
+ * @brief  Wait until every queued write has landed, leaving the pool running.
+ *
+ * @return 0 if every write so far succeeded, -1 otherwise.
+ */
+int restore_pool_drain();
+
+/*
+ * @brief  Wait for every queued write, stop the pool and apply deferred modes.
+ *
+ * @return 0 if every write succeeded, -1 otherwise.
+ */
+int restore_pool_finish();
+
+#endif
@@ -0,0 +1,387 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "format.h"
+
+struct hash_state;
+
+/*
+ * Record reader used by the deserializer and record writer used by the
+ * serializer.
+ *
+ * Serialized data is read from a file descriptor into a large aligned
+ * buffer.  Fixed-size pieces of a record (the header, the DIRECTORY_ENTRY
+ * metadata, a file name) are handed out as views directly into that buffer,
+ * and payloads are either handed out as spans or copied straight to their
+ * destination descriptor, so no per-byte library calls are involved.
+ */
+
+/*
+ * Size of the input buffer.  No single view may be larger than this, unless
+ * the input has been mapped.
+ */
+#define READER_BUFFER_SIZE (1 << 20)
+
+/*
+ * Size of the output buffer.  Headers, entry names and the payloads of small
+ * files are gathered here and leave in a single write.
+ */
+#define WRITER_BUFFER_SIZE (1 << 20)
+
+/*
+ * Size of the metadata at the start of a DIRECTORY_ENTRY record.
+ */
+#define ENTRY_METADATA_SIZE 12
+
+/*
+ * With writer_align(), the contents of regular files of at least ALIGN_MIN
+ * bytes start at a multiple of ALIGN_SIZE bytes into the output file, the
+ * block size of most file systems.
+ */
+#define ALIGN_SIZE 4096
+#define ALIGN_MIN (64 << 10)
+
+/*
+ * A decoded record header.
+ */
+struct record_header {
+    int type;
+    uint32_t depth;
+    uint64_t size;
+};
+
+// Load a big-endian value from a possibly unaligned position
+static inline uint32_t load_be32(const char *p) {
+    uint32_t value;
+    __builtin_memcpy(&value, p, sizeof(value));
+    return __builtin_bswap32(value);
+}
+
+static inline uint64_t load_be64(const char *p) {
+    uint64_t value;
+    __builtin_memcpy(&value, p, sizeof(value));
+    return __builtin_bswap64(value);
+}
+
+// Store a big-endian value at a possibly unaligned position
+static inline void store_be32(char *p, uint32_t value) {
+    value = __builtin_bswap32(value);
+    __builtin_memcpy(p, &value, sizeof(value));
+}
+
+static inline void store_be64(char *p, uint64_t value) {
+    value = __builtin_bswap64(value);
+    __builtin_memcpy(p, &value, sizeof(value));
+}
+
+/*
+ * @brief  Start reading serialized data from a file descriptor.
+ * @details  If the descriptor is a regular file it is mapped into memory and
+ * parsed in place from its current offset, and payloads are written to their
+ * destination straight from the mapped pages.  Otherwise data is read into
+ * the input buffer.
+ *
+ * @param fd  The descriptor to read from.
+ */
+void reader_open(int fd);
+
+/*
+ * @brief  Stop reading, releasing any mapping.
+ * @details  A mapped descriptor is left positioned just after the last byte
+ * consumed.
+ */
+void reader_close();
+
+/*
+ * @brief  Consume the next length bytes of input and return a view of them.
+ * @details  The view points into the reader's buffer and remains valid until
+ * the next call into the reader.
+ *
+ * @param length  The number of bytes wanted, at most READER_BUFFER_SIZE.
+ * @return A pointer to the bytes, or NULL if the input ends first or a read
+ * error occurs.
+ */
+char *reader_view(size_t length);
+
+/*
+ * @brief  Consume up to max bytes of input without copying them.
+ * @details  Returns whatever is available in the buffer, refilling it first
+ * if it is empty.  The span remains valid until the next call into the reader.
+ *
+ * @param data  Set to the start of the span.
+ * @param max  The largest number of bytes wanted.
+ * @return The number of bytes in the span, 0 at end of input, or -1 if a
+ * read error occurs.
+ */
+long reader_span(char **data, off_t max);
+
+/*
+ * @brief  Consume exactly length bytes of input, copying them into memory.
+ *
+ * @param dest  Where to put the bytes.
+ * @param length  The number of bytes wanted.
+ * @return 0 in case of success, -1 if the input ends first or a read error
+ * occurs.
+ */
+int reader_read(void *dest, off_t length);
+
+/*
+ * @brief  Consume exactly length bytes of input, copying them to a descriptor.
+ * @details  Large amounts of a mapped input are moved by bulk_copy_range()
+ * from the input file, which clones them where they are block-aligned in
+ * both files.  Otherwise bytes already buffered are written out first and
+ * large remainders are moved by bulk_copy() directly from the input
+ * descriptor.  With --nocache the copy is split into WRITEBACK_WINDOW
+ * pieces handed to writeback_window() in turn.
+ *
+ * @return 0 in case of success, -1 if the input ends first or an I/O error
+ * occurs.
+ */
+int reader_copy(int fd, off_t length);
+
+/*
+ * @brief  Consume exactly length bytes of input and discard them.
+ * @details  Seeks over the bytes when the input is seekable, and drains
+ * them from a pipe without copying them, unless they are to be checksummed.
+ *
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int reader_skip(off_t length);
+
+/*
+ * @brief  Continue reading from another point of the stream.
+ * @details  Only a mapped input that is not being checked against its
+ * checksums can be read out of order.
+ *
+ * @param offset  The offset of the record to read next from the start of
+ * the stream, as an index records it.
+ * @return 0 in case of success, -1 if the input cannot be read out of order
+ * or the offset is beyond its end.
+ */
+int reader_seek(uint64_t offset);
+
+/*
+ * @brief  Read and decode the next record header.
+ * @details  Checks the magic sequence and that the size is consistent with
+ * the type: header-only records must be exactly HEADER_SIZE bytes and a
+ * DIRECTORY_ENTRY must have room for its metadata.  Checking the type and
+ * depth against what is expected at this point in the stream is left to the
+ * caller.
+ *
+ * @param header  Filled in with the decoded fields.
+ * @return 0 in case of success, -1 if the input ends or the header is invalid.
+ */
+int read_header(struct record_header *header);
+
+/*
+ * @brief  Read the START_OF_TRANSMISSION record.
+ * @details  If the stream is checksummed, everything read from here on is
+ * checked: the contents of each FILE_DATA record against the CHECKSUM record
+ * after them, which read_header() and peek_header() consume and check on
+ * their own, and the whole stream by read_end().  Contents are then never
+ * moved or skipped without being read, and mapped ones are written out in
+ * pieces of READER_BUFFER_SIZE bytes, checksummed while they are cached.
+ *
+ * @return 0 in case of success, -1 if the input ends, the record is not
+ * START_OF_TRANSMISSION or it has flags this reader does not know.
+ */
+int read_start();
+
+/*
+ * @brief  Skim the rest of the stream rather than check it.
+ * @details  Checksums are no longer verified, so contents can be skipped
+ * without being read and CHECKSUM records are returned by read_header()
+ * like any other.  A mapped input is no longer read ahead, so that skipping
+ * contents does not bring them in after all.
+ */
+void reader_skim();
+
+/*
+ * @brief  Tell whether the stream is being checked against its checksums.
+ *
+ * @return Nonzero after read_start() on a checksummed stream, until
+ * reader_skim() or read_end() is called.
+ */
+int reader_checking();
+
+/*
+ * @brief  Check the checksum of the whole stream, if it has one.
+ * @details  Reads past any index to END_OF_TRANSMISSION.  Does nothing if
+ * the stream is not checksummed.
+ *
+ * @return 0 in case of success, -1 if the input ends, a record is invalid or
+ * the checksum does not match.
+ */
+int read_end();
+
+/*
+ * @brief  Read the CHECKSUM record after contents the caller has summed
+ * itself, such as those of compressed or sparse files, and check it.
+ * @details  Does nothing if the stream is not being checked.
+ *
+ * @param depth  The depth the record must have.
+ * @param crc  The CRC-32C of the contents of the file.
+ * @return 0 in case of success, -1 if the input ends, the next record is not
+ * a CHECKSUM record at depth or the checksum does not match.
+ */
+int read_checksum(uint32_t depth, uint32_t crc);
+
+/*
+ * @brief  Read and decode the next record header without consuming it.
+ * @details  Performs the same checks as read_header().
+ *
+ * @param header  Filled in with the decoded fields.
+ * @return 0 in case of success, -1 if the input ends or the header is invalid.
+ */
+int peek_header(struct record_header *header);
+
+/*
+ * @brief  Start writing serialized data to a file descriptor.
+ *
+ * @param fd  The descriptor to write to.
+ */
+void writer_open(int fd);
+
+/*
+ * @brief  Append the START_OF_TRANSMISSION record to the output.
+ * @details  With checksums, the contents of every FILE_DATA record appended
+ * afterwards are followed by a CHECKSUM record as soon as they are complete,
+ * and everything appended is added to the checksum put_end() writes.  Each
+ * byte is checksummed once, as it is appended, and payloads then always
+ * pass through the output buffer.
+ *
+ * @param checksums  Nonzero to write a checksummed stream.
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int put_start(int checksums);
+
+/*
+ * @brief  Append the END_OF_TRANSMISSION record to the output, carrying the
+ * checksum of the stream if put_start() asked for one.
+ *
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int put_end();
+
+/*
+ * @brief  Tell whether the output is checksummed.
+ *
+ * @return Nonzero after put_start() asked for checksums, until put_end().
+ */
+int writer_checking();
+
+/*
+ * @brief  Append the CHECKSUM record for contents summed by the caller,
+ * such as those of compressed or sparse files, if the output is checksummed.
+ *
+ * @param depth  The depth of the record.
+ * @param crc  The CRC-32C of the contents of the file.
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int put_checksum(uint32_t depth, uint32_t crc);
+
+/*
+ * @brief  Append a record header to the output.
+ *
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int put_header(int type, uint32_t depth, uint64_t size);
+
+/*
+ * @brief  Start aligning the contents of large files.
+ * @details  Each DIRECTORY_ENTRY of a regular file of at least ALIGN_MIN
+ * bytes is preceded by a PADDING record that makes its FILE_DATA contents,
+ * if that is what follows, start on an ALIGN_SIZE boundary of the output.
+ */
+void writer_align();
+
+/*
+ * @brief  Append a complete DIRECTORY_ENTRY record to the output.
+ * @details  The header, the metadata and the name are encoded together.  The
+ * entry is also reported to the index if one is being built.
+ *
+ * @param depth  The depth of the record.
+ * @param mode  The st_mode of the entry.
+ * @param size  The st_size of the entry.
+ * @param name  The name of the entry, without a terminator.
+ * @param nameLength  The number of bytes in name, less than NAME_MAX.
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int put_entry(uint32_t depth, mode_t mode, off_t size, const char *name, size_t nameLength);
+
+/*
+ * @brief  Append bytes held in memory to the output.
+ * @details  Small amounts are copied into the output buffer.  Anything that
+ * does not fit is written together with the buffer by a single writev(2),
+ * without being copied.
+ *
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int put_data(const void *data, size_t length);
+
+/*
+ * @brief  Append exactly length bytes read from a descriptor to the output.
+ * @details  Small payloads are read straight into the output buffer so that
+ * they leave together with the headers in front of them.  Large payloads are
+ * moved by bulk_copy() after the buffer has been flushed.
+ *
+ * @return 0 in case of success, -1 if an I/O error occurs or the descriptor
+ * reaches end of file first.
+ */
+int put_payload(int fd, off_t length);
+
+/*
+ * @brief  Offset in the output of the next byte to be appended.
+ */
+uint64_t writer_offset();
+
+/*
+ * @brief  Flush the output and report what a checkpoint needs to resume it.
+ *
+ * @param base  Set to the offset of the output at which the stream starts.
+ * @param crc  Set to the checksum of the stream so far, or 0 without checksums.
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int writer_checkpoint(uint64_t *base, uint32_t *crc);
+
+/*
+ * @brief  Continue a stream from a checkpoint instead of starting one.
+ * @details  The output, which has to be a regular file, is cut back to where
+ * the checkpoint was made, and records are then discarded rather than
+ * written until writer_replayed() is called, so the stream can be walked
+ * again from its start.  No START_OF_TRANSMISSION record is written.
+ *
+ * @param base  The offset of the output at which the stream starts.
+ * @param total  The bytes of stream written before the checkpoint.
+ * @param checksums  Nonzero if the stream is checksummed.
+ * @param crc  The checksum of those bytes.
+ * @return 0 in case of success, -1 if the output is not a regular file
+ * holding at least that much of the stream.
+ */
+int writer_resume(uint64_t base, uint64_t total, int checksums, uint32_t crc);
+
+/*
+ * @brief  Start writing records again after writer_resume().
+ */
+void writer_replayed();
+
+/*
+ * @brief  Like put_payload(), also adding the bytes to a content hash.
+ * @details  The payload always passes through the output buffer, since the
+ * bytes have to be seen to be hashed.
+ *
+ * @param state  The hash to add to, or NULL for none.
+ */
+int put_payload_hashed(int fd, off_t length, struct hash_state *state);
+
+/*
+ * @brief  Write out everything held in the output buffer.
+ *
+ * @return 0 in case of success, -1 if an I/O error occurs.
+ */
+int writer_flush();
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * Directory scanning for the serializer and the walker of serialize_parallel().
+ *
+ * A scan hands out the entries of one directory, except "." and "..", in
+ * the order the file system keeps them, each with the result of stat(2) on
+ * it.  Asked for a sort order, it reads every name of the directory first,
+ * packed into one growing arena, and sorts them bytewise or by inode
+ * number.  Entries are read with getdents64(2), SCAN_ENTRIES_SIZE bytes' worth
+ * at a time, and stat'ed with statx(2) asking only for the fields the
+ * serializer uses.  Where the entry type is known not to be a symbolic link,
+ * the statx does not try to follow one.
+ *
+ * Without the io_uring engine (see uring.h) each entry is stat'ed as it is
+ * handed out.  With it, names are gathered SCAN_WINDOW at a time and stat'ed
+ * in one batch, and the contents of small regular files further on are read
+ * ahead, so that by the time the serializer reaches such a file its contents
+ * are usually in memory already.
+ */
+
+/*
+ * Bytes of directory entries read with one getdents64(2) call.
+ */
+#define SCAN_ENTRIES_SIZE (128 << 10)
+
+/*
+ * Most entries of a directory stat'ed in one batch.
+ */
+#define SCAN_WINDOW 512
+
+/*
+ * Largest file whose contents are read ahead.
+ */
+#define SCAN_PREFETCH_MAX (64 << 10)
+
+/*
+ * Most bytes of contents read ahead at once, over all open scans.
+ */
+#define SCAN_BUDGET (8 << 20)
+
+/*
+ * Options to scan_open().  SCAN_PREFETCH reads small files ahead when the
+ * io_uring engine is running, SCAN_TIMES fills in st_mtim as well, and
+ * SCAN_BY_NAME or SCAN_BY_INODE hand entries out sorted by name or by inode
+ * number, the latter broken by name.
+ */
+#define SCAN_PREFETCH 0x1
+#define SCAN_TIMES 0x2
+#define SCAN_BY_NAME 0x4
+#define SCAN_BY_INODE 0x8
+
+struct scan;
+
+/*
+ * @brief  Start scanning a directory.
+ *
+ * @param dirfd  The directory the name is relative to, or AT_FDCWD.
+ * @param name  The name of the directory.
+ * @param flags  Any of SCAN_PREFETCH and SCAN_TIMES, and at most one of
+ * SCAN_BY_NAME and SCAN_BY_INODE.
+ * @return The scan, or NULL if the directory cannot be opened.
+ */
+struct scan *scan_open(int dirfd, const char *name, int flags);
+
+/*
+ * @brief  Move to the next entry.
+ * @details  Anything read ahead for the previous entry is released.
+ *
+ * @param scan  The scan.
+ * @param name  Set to the name of the entry, valid until the next call.
+ * @param stat_buf  Filled in with the status of the entry: its device, inode,
+ * mode, link count, size and blocks, and with SCAN_TIMES its modification
+ * time.  The rest is zero.
+ * @return 1 if there is an entry, 0 at the end of the directory, -1 if an
+ * error occurs, including an entry that cannot be stat'ed.
+ */
+int scan_next(struct scan *scan, char **name, struct stat *stat_buf);
+
+/*
+ * @brief  Get a descriptor for the directory being scanned, which entries
+ * can be opened relative to.  It is closed by scan_close().
+ */
+int scan_fd(struct scan *scan);
+
+/*
+ * @brief  Get the contents read ahead for the current entry.
+ *
+ * @param scan  The scan.
+ * @param data  Set to the contents, valid until the next call to scan_next().
+ * @return The number of bytes, which is the size the entry was stat'ed with,
+ * or -1 if nothing was read ahead.
+ */
+long scan_data(struct scan *scan, char **data);
+
+/*
+ * @brief  Finish a scan, waiting for any reads still in flight.
+ */
+void scan_close(struct scan *scan);
+
+#endif
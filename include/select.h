@@ -0,0 +1,70 @@
+#ifndef SELECT_H
+#define SELECT_H
+
+#include <stddef.h>
+
+#include "index.h"
+
+/*
+ * Selective extraction, chosen with -d --only PATH...
+ *
+ * Each PATH is a pathname relative to the serialized directory and may
+ * contain shell wildcards, matched with fnmatch(3) so that '*' and '?' do
+ * not cross a '/'.  An entry is selected if its pathname matches a pattern or
+ * lies below a directory that does, so naming a directory restores the whole
+ * subtree.  Entries that are not selected are still parsed, to keep the stream
+ * in step, but their payloads are skipped rather than written.
+ *
+ * When the archive is a file with an index (-s -x) and every PATH names a
+ * single pathname, the entries are instead looked up in the index and read
+ * from where it says they are, so the rest of the stream is not parsed.
+ * The directories above them are created as needed and given the modes their
+ * own index entries record, as a full restore would.
+ */
+
+/*
+ * A selected entry found in the index.
+ */
+struct select_entry {
+    const char *path;
+    size_t length;
+    struct index_entry location;
+};
+
+/*
+ * @brief  Add a pattern to the selection.
+ *
+ * @param pattern  The pattern, which must stay valid; a leading "./" and
+ * trailing '/' are ignored.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int select_add(char *pattern);
+
+/*
+ * @brief  Check whether any pattern has been added.
+ *
+ * @return 1 if extraction is selective, 0 if everything is restored.
+ */
+int select_active();
+
+/*
+ * @brief  Check whether an entry is to be restored.
+ *
+ * @param path  The pathname of the entry relative to the serialized directory.
+ * @return 1 if the entry is selected, or no pattern has been added, 0 otherwise.
+ */
+int select_match(char *path);
+
+/*
+ * @brief  Look every pattern up in the loaded index.
+ * @details  Pathnames the index does not hold are left out, and so are
+ * those below another one found, since restoring that one restores them.
+ *
+ * @param count  Set to the number of entries found.
+ * @return The entries, in the order they occur in the stream and valid
+ * until the next call, or NULL if a pattern has wildcards, which have to be
+ * matched against every pathname in the stream, or memory runs out.
+ */
+const struct select_entry *select_locate(long *count);
+
+#endif
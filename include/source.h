@@ -0,0 +1,111 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * How the contents of files are read while serializing.
+ *
+ * By default they are read, or copied to the output inside the kernel, in
+ * the ordinary way, which leaves every file of the tree in the page cache.
+ * On a machine that is doing other work that pushes out the data its other
+ * programs need.  Two ways of reading avoid it, selected with -s --nocache
+ * and -s --direct.
+ *
+ * With SOURCE_NOCACHE files are read with preadv2(RWF_DONTCACHE), so pages
+ * brought in for the read are dropped as soon as it completes while pages
+ * that were already cached stay.  On kernels or file systems without it
+ * (before Linux 6.14) the window ahead of the reader is requested with
+ * POSIX_FADV_WILLNEED and what is behind it dropped with
+ * POSIX_FADV_DONTNEED, which also drops pages of the file that some other
+ * program had cached.
+ *
+ * With SOURCE_DIRECT files of SOURCE_DIRECT_MIN bytes or more are read with
+ * O_DIRECT, a window at a time, into an aligned buffer, bypassing the cache
+ * completely; smaller files are read as with SOURCE_NOCACHE.  File systems
+ * that refuse O_DIRECT are read as with SOURCE_NOCACHE too.
+ *
+ * Either way the contents go through user space instead of being copied
+ * inside the kernel.
+ */
+
+/*
+ * Ways of reading, for source_start().
+ */
+#define SOURCE_NOCACHE 0x1
+#define SOURCE_DIRECT 0x2
+
+/*
+ * Default bytes read ahead, and for --direct read at once.  --readahead
+ * sets it in MiB, from 1 up to SOURCE_WINDOW_MAX.
+ */
+#define SOURCE_WINDOW (8 << 20)
+#define SOURCE_WINDOW_MAX (1 << 30)
+
+/*
+ * Alignment of the offsets and buffer of O_DIRECT reads.
+ */
+#define SOURCE_ALIGN 4096
+
+/*
+ * Files smaller than this are not read with O_DIRECT.
+ */
+#define SOURCE_DIRECT_MIN (1 << 20)
+
+/*
+ * The way of reading in force, 0 until source_start() is called.
+ */
+extern int source_mode;
+
+/*
+ * One file being read.
+ */
+struct source {
+    int fd;
+    int direct;
+    off_t offset;
+    off_t advised;
+    off_t dropped;
+    size_t bufferStart;
+    size_t bufferEnd;
+};
+
+/*
+ * @brief  Select the way files are read for the rest of the run.
+ *
+ * @param mode  SOURCE_NOCACHE, SOURCE_DIRECT, or 0 for the ordinary way.
+ * @param window  Bytes to read ahead.
+ * @return 0 in case of success, -1 if the buffer for O_DIRECT cannot be had.
+ */
+int source_start(int mode, size_t window);
+
+/*
+ * @brief  Go back to reading in the ordinary way.
+ */
+void source_finish();
+
+/*
+ * @brief  Start reading a file from its current offset.
+ *
+ * @param s  The reading state.
+ * @param fd  The file.
+ * @param length  The bytes that will be read.
+ * @param direct  Nonzero to allow O_DIRECT, which only the thread that
+ * called source_start() may.
+ */
+void source_begin(struct source *s, int fd, off_t length, int direct);
+
+/*
+ * @brief  Read the next bytes of a file, as read(2) would.
+ *
+ * @return The number of bytes read, 0 at end of file, -1 if an I/O error occurs.
+ */
+ssize_t source_read(struct source *s, void *buf, size_t count);
+
+/*
+ * @brief  Finish reading a file, leaving its offset after the bytes read.
+ */
+void source_end(struct source *s);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct hash_state;
+
+/*
+ * Sparse files.
+ *
+ * With -s -S, a regular file that occupies fewer blocks than its size calls
+ * for is mapped with lseek(2) SEEK_DATA/SEEK_HOLE, and if it does have holes only
+ * its data extents are emitted, as a SPARSE_DATA record in place of the
+ * FILE_DATA record (see format.h).  The reader seeks over the holes, so
+ * the restored file is sparse again.  Files without holes, and file systems
+ * that cannot report them, are serialized as before.  In a checksummed
+ * stream the record is followed by the CHECKSUM record of the file, whose
+ * CRC is that of its whole contents with the holes read as zeros.
+ */
+
+/*
+ * Most extents a file may have to be emitted as SPARSE_DATA.  A file with
+ * more is emitted in full.
+ */
+#define SPARSE_MAX_EXTENTS (1 << 16)
+
+/*
+ * Size of the fixed part of a SPARSE_DATA record's data, and of each entry
+ * of its extent map.
+ */
+#define SPARSE_PREFIX_SIZE 16
+#define SPARSE_EXTENT_SIZE 16
+
+/*
+ * @brief  Emit a file as a SPARSE_DATA record if it has holes.
+ *
+ * @param fd  The file, positioned at its start.
+ * @param size  The size of the file.
+ * @param depth  The depth of the record.
+ * @param state  A content hash to add the whole contents to, the holes as
+ * zeros, or NULL.
+ * @return 1 if the record was emitted, 0 if the file has no holes and nothing
+ * was emitted, -1 if an I/O error occurs.
+ */
+int put_sparse(int fd, off_t size, uint32_t depth, struct hash_state *state);
+
+/*
+ * @brief  Read a SPARSE_DATA record and recreate the file from it.
+ * @details  The data extents are written at their offsets in fd, which must
+ * be empty, and the file is then extended to its full size, leaving holes
+ * wherever nothing was written.  With fd -1 the record is just skipped.
+ * Either way the contents are checked against the CHECKSUM record after
+ * them, which is read too, if the stream is being checked.
+ *
+ * @param depth  The depth the record must have.
+ * @param fd  The file to write, or -1.
+ * @return 0 in case of success, -1 if the record is malformed, the input
+ * ends or an I/O error occurs.
+ */
+int restore_sparse(uint32_t depth, int fd);
+
+/*
+ * @brief  Read a SPARSE_DATA record, checking it without restoring anything.
+ * @details  The extent map is checked as restore_sparse() does and the data
+ * is skipped, or checked against its CHECKSUM record as restore_sparse()
+ * does.
+ *
+ * @param depth  The depth the record must have.
+ * @param size  The size the DIRECTORY_ENTRY gave the file.
+ * @return 0 in case of success, -1 if the record is malformed, does not
+ * describe a file of that size, or the input ends.
+ */
+int check_sparse(uint32_t depth, off_t size);
+
+#endif
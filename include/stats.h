@@ -0,0 +1,97 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "format.h"
+
+/*
+ * Run-time statistics, selected with --stats and --progress.
+ *
+ * Counters cover the records read or written by type, the bytes of the
+ * stream and of file contents among them, and the files and directories
+ * processed.  Timers split wall-clock time between walking directories,
+ * metadata system calls (stat, create, chmod), reading, writing, and copies
+ * done inside the kernel (copy_file_range, sendfile, splice), each measured
+ * around the system calls of that kind.  Comparing them tells whether a run
+ * is bound by the disk, the pipe or the processor.  Time spent in several
+ * threads at once is summed, so with -j a phase may exceed the elapsed time,
+ * and I/O done through io_uring or a mapped input is not timed.  The bytes of
+ * a record are counted when its header is read or written.
+ *
+ * Until stats_start() is called every function here returns straight away,
+ * so the counters cost one predictable branch when they are not wanted.
+ * They are updated with relaxed atomics, as the -j workers and writer
+ * threads count too, and a progress thread reads them.
+ */
+
+/*
+ * Phases time is split between.
+ */
+#define STATS_TRAVERSE 0
+#define STATS_METADATA 1
+#define STATS_READ 2
+#define STATS_WRITE 3
+#define STATS_COPY 4
+#define STATS_PHASES 5
+
+/*
+ * Record types counted separately; larger ones are counted as the last.
+ */
+#define STATS_RECORD_TYPES (NUM_FORMAT_RECORD_TYPES + 1)
+
+/*
+ * Seconds between progress lines.
+ */
+#define STATS_PROGRESS_INTERVAL 1
+
+/*
+ * Nonzero once stats_start() has been called.
+ */
+extern int stats_on;
+
+/*
+ * @brief  Start counting.
+ *
+ * @param report  Nonzero to print a summary on the standard error at the end.
+ * @param progress  Nonzero to print a progress line on the standard error
+ * every STATS_PROGRESS_INTERVAL seconds while the run lasts.
+ * @return 0 in case of success, -1 if the progress thread cannot be started.
+ */
+int stats_start(int report, int progress);
+
+/*
+ * @brief  Stop the progress line and print the summary if one was asked for.
+ */
+void stats_finish();
+
+/*
+ * @brief  Count a record read or written.
+ *
+ * @param type  The record type.
+ * @param size  The size field of its header, the header included.
+ */
+void stats_record(int type, uint64_t size);
+
+/*
+ * @brief  Count a file or directory processed.
+ */
+void stats_entry(mode_t mode);
+
+/*
+ * @brief  Read the clock at the start of a timed phase.
+ *
+ * @return The time in nanoseconds, or 0 if statistics are off.
+ */
+uint64_t stats_clock();
+
+/*
+ * @brief  Charge the time since a stats_clock() reading to a phase.
+ *
+ * @param phase  One of the STATS_ phases.
+ * @param since  What stats_clock() returned at the start.
+ */
+void stats_charge(int phase, uint64_t since);
+
+#endif
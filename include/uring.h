@@ -0,0 +1,150 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * io_uring engine, selected with -a.
+ *
+ * The ring is driven directly through the io_uring_setup(2) and
+ * io_uring_enter(2) system calls.  Operations on many files are queued
+ * together and submitted with a single system call, so that dozens of them
+ * are in flight at once:
+ *
+ *   - statx for all the entries of a directory in one batch;
+ *   - reading a small file whole, as an openat/read/close chain;
+ *   - writing a small file whole, as an openat/write/close chain;
+ *   - creating a directory, ahead of whatever is queued after it.
+ *
+ * A chain opens its file into one of URING_SLOTS registered file slots, so
+ * that the read or write linked after the open can use it without the
+ * descriptor ever reaching user space.  The links are hard links, so the
+ * close always runs and frees the slot, whatever became of the rest.
+ *
+ * If the kernel has no io_uring, or it has been disabled, uring_start()
+ * fails and callers carry on with the synchronous system calls.  The engine
+ * is only ever used from one thread.
+ */
+
+struct statx;
+
+/*
+ * Number of submission queue entries.
+ */
+#define URING_ENTRIES 256
+
+/*
+ * Number of registered file slots, and so of chains in flight at once.
+ */
+#define URING_SLOTS 64
+
+/*
+ * An operation in flight.  The caller owns it, and it must stay where it is
+ * until the operation is complete.
+ */
+struct uring_io {
+    int pending;
+    int error;
+    int result;
+    int slot;
+    size_t length;
+};
+
+/*
+ * @brief  Set up the ring.
+ *
+ * @return 0 in case of success, -1 if io_uring is not available, in which
+ * case nothing else here may be used.
+ */
+int uring_start();
+
+/*
+ * @brief  Wait for everything in flight and tear the ring down.
+ */
+void uring_stop();
+
+/*
+ * @brief  Check whether the ring has been set up.
+ */
+int uring_active();
+
+/*
+ * @brief  Run statx(2) on a batch of entries of one directory.
+ *
+ * @param dirfd  The directory.
+ * @param names  The names of the entries, relative to dirfd.
+ * @param flags  The statx flags to use for each entry.
+ * @param count  The number of entries.
+ * @param mask  The fields wanted, as for statx(2).
+ * @param results  Filled in with the results, one for each name.  An entry
+ * the ring could not stat has its stx_mask set to 0.
+ * @return 0 in case of success, -1 if the ring fails.
+ */
+int uring_statx_batch(int dirfd, char **names, const int *flags, size_t count, unsigned mask,
+                      struct statx *results);
+
+/*
+ * @brief  Queue reading a whole small file into memory.
+ * @details  May wait for earlier operations if the ring is full.
+ *
+ * @param dirfd  The directory the name is relative to, or AT_FDCWD.
+ * @param name  The name of the file, which must stay valid until submitted.
+ * @param buf  Where to put the contents.
+ * @param length  The number of bytes to read, which must be the whole file.
+ * @param io  Tracks the operation.
+ * @return 0 in case of success, -1 if the ring fails.
+ */
+int uring_read(int dirfd, const char *name, char *buf, size_t length, struct uring_io *io);
+
+/*
+ * @brief  Queue creating a file and writing its whole contents.
+ * @details  May wait for earlier operations if the ring is full.
+ *
+ * @param path  The pathname of the file, which must stay valid until done.
+ * @param flags  The open(2) flags, which must include O_WRONLY and O_CREAT.
+ * @param mode  The mode to create the file with, before the umask.
+ * @param data  The contents, which must stay valid until done.
+ * @param length  The number of bytes in data.
+ * @param io  Tracks the operation.
+ * @return 0 in case of success, -1 if the ring fails.
+ */
+int uring_write(const char *path, int flags, mode_t mode, const char *data, size_t length,
+                struct uring_io *io);
+
+/*
+ * @brief  Queue creating a directory.
+ * @details  Nothing queued after it starts until it is complete, so writes
+ * into the new directory may be queued straight after it.  io_uring has no
+ * operation to change the mode of a file, so that stays synchronous.
+ *
+ * @param path  The pathname of the directory, which must stay valid until done.
+ * @param mode  The mode to create it with, before the umask.
+ * @param io  Tracks the operation, whose error is that of mkdir(2), negated.
+ * @return 0 in case of success, -1 if the ring fails.
+ */
+int uring_mkdir(const char *path, mode_t mode, struct uring_io *io);
+
+/*
+ * @brief  Wait for an operation to complete.
+ *
+ * @return 0 if it succeeded in full, -1 otherwise.
+ */
+int uring_wait(struct uring_io *io);
+
+/*
+ * @brief  Reap whatever has completed, without waiting.
+ *
+ * @return 0 in case of success, -1 if the ring fails.
+ */
+int uring_poll();
+
+/*
+ * @brief  Wait for every operation in flight.
+ *
+ * @return 0 in case of success, -1 if the ring fails.
+ */
+int uring_wait_all();
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <sys/types.h>
+
+/*
+ * How restored files are laid out and written back.
+ *
+ * Files of WRITEBACK_PREALLOCATE_MIN bytes or more have their whole size
+ * reserved with fallocate(2) before the first byte is written, so the file
+ * system can give them one run of blocks instead of growing them extent by
+ * extent, and a full disk is found before the data is copied rather than
+ * part way through.
+ *
+ * With --nocache the restored data is also kept from filling the page cache
+ * at the expense of everything else on the machine.  Each file is pushed to
+ * disk with sync_file_range(2) as it is closed, and WRITEBACK_DEPTH files
+ * later, when that has long finished, its pages are dropped with
+ * posix_fadvise(POSIX_FADV_DONTNEED).  Payloads longer than
+ * WRITEBACK_WINDOW are treated the same way a window at a time while they
+ * are copied.  Files written through io_uring with -a are not covered.
+ */
+
+/*
+ * Files smaller than this are not preallocated.
+ */
+#define WRITEBACK_PREALLOCATE_MIN (1 << 20)
+
+/*
+ * Closed files whose pages are held until their writeback is over.
+ */
+#define WRITEBACK_DEPTH 32
+
+/*
+ * Bytes of one payload written between pushing them to disk.
+ */
+#define WRITEBACK_WINDOW (8 << 20)
+
+/*
+ * Nonzero between writeback_start() and writeback_finish().
+ */
+extern int writeback_on;
+
+/*
+ * @brief  Reserve the blocks of a file about to be written.
+ * @details  The size of the file is left alone.  File systems that cannot
+ * preallocate are not an error.
+ *
+ * @param fd  The file, just created.
+ * @param size  The number of bytes it will hold.
+ * @return 0 in case of success, -1 if the blocks cannot be had (ENOSPC).
+ */
+int writeback_preallocate(int fd, off_t size);
+
+/*
+ * @brief  Start dropping the pages of restored files once they are on disk.
+ */
+void writeback_start();
+
+/*
+ * @brief  Push one window of a payload to disk and drop the one before it.
+ * @details  Called from the thread restoring the stream only.
+ *
+ * @param fd  The file being written.
+ * @param offset  Where in the file the window starts.
+ * @param length  The bytes just written there.
+ */
+void writeback_window(int fd, off_t offset, off_t length);
+
+/*
+ * @brief  Push a restored file to disk before it is closed.
+ * @details  The file is kept open on a descriptor of its own until its pages
+ * are dropped, so the caller closes fd as usual.  Safe to call from the
+ * writer threads.
+ *
+ * @param fd  The file, completely written.
+ */
+void writeback_release(int fd);
+
+/*
+ * @brief  Wait for every file released so far and drop its pages.
+ */
+void writeback_finish();
+
+#endif
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+
+#include "bulk.h"
+#include "debug.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+/*
+ * Block buffer shared by the buffered fallback paths.
+ */
+static char bulk_buf[BULK_BLOCK_SIZE];
+
+/*
+ * Cleared once the kernel tells us a zero-copy call does not work here, so
+ * that later payloads go straight to the path that does.
+ */
+static int tryClone = 1;
+static int tryCopyRange = 1;
+static int trySendfile = 1;
+static int trySplice = 1;
+
+// Check if errno means the call is not usable for these descriptors
+static int unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EBADF
+        || err == EOPNOTSUPP || err == ESPIPE || err == ENOTTY;
+}
+
+int bulk_write(int fd, const void *buf, size_t len) {
+    const char *pointer = buf;
+    uint64_t since = stats_clock();
+
+    // Keep writing until every byte has been accepted
+    while (len > 0) {
+        ssize_t done = write(fd, pointer, len);
+        if (done == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            stats_charge(STATS_WRITE, since);
+            return -1;
+        }
+        pointer += done;
+        len -= done;
+    }
+    stats_charge(STATS_WRITE, since);
+    return 0;
+}
+
+int bulk_copy(int in_fd, int out_fd, off_t count) {
+    // Terminals get plain buffered blocks
+    if (isatty(out_fd)) {
+        tryCopyRange = 0;
+        trySendfile = 0;
+        trySplice = 0;
+    }
+
+    while (count > 0) {
+        size_t chunk = count > 0x40000000 ? 0x40000000 : count;
+        ssize_t done = -1;
+        uint64_t since = stats_clock();
+
+        // Both regular files, so let the file system copy the extents
+        if (tryCopyRange) {
+            done = copy_file_range(in_fd, NULL, out_fd, NULL, chunk, 0);
+            if (done == -1 && unsupported(errno)) {
+                tryCopyRange = 0;
+                continue;
+            }
+        }
+        // Source can be mapped, output can be anything
+        else if (trySendfile) {
+            done = sendfile(out_fd, in_fd, NULL, chunk);
+            if (done == -1 && unsupported(errno)) {
+                trySendfile = 0;
+                continue;
+            }
+        }
+        // One of the two ends is a pipe
+        else if (trySplice) {
+            done = splice(in_fd, NULL, out_fd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (done == -1 && unsupported(errno)) {
+                trySplice = 0;
+                continue;
+            }
+        }
+        // Nothing zero-copy applies, so move a block through user space
+        else {
+            if (chunk > BULK_BLOCK_SIZE) {
+                chunk = BULK_BLOCK_SIZE;
+            }
+            done = read(in_fd, bulk_buf, chunk);
+            stats_charge(STATS_READ, since);
+            if (done > 0 && bulk_write(out_fd, bulk_buf, done) == -1) {
+                return -1;
+            }
+        }
+        if (tryCopyRange || trySendfile || trySplice) {
+            stats_charge(STATS_COPY, since);
+        }
+
+        if (done == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            debug("bulk copy failed with errno %d", errno);
+            return -1;
+        }
+
+        // Input ended before the expected number of bytes
+        if (done == 0) {
+            return -1;
+        }
+        count -= done;
+    }
+
+    return 0;
+}
+
+// Share the whole blocks at the start of a range, returning how many bytes that covered
+static off_t clone_blocks(int in_fd, off_t offset, int out_fd, off_t count) {
+    struct stat stat_buf;
+    off_t position = lseek(out_fd, 0, SEEK_CUR);
+    if (position == -1 || fstat(in_fd, &stat_buf) == -1 || stat_buf.st_blksize <= 0) {
+        return 0;
+    }
+    off_t block = stat_buf.st_blksize;
+    if (offset % block != 0 || position % block != 0 || count < block) {
+        return 0;
+    }
+
+    struct file_clone_range range = {
+        .src_fd = in_fd,
+        .src_offset = offset,
+        .src_length = count - count % block,
+        .dest_offset = position
+    };
+    uint64_t since = stats_clock();
+    int getReturn = ioctl(out_fd, FICLONERANGE, &range);
+    stats_charge(STATS_COPY, since);
+    if (getReturn == -1) {
+        if (unsupported(errno)) {
+            tryClone = 0;
+        }
+        return 0;
+    }
+    if (lseek(out_fd, position + range.src_length, SEEK_SET) == -1) {
+        return -1;
+    }
+    return range.src_length;
+}
+
+int bulk_copy_range(int in_fd, off_t offset, int out_fd, off_t count) {
+    if (tryClone) {
+        off_t cloned = clone_blocks(in_fd, offset, out_fd, count);
+        if (cloned == -1) {
+            return -1;
+        }
+        offset += cloned;
+        count -= cloned;
+    }
+
+    while (count > 0) {
+        size_t chunk = count > 0x40000000 ? 0x40000000 : count;
+        ssize_t done;
+        uint64_t since = stats_clock();
+
+        // Let the file system copy the extents, advancing offset as it goes
+        if (tryCopyRange) {
+            done = copy_file_range(in_fd, &offset, out_fd, NULL, chunk, 0);
+            stats_charge(STATS_COPY, since);
+            if (done == -1 && unsupported(errno)) {
+                tryCopyRange = 0;
+                continue;
+            }
+        }
+        // Otherwise move a block through user space
+        else {
+            if (chunk > BULK_BLOCK_SIZE) {
+                chunk = BULK_BLOCK_SIZE;
+            }
+            done = pread(in_fd, bulk_buf, chunk, offset);
+            stats_charge(STATS_READ, since);
+            if (done > 0 && bulk_write(out_fd, bulk_buf, done) == -1) {
+                return -1;
+            }
+            if (done > 0) {
+                offset += done;
+            }
+        }
+
+        if (done == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            debug("bulk copy failed with errno %d", errno);
+            return -1;
+        }
+
+        // Input ended before the expected number of bytes
+        if (done == 0) {
+            return -1;
+        }
+        count -= done;
+    }
+
+    return 0;
+}
+
+int bulk_stream_copy(FILE *in, FILE *out, off_t count) {
+    while (count > 0) {
+        size_t chunk = count > BULK_BLOCK_SIZE ? BULK_BLOCK_SIZE : count;
+
+        // Short read means end of file or an error, both fail the copy
+        size_t done = fread(bulk_buf, 1, chunk, in);
+        if (done != chunk) {
+            return -1;
+        }
+        if (fwrite(bulk_buf, 1, chunk, out) != chunk) {
+            return -1;
+        }
+        count -= chunk;
+    }
+
+    return 0;
+}
+
+int bulk_discard(int fd, off_t count) {
+    // A pipe is drained into /dev/null without its pages being copied out
+    static int devNull = -1;
+    if (devNull == -1) {
+        devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    }
+    while (count > 0 && devNull != -1) {
+        size_t chunk = count > 0x40000000 ? 0x40000000 : count;
+        ssize_t done = splice(fd, NULL, devNull, NULL, chunk, SPLICE_F_MOVE);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done == -1 && unsupported(errno)) {
+            break;
+        }
+        if (done <= 0) {
+            return -1;
+        }
+        count -= done;
+    }
+
+    // Otherwise read the bytes and drop them
+    while (count > 0) {
+        ssize_t done = read(fd, bulk_buf, count > BULK_BLOCK_SIZE ? BULK_BLOCK_SIZE : count);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return -1;
+        }
+        count -= done;
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+
+#include "checkpoint.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The checkpoint file, and the name it is written under before replacing it
+static char *checkpointPath;
+static char *temporaryPath;
+
+// The checkpoint resumed from, if any
+static uint64_t resumeEntries;
+static char *resumePath;
+static size_t resumeLength;
+
+// Where the last checkpoint was made
+static uint64_t savedEntries;
+static uint64_t savedTotal;
+
+int checkpoint_open(char *file, struct checkpoint *resume) {
+    checkpointPath = file;
+    if (asprintf(&temporaryPath, "%s.tmp", file) == -1) {
+        temporaryPath = NULL;
+        return -1;
+    }
+    resumeEntries = 0;
+    savedEntries = 0;
+    savedTotal = 0;
+
+    FILE *in = fopen(file, "r");
+    if (in == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    // Fixed fields, then a pathname of known length and a newline
+    char kind;
+    unsigned long long entries;
+    unsigned long long base;
+    unsigned long long total;
+    unsigned int crc;
+    size_t length;
+    if (fscanf(in, "transplant-checkpoint %c %llu %llu %llu %x %zu ", &kind, &entries, &base, &total,
+               &crc, &length) != 6
+        || (kind != CHECKPOINT_SERIALIZE && kind != CHECKPOINT_DESERIALIZE)
+        || entries == 0 || length == 0 || length > PATH_MAX) {
+        debug("malformed checkpoint %s", file);
+        fclose(in);
+        return -1;
+    }
+    resumePath = malloc(length);
+    if (resumePath == NULL || fread(resumePath, 1, length, in) != length || fgetc(in) != '\n') {
+        debug("malformed checkpoint %s", file);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+
+    resumeEntries = entries;
+    resumeLength = length;
+    resume->kind = kind;
+    resume->entries = entries;
+    resume->base = base;
+    resume->total = total;
+    resume->crc = crc;
+    savedEntries = entries;
+    savedTotal = total;
+    return 1;
+}
+
+void checkpoint_restart() {
+    savedTotal = 0;
+}
+
+int checkpoint_replay(uint64_t index, const char *path, size_t length) {
+    if (index + 1 < resumeEntries) {
+        return 1;
+    }
+    if (index >= resumeEntries) {
+        return 0;
+    }
+
+    // The last entry done has to be the one recorded
+    if (length != resumeLength || memcmp(path, resumePath, length) != 0) {
+        debug("entry %llu is %.*s, not %.*s as checkpointed", (unsigned long long)index,
+              (int)length, path, (int)resumeLength, resumePath);
+        return -1;
+    }
+    return 1;
+}
+
+int checkpoint_due(uint64_t entries, uint64_t total) {
+    if (checkpointPath == NULL || entries < resumeEntries) {
+        return 0;
+    }
+    return entries - savedEntries >= CHECKPOINT_ENTRIES || total - savedTotal >= CHECKPOINT_BYTES;
+}
+
+int checkpoint_save(struct checkpoint *state, const char *path, size_t length) {
+    FILE *out = fopen(temporaryPath, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    fprintf(out, "transplant-checkpoint %c %llu %llu %llu %08x %zu ", state->kind,
+            (unsigned long long)state->entries, (unsigned long long)state->base,
+            (unsigned long long)state->total, state->crc, length);
+    fwrite(path, 1, length, out);
+    fputc('\n', out);
+    int failed = ferror(out);
+    if (fclose(out) == EOF || failed) {
+        unlink(temporaryPath);
+        return -1;
+    }
+    if (rename(temporaryPath, checkpointPath) == -1) {
+        return -1;
+    }
+    savedEntries = state->entries;
+    savedTotal = state->total;
+    return 0;
+}
+
+void checkpoint_finish(int success) {
+    if (checkpointPath != NULL && success) {
+        unlink(checkpointPath);
+    }
+    free(temporaryPath);
+    free(resumePath);
+    checkpointPath = NULL;
+    temporaryPath = NULL;
+    resumePath = NULL;
+    resumeEntries = 0;
+}
@@ -0,0 +1,401 @@
+#define _GNU_SOURCE
+
+#include "compress.h"
+#include "bulk.h"
+#include "crc.h"
+#include "hash.h"
+#include "index.h"
+#include "record.h"
+#include "format.h"
+#include "source.h"
+#include "stats.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The codec writes a block as a series of sequences, each made of a token
+ * byte, a run of literal bytes copied as they are, and a match that repeats
+ * earlier output.  The high nibble of the token is the number of literals and
+ * the low nibble the match length minus MIN_MATCH; a nibble of 15 is
+ * continued by bytes that are added on, up to and including the first that
+ * is not 255.  The match offset follows the literals as two little-endian
+ * bytes.  The last sequence has literals only.
+ */
+#define MIN_MATCH 4
+#define HASH_BITS 13
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash32(uint32_t value) {
+    return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Append a length that did not fit in its nibble, NULL if out of room
+static unsigned char *put_length(unsigned char *op, unsigned char *end, size_t length) {
+    while (length >= 255) {
+        if (op >= end) {
+            return NULL;
+        }
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op >= end) {
+        return NULL;
+    }
+    *op++ = length;
+    return op;
+}
+
+// Append one sequence, NULL if it does not fit before end
+static unsigned char *put_sequence(unsigned char *op, unsigned char *end, const unsigned char *literals,
+                                   size_t literalLength, size_t offset, size_t matchLength) {
+    if (op >= end) {
+        return NULL;
+    }
+    unsigned char *token = op++;
+    *token = (literalLength < 15 ? literalLength : 15) << 4;
+    if (literalLength >= 15 && (op = put_length(op, end, literalLength - 15)) == NULL) {
+        return NULL;
+    }
+    if (end - op < literalLength) {
+        return NULL;
+    }
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    // The final sequence stops after its literals
+    if (matchLength == 0) {
+        return op;
+    }
+    if (end - op < 2) {
+        return NULL;
+    }
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    matchLength -= MIN_MATCH;
+    *token |= matchLength < 15 ? matchLength : 15;
+    if (matchLength >= 15 && (op = put_length(op, end, matchLength - 15)) == NULL) {
+        return NULL;
+    }
+    return op;
+}
+
+size_t lz_compress(const char *src, size_t length, char *dst) {
+    const unsigned char *base = (const unsigned char *)src;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *end = op + length;
+
+    // Positions fit in 16 bits since a block is at most 64 KiB
+    uint16_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t misses = 0;
+    while (length > MATCH_LIMIT && ip < length - MATCH_LIMIT) {
+        uint32_t value = read32(base + ip);
+        uint32_t h = hash32(value);
+        size_t ref = table[h];
+        table[h] = ip;
+
+        if (ref >= ip || read32(base + ref) != value) {
+            // Step faster through data that does not compress
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        // Extend the match as far as the end rules allow
+        size_t matchLength = MIN_MATCH;
+        while (ip + matchLength < length - LAST_LITERALS && base[ref + matchLength] == base[ip + matchLength]) {
+            matchLength++;
+        }
+
+        op = put_sequence(op, end, base + anchor, ip - anchor, ip - ref, matchLength);
+        if (op == NULL) {
+            return 0;
+        }
+        ip += matchLength;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, end, base + anchor, length - anchor, 0, 0);
+    if (op == NULL || op >= end) {
+        return 0;
+    }
+    return op - (unsigned char *)dst;
+}
+
+// Read a continued length, -1 if the block ends first
+static long get_length(const unsigned char **ip, const unsigned char *end) {
+    long length = 0;
+    unsigned char byte;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+long lz_decompress(const char *src, size_t length, char *dst, size_t capacity) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *end = ip + length;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *outEnd = op + capacity;
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+
+        // Literals
+        long literalLength = token >> 4;
+        if (literalLength == 15) {
+            long more = get_length(&ip, end);
+            if (more == -1) {
+                return -1;
+            }
+            literalLength += more;
+        }
+        if (end - ip < literalLength || outEnd - op < literalLength) {
+            return -1;
+        }
+        memcpy(op, ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        // The last sequence has no match
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        long matchLength = token & 15;
+        if (matchLength == 15) {
+            long more = get_length(&ip, end);
+            if (more == -1) {
+                return -1;
+            }
+            matchLength += more;
+        }
+        matchLength += MIN_MATCH;
+        if (offset == 0 || offset > op - (unsigned char *)dst || outEnd - op < matchLength) {
+            return -1;
+        }
+
+        // Matches may overlap the bytes they produce, so copy forwards
+        const unsigned char *match = op - offset;
+        if (offset >= matchLength) {
+            memcpy(op, match, matchLength);
+            op += matchLength;
+        } else {
+            while (matchLength-- > 0) {
+                *op++ = *match++;
+            }
+        }
+    }
+    return op - (unsigned char *)dst;
+}
+
+size_t compress_bound(size_t length) {
+    size_t blocks = length / COMPRESS_BLOCK_SIZE + 1;
+    return length + blocks * (HEADER_SIZE + BLOCK_LENGTH_SIZE);
+}
+
+// Encode one block as a record at out, returning the size of the record
+static size_t encode_block(const char *data, size_t length, uint32_t depth, char *out) {
+    char *payload = out + HEADER_SIZE + BLOCK_LENGTH_SIZE;
+    size_t stored = length > 0 ? lz_compress(data, length, payload) : 0;
+
+    // Blocks that do not shrink are stored as they are
+    if (stored == 0) {
+        memcpy(payload, data, length);
+        stored = length;
+    }
+
+    uint64_t size = HEADER_SIZE + BLOCK_LENGTH_SIZE + stored;
+    out[0] = MAGIC0;
+    out[1] = MAGIC1;
+    out[2] = MAGIC2;
+    out[3] = COMPRESSED_BLOCK;
+    store_be32(out + 4, depth);
+    store_be64(out + 8, size);
+    store_be32(out + HEADER_SIZE, length);
+    stats_record(COMPRESSED_BLOCK, size);
+    return size;
+}
+
+size_t compress_records(const char *data, size_t length, uint32_t depth, int last, char *out) {
+    size_t produced = 0;
+
+    while (length >= COMPRESS_BLOCK_SIZE) {
+        produced += encode_block(data, COMPRESS_BLOCK_SIZE, depth, out + produced);
+        data += COMPRESS_BLOCK_SIZE;
+        length -= COMPRESS_BLOCK_SIZE;
+    }
+
+    // A short block, possibly empty, marks the end of the file
+    if (last) {
+        produced += encode_block(data, length, depth, out + produced);
+    }
+    return produced;
+}
+
+int put_compressed(int fd, off_t length, uint32_t depth, struct hash_state *state, uint32_t crc) {
+    static char block[COMPRESS_BLOCK_SIZE];
+    static char record[HEADER_SIZE + BLOCK_LENGTH_SIZE + COMPRESS_BLOCK_SIZE];
+
+    // Stop after the first short block, which may be empty
+    struct source source;
+    source_begin(&source, fd, length, 1);
+    size_t have;
+    do {
+        size_t want = length < COMPRESS_BLOCK_SIZE ? length : COMPRESS_BLOCK_SIZE;
+        have = 0;
+        uint64_t since = stats_clock();
+        while (have < want) {
+            ssize_t done = source_read(&source, block + have, want - have);
+            if (done == -1 && errno == EINTR) {
+                continue;
+            }
+            if (done <= 0) {
+                source_end(&source);
+                return -1;
+            }
+            have += done;
+        }
+        stats_charge(STATS_READ, since);
+        if (state != NULL) {
+            hash_update(state, block, have);
+        }
+        if (writer_checking()) {
+            crc = crc32c(crc, block, have);
+        }
+
+        size_t size = encode_block(block, have, depth, record);
+        if (put_data(record, size) == -1) {
+            source_end(&source);
+            return -1;
+        }
+        length -= have;
+    } while (have == COMPRESS_BLOCK_SIZE);
+
+    source_end(&source);
+    return put_checksum(depth, crc);
+}
+
+int put_compressed_data(const char *data, size_t length, uint32_t depth) {
+    static char record[HEADER_SIZE + BLOCK_LENGTH_SIZE + COMPRESS_BLOCK_SIZE];
+    index_data(length);
+
+    // Stop after the first short block, which may be empty
+    uint32_t crc = writer_checking() ? crc32c(0, data, length) : 0;
+    size_t have;
+    do {
+        have = length < COMPRESS_BLOCK_SIZE ? length : COMPRESS_BLOCK_SIZE;
+        if (put_data(record, encode_block(data, have, depth, record)) == -1) {
+            return -1;
+        }
+        data += have;
+        length -= have;
+    } while (have == COMPRESS_BLOCK_SIZE);
+    return put_checksum(depth, crc);
+}
+
+long read_block(uint32_t depth, char **data, int *last) {
+    static char block[COMPRESS_BLOCK_SIZE];
+
+    // CRC of the run decoded so far, while it is checked against the CHECKSUM record after it
+    static uint32_t runCrc;
+
+    struct record_header header;
+    if (read_header(&header) == -1) {
+        return -1;
+    }
+    if (header.type != COMPRESSED_BLOCK || header.depth != depth) {
+        return -1;
+    }
+    char *view = reader_view(header.size - HEADER_SIZE);
+    if (view == NULL) {
+        return -1;
+    }
+    uint32_t length = load_be32(view);
+    size_t stored = header.size - HEADER_SIZE - BLOCK_LENGTH_SIZE;
+    if (length > COMPRESS_BLOCK_SIZE || stored > length) {
+        return -1;
+    }
+    *last = length < COMPRESS_BLOCK_SIZE;
+
+    // Callers only skipping the contents need not decode them, unless they are checked
+    int checking = reader_checking();
+    if (data == NULL && !checking) {
+        return length;
+    }
+
+    // Stored blocks are handed out in place
+    char *bytes = view + BLOCK_LENGTH_SIZE;
+    if (stored != length) {
+        if (lz_decompress(bytes, stored, block, length) != length) {
+            debug("corrupt compressed block");
+            runCrc = 0;
+            return -1;
+        }
+        bytes = block;
+    }
+    if (checking) {
+        runCrc = crc32c(runCrc, bytes, length);
+    }
+    if (checking && *last) {
+        // The CHECKSUM record is read next, so the block is moved out of the reader's way
+        if (bytes != block) {
+            memcpy(block, bytes, length);
+            bytes = block;
+        }
+        uint32_t crc = runCrc;
+        runCrc = 0;
+        if (read_checksum(depth, crc) == -1) {
+            return -1;
+        }
+    }
+    if (data != NULL) {
+        *data = bytes;
+    }
+    return length;
+}
+
+long restore_blocks(uint32_t depth, int fd, char *dest, size_t capacity) {
+    long total = 0;
+    int last = 0;
+
+    while (!last) {
+        char *data;
+        long length = read_block(depth, fd == -1 && dest == NULL ? NULL : &data, &last);
+        if (length == -1) {
+            return -1;
+        }
+        if (dest != NULL) {
+            if (length > capacity - total) {
+                return -1;
+            }
+            memcpy(dest + total, data, length);
+        } else if (fd != -1 && bulk_write(fd, data, length) == -1) {
+            return -1;
+        }
+        total += length;
+    }
+    return total;
+}
@@ -0,0 +1,13 @@
+#include "const.h"
+
+/*
+ * The single definitions of the variables const.h declares for every file.
+ */
+
+int global_options;
+
+char name_buf[NAME_MAX];
+
+char path_buf[PATH_MAX];
+
+int path_length;
@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+
+#include "crc.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// The Castagnoli polynomial, bit-reversed, so that bit 31 stands for x^0
+#define POLY 0x82F63B78
+
+// Tables for eight bytes at a time, table[k][i] being byte i followed by k zero bytes
+static uint32_t table[8][256];
+
+// x^(2^n) modulo the polynomial, enough for any 64-bit length in bytes
+static uint32_t powers[67];
+
+// x^(8 * CRC_LANE_SIZE), which moves a CRC past one lane
+static uint32_t laneShift;
+
+// Extends an inverted CRC, picked by crc_setup() for this processor
+static uint32_t (*update)(uint32_t raw, const unsigned char *data, size_t length);
+
+static pthread_once_t setupOnce = PTHREAD_ONCE_INIT;
+
+// Multiply a and b modulo the polynomial
+static uint32_t multiply(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t product = 0;
+    while (1) {
+        if (a & m) {
+            product ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return product;
+}
+
+// x^(n * 2^k) modulo the polynomial
+static uint32_t shift(uint64_t n, int k) {
+    uint32_t p = (uint32_t)1 << 31;
+    while (n > 0) {
+        if (n & 1) {
+            p = multiply(powers[k], p);
+        }
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+static uint32_t update_table(uint32_t raw, const unsigned char *data, size_t length) {
+    while (length >= 8) {
+        uint32_t low = raw ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+        uint32_t high = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+        raw = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF]
+            ^ table[4][low >> 24] ^ table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF]
+            ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        raw = (raw >> 8) ^ table[0][(raw ^ *data) & 0xFF];
+        data++;
+        length--;
+    }
+    return raw;
+}
+
+// Join three lanes, the first carrying on from what came before
+static uint32_t join(uint32_t a, uint32_t b, uint32_t c) {
+    return ~(multiply(laneShift, multiply(laneShift, ~a) ^ ~b) ^ ~c);
+}
+
+static uint64_t load64(const unsigned char *data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t update_sse42(uint32_t raw, const unsigned char *data, size_t length) {
+    while (length >= 3 * CRC_LANE_SIZE) {
+        uint64_t a = raw;
+        uint64_t b = 0xFFFFFFFF;
+        uint64_t c = 0xFFFFFFFF;
+        const unsigned char *end = data + CRC_LANE_SIZE;
+        while (data < end) {
+            a = __builtin_ia32_crc32di(a, load64(data));
+            b = __builtin_ia32_crc32di(b, load64(data + CRC_LANE_SIZE));
+            c = __builtin_ia32_crc32di(c, load64(data + 2 * CRC_LANE_SIZE));
+            data += 8;
+        }
+        raw = join(a, b, c);
+        data += 2 * CRC_LANE_SIZE;
+        length -= 3 * CRC_LANE_SIZE;
+    }
+    uint64_t wide = raw;
+    while (length >= 8) {
+        wide = __builtin_ia32_crc32di(wide, load64(data));
+        data += 8;
+        length -= 8;
+    }
+    raw = wide;
+    while (length > 0) {
+        raw = __builtin_ia32_crc32qi(raw, *data);
+        data++;
+        length--;
+    }
+    return raw;
+}
+#endif
+
+#if defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t update_armv8(uint32_t raw, const unsigned char *data, size_t length) {
+    while (length >= 3 * CRC_LANE_SIZE) {
+        uint32_t a = raw;
+        uint32_t b = 0xFFFFFFFF;
+        uint32_t c = 0xFFFFFFFF;
+        const unsigned char *end = data + CRC_LANE_SIZE;
+        while (data < end) {
+            a = __crc32cd(a, load64(data));
+            b = __crc32cd(b, load64(data + CRC_LANE_SIZE));
+            c = __crc32cd(c, load64(data + 2 * CRC_LANE_SIZE));
+            data += 8;
+        }
+        raw = join(a, b, c);
+        data += 2 * CRC_LANE_SIZE;
+        length -= 3 * CRC_LANE_SIZE;
+    }
+    while (length >= 8) {
+        raw = __crc32cd(raw, load64(data));
+        data += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        raw = __crc32cb(raw, *data);
+        data++;
+        length--;
+    }
+    return raw;
+}
+#endif
+
+// Build the tables and pick the fastest way this processor has
+static void crc_setup() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t value = i;
+        for (int bit = 0; bit < 8; bit++) {
+            value = value & 1 ? (value >> 1) ^ POLY : value >> 1;
+        }
+        table[0][i] = value;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+        }
+    }
+
+    // Start from x^1 and square
+    uint32_t p = (uint32_t)1 << 30;
+    for (int n = 0; n < sizeof(powers) / sizeof(powers[0]); n++) {
+        powers[n] = p;
+        p = multiply(p, p);
+    }
+    laneShift = shift(CRC_LANE_SIZE, 3);
+
+    update = update_table;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        update = update_sse42;
+    }
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        update = update_armv8;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&setupOnce, crc_setup);
+    return ~update(~crc, data, length);
+}
+
+uint32_t crc32c_combine(uint32_t first, uint32_t second, uint64_t length) {
+    pthread_once(&setupOnce, crc_setup);
+    return multiply(shift(length, 3), first) ^ second;
+}
+
+uint32_t crc32c_zeros(uint32_t crc, uint64_t length) {
+    pthread_once(&setupOnce, crc_setup);
+
+    // Zero bytes only shift the register along
+    return ~multiply(shift(length, 3), ~crc);
+}
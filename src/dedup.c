@@ -0,0 +1,432 @@
+#define _GNU_SOURCE
+
+#include "dedup.h"
+#include "const.h"
+#include "bulk.h"
+#include "hash.h"
+#include "record.h"
+#include "format.h"
+#include "debug.h"
+#include "writeback.h"
+#include "select.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * A remembered file.  Its pathname lives in names.  Slots with a size of 0
+ * are free, since empty files are never remembered.
+ */
+struct content {
+    uint64_t size;
+    uint64_t hash;
+    uint64_t nameOffset;
+    uint64_t nameLength;
+};
+
+/*
+ * Open-addressed tables, kept at most half full: contents keyed by size and
+ * hash, and the sizes seen so far on their own.
+ */
+static struct content *contents;
+static size_t contentsCount;
+static size_t contentsCapacity;
+static uint64_t *sizes;
+static size_t sizesCount;
+static size_t sizesCapacity;
+
+/*
+ * Regular files with more than one link, keyed by device and inode.  Slots
+ * with a nameLength of 0 are free.
+ */
+struct link {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t hash;
+    uint64_t nameOffset;
+    uint64_t nameLength;
+};
+
+static struct link *links;
+static size_t linksCount;
+static size_t linksCapacity;
+
+// Pathnames of remembered files and links, shared by both tables
+static char *names;
+static size_t namesLength;
+static size_t namesCapacity;
+
+// Serialized directory and a '/', with room for a pathname below it
+static char prefix[PATH_MAX];
+static size_t prefixLength;
+static int active;
+
+// Spread a size and hash over the slots of a table
+static size_t slot_of(uint64_t size, uint64_t hash, size_t capacity) {
+    uint64_t mixed = (hash ^ (size * 0x9E3779B97F4A7C15ULL));
+    mixed ^= mixed >> 29;
+    return mixed & (capacity - 1);
+}
+
+int dedup_begin(const char *root) {
+    prefixLength = strlen(root);
+    if (prefixLength + 1 >= PATH_MAX) {
+        return -1;
+    }
+    memcpy(prefix, root, prefixLength);
+    prefix[prefixLength++] = '/';
+    active = 1;
+    return 0;
+}
+
+static int has_size(uint64_t size) {
+    if (sizesCount == 0) {
+        return 0;
+    }
+    for (size_t i = slot_of(size, 0, sizesCapacity); sizes[i] != 0; i = (i + 1) & (sizesCapacity - 1)) {
+        if (sizes[i] == size) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Check the remembered file c still holds the same bytes as fd
+static int same_contents(int fd, struct content *c) {
+    static char mine[BULK_MIN_DIRECT];
+    static char theirs[BULK_MIN_DIRECT];
+
+    if (prefixLength + c->nameLength >= PATH_MAX) {
+        return 0;
+    }
+    memcpy(prefix + prefixLength, names + c->nameOffset, c->nameLength);
+    prefix[prefixLength + c->nameLength] = '\0';
+    int other = open(prefix, O_RDONLY);
+    if (other == -1) {
+        return 0;
+    }
+
+    int same = 1;
+    off_t offset = 0;
+    while (same && offset < c->size) {
+        size_t want = c->size - offset < sizeof(mine) ? c->size - offset : sizeof(mine);
+        ssize_t done = pread(fd, mine, want, offset);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            same = -1;
+            break;
+        }
+
+        // Whatever the other file gives back has to match in full
+        size_t have = 0;
+        while (have < done) {
+            ssize_t got = pread(other, theirs + have, done - have, offset + have);
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                break;
+            }
+            have += got;
+        }
+        same = have == done && memcmp(mine, theirs, done) == 0;
+        offset += done;
+    }
+    close(other);
+    return same;
+}
+
+int dedup_find(int fd, off_t size, uint64_t *hash, const char **original, size_t *originalLength) {
+    if (!active || size <= 0 || !has_size(size)) {
+        return 0;
+    }
+
+    uint64_t mine;
+    if (hash_fd(fd, size, &mine) == -1) {
+        return -1;
+    }
+
+    // Equal hashes are only taken at their word once the bytes agree too
+    for (size_t i = slot_of(size, mine, contentsCapacity); contents[i].size != 0;
+         i = (i + 1) & (contentsCapacity - 1)) {
+        struct content *c = contents + i;
+        if (c->size != size || c->hash != mine || c->nameLength >= size) {
+            continue;
+        }
+        int same = same_contents(fd, c);
+        if (same == -1) {
+            return -1;
+        }
+        if (same) {
+            *hash = mine;
+            *original = names + c->nameOffset;
+            *originalLength = c->nameLength;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Double the contents table, rehashing what is in it
+static int grow_contents() {
+    size_t bigger = contentsCapacity ? contentsCapacity * 2 : 1024;
+    struct content *fresh = calloc(bigger, sizeof(struct content));
+    if (fresh == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < contentsCapacity; i++) {
+        if (contents[i].size == 0) {
+            continue;
+        }
+        size_t j = slot_of(contents[i].size, contents[i].hash, bigger);
+        while (fresh[j].size != 0) {
+            j = (j + 1) & (bigger - 1);
+        }
+        fresh[j] = contents[i];
+    }
+    free(contents);
+    contents = fresh;
+    contentsCapacity = bigger;
+    return 0;
+}
+
+// Double the sizes table, rehashing what is in it
+static int grow_sizes() {
+    size_t bigger = sizesCapacity ? sizesCapacity * 2 : 1024;
+    uint64_t *fresh = calloc(bigger, sizeof(uint64_t));
+    if (fresh == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizesCapacity; i++) {
+        if (sizes[i] == 0) {
+            continue;
+        }
+        size_t j = slot_of(sizes[i], 0, bigger);
+        while (fresh[j] != 0) {
+            j = (j + 1) & (bigger - 1);
+        }
+        fresh[j] = sizes[i];
+    }
+    free(sizes);
+    sizes = fresh;
+    sizesCapacity = bigger;
+    return 0;
+}
+
+// Make room for length more bytes of pathnames
+static int reserve_names(size_t length) {
+    if (namesLength + length <= namesCapacity) {
+        return 0;
+    }
+    size_t bigger = namesCapacity ? namesCapacity * 2 : 64 << 10;
+    while (bigger < namesLength + length) {
+        bigger *= 2;
+    }
+    char *fresh = realloc(names, bigger);
+    if (fresh == NULL) {
+        return -1;
+    }
+    names = fresh;
+    namesCapacity = bigger;
+    return 0;
+}
+
+void dedup_add(off_t size, uint64_t hash, const char *path, size_t length) {
+    if (!active || size <= 0 || contentsCount >= DEDUP_TABLE_MAX
+        || namesLength + length > DEDUP_NAMES_MAX) {
+        return;
+    }
+
+    // Make room first, so a failure leaves the tables as they were
+    if (2 * (contentsCount + 1) > contentsCapacity && grow_contents() == -1) {
+        return;
+    }
+    if (2 * (sizesCount + 1) > sizesCapacity && grow_sizes() == -1) {
+        return;
+    }
+    if (reserve_names(length) == -1) {
+        return;
+    }
+
+    size_t i = slot_of(size, hash, contentsCapacity);
+    while (contents[i].size != 0) {
+        i = (i + 1) & (contentsCapacity - 1);
+    }
+    contents[i].size = size;
+    contents[i].hash = hash;
+    contents[i].nameOffset = namesLength;
+    contents[i].nameLength = length;
+    memcpy(names + namesLength, path, length);
+    namesLength += length;
+    contentsCount++;
+
+    if (!has_size(size)) {
+        i = slot_of(size, 0, sizesCapacity);
+        while (sizes[i] != 0) {
+            i = (i + 1) & (sizesCapacity - 1);
+        }
+        sizes[i] = size;
+        sizesCount++;
+    }
+}
+
+// Slot of a file in the links table, or the free slot where it would go
+static struct link *link_slot(uint64_t dev, uint64_t ino) {
+    size_t i = slot_of(ino, dev, linksCapacity);
+    while (links[i].nameLength != 0 && (links[i].dev != dev || links[i].ino != ino)) {
+        i = (i + 1) & (linksCapacity - 1);
+    }
+    return links + i;
+}
+
+int dedup_link_find(dev_t dev, ino_t ino, const char **original, size_t *originalLength, uint64_t *hash) {
+    if (linksCount == 0) {
+        return 0;
+    }
+    struct link *l = link_slot(dev, ino);
+    if (l->nameLength == 0) {
+        return 0;
+    }
+    *original = names + l->nameOffset;
+    *originalLength = l->nameLength;
+    *hash = l->hash;
+    return 1;
+}
+
+// Double the links table, rehashing what is in it
+static int grow_links() {
+    struct link *old = links;
+    size_t oldCapacity = linksCapacity;
+    size_t bigger = linksCapacity ? linksCapacity * 2 : 1024;
+    links = calloc(bigger, sizeof(struct link));
+    if (links == NULL) {
+        links = old;
+        return -1;
+    }
+    linksCapacity = bigger;
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (old[i].nameLength != 0) {
+            *link_slot(old[i].dev, old[i].ino) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+void dedup_link_add(dev_t dev, ino_t ino, uint64_t hash, const char *path, size_t length) {
+    if (length == 0 || linksCount >= DEDUP_TABLE_MAX || namesLength + length > DEDUP_NAMES_MAX) {
+        return;
+    }
+    if (2 * (linksCount + 1) > linksCapacity && grow_links() == -1) {
+        return;
+    }
+    struct link *l = link_slot(dev, ino);
+    if (l->nameLength != 0 || reserve_names(length) == -1) {
+        return;
+    }
+    l->dev = dev;
+    l->ino = ino;
+    l->hash = hash;
+    l->nameOffset = namesLength;
+    l->nameLength = length;
+    memcpy(names + namesLength, path, length);
+    namesLength += length;
+    linksCount++;
+}
+
+void dedup_end() {
+    free(contents);
+    free(sizes);
+    free(links);
+    free(names);
+    contents = NULL;
+    sizes = NULL;
+    links = NULL;
+    names = NULL;
+    contentsCount = contentsCapacity = 0;
+    sizesCount = sizesCapacity = 0;
+    linksCount = linksCapacity = 0;
+    namesLength = namesCapacity = 0;
+    active = 0;
+}
+
+// Check a pathname from a record stays inside the target directory
+static int safe_name(const char *name, size_t length) {
+    if (length == 0 || *name == '/' || memchr(name, '\0', length) != NULL) {
+        return 0;
+    }
+    const char *end = name + length;
+    while (name < end) {
+        const char *slash = memchr(name, '/', end - name);
+        size_t part = (slash == NULL ? end : slash) - name;
+        if (part == 2 && name[0] == '.' && name[1] == '.') {
+            return 0;
+        }
+        name += part + 1;
+    }
+    return 1;
+}
+
+int dedup_restore(char *path, int rootLength, int type, uint64_t nameLength, mode_t mode) {
+    static char source[PATH_MAX];
+    if (rootLength + 1 + nameLength >= PATH_MAX) {
+        return -1;
+    }
+    memcpy(source, path, rootLength);
+    source[rootLength] = '/';
+    if (reader_read(source + rootLength + 1, nameLength) == -1) {
+        return -1;
+    }
+    source[rootLength + 1 + nameLength] = '\0';
+    if (!safe_name(source + rootLength + 1, nameLength)) {
+        debug("unsafe reference %s", source);
+        return -1;
+    }
+
+    // With --only the earlier file is only there if it was selected too
+    if (!select_match(source + rootLength + 1)) {
+        return 1;
+    }
+
+    // Clobbering replaces the name rather than writing through an old link
+    int clobber = (global_options & 0x8) == 0x8;
+    if (clobber) {
+        unlink(path);
+    }
+
+    // Hard links always share the file, references only with -L and equal modes
+    struct stat stat_buf;
+    if (stat(source, &stat_buf) == -1 || !S_ISREG(stat_buf.st_mode)) {
+        return -1;
+    }
+    int share = type == HARD_LINK
+        || ((global_options & 0x1000) == 0x1000 && (stat_buf.st_mode & 0777) == (mode & 0777));
+    if (share && link(source, path) == 0) {
+        return 0;
+    }
+
+    // Otherwise a copy, which the file system may make by sharing extents
+    int in = open(source, O_RDONLY);
+    if (in == -1) {
+        return -1;
+    }
+    int out = open(path, O_WRONLY | O_CREAT | (clobber ? O_TRUNC : O_EXCL), 0666);
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+    int getReturn = bulk_copy(in, out, stat_buf.st_size);
+    close(in);
+    writeback_release(out);
+    if (close(out) == -1) {
+        getReturn = -1;
+    }
+    return getReturn;
+}
@@ -0,0 +1,149 @@
+#include "hash.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotate(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t load64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t load32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t round64(uint64_t lane, uint64_t input) {
+    lane += input * PRIME2;
+    return rotate(lane, 31) * PRIME1;
+}
+
+static inline uint64_t merge(uint64_t hash, uint64_t lane) {
+    hash ^= round64(0, lane);
+    return hash * PRIME1 + PRIME4;
+}
+
+void hash_init(struct hash_state *state) {
+    state->lanes[0] = PRIME1 + PRIME2;
+    state->lanes[1] = PRIME2;
+    state->lanes[2] = 0;
+    state->lanes[3] = -PRIME1;
+    state->total = 0;
+    state->pendingLength = 0;
+}
+
+// Mix one 32-byte stripe into the lanes
+static inline void stripe(uint64_t *lanes, const unsigned char *p) {
+    lanes[0] = round64(lanes[0], load64(p));
+    lanes[1] = round64(lanes[1], load64(p + 8));
+    lanes[2] = round64(lanes[2], load64(p + 16));
+    lanes[3] = round64(lanes[3], load64(p + 24));
+}
+
+void hash_update(struct hash_state *state, const void *data, size_t length) {
+    const unsigned char *p = data;
+    state->total += length;
+
+    // Complete a stripe left over from the previous call first
+    if (state->pendingLength > 0) {
+        size_t want = 32 - state->pendingLength;
+        if (length < want) {
+            memcpy(state->pending + state->pendingLength, p, length);
+            state->pendingLength += length;
+            return;
+        }
+        memcpy(state->pending + state->pendingLength, p, want);
+        stripe(state->lanes, state->pending);
+        p += want;
+        length -= want;
+        state->pendingLength = 0;
+    }
+
+    while (length >= 32) {
+        stripe(state->lanes, p);
+        p += 32;
+        length -= 32;
+    }
+
+    memcpy(state->pending, p, length);
+    state->pendingLength = length;
+}
+
+uint64_t hash_final(const struct hash_state *state) {
+    const uint64_t *lanes = state->lanes;
+    uint64_t hash;
+
+    if (state->total >= 32) {
+        hash = rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12) + rotate(lanes[3], 18);
+        hash = merge(hash, lanes[0]);
+        hash = merge(hash, lanes[1]);
+        hash = merge(hash, lanes[2]);
+        hash = merge(hash, lanes[3]);
+    } else {
+        hash = lanes[2] + PRIME5;
+    }
+    hash += state->total;
+
+    // Fold in the bytes that did not make a whole stripe
+    const unsigned char *p = state->pending;
+    size_t length = state->pendingLength;
+    while (length >= 8) {
+        hash ^= round64(0, load64(p));
+        hash = rotate(hash, 27) * PRIME1 + PRIME4;
+        p += 8;
+        length -= 8;
+    }
+    if (length >= 4) {
+        hash ^= (uint64_t)load32(p) * PRIME1;
+        hash = rotate(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+        length -= 4;
+    }
+    while (length > 0) {
+        hash ^= *p * PRIME5;
+        hash = rotate(hash, 11) * PRIME1;
+        p++;
+        length--;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+int hash_fd(int fd, off_t size, uint64_t *hash) {
+    static char block[1 << 20];
+    struct hash_state state;
+    hash_init(&state);
+
+    off_t offset = 0;
+    while (offset < size) {
+        ssize_t done = pread(fd, block, size - offset < sizeof(block) ? size - offset : sizeof(block), offset);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return -1;
+        }
+        hash_update(&state, block, done);
+        offset += done;
+    }
+    *hash = hash_final(&state);
+    return 0;
+}
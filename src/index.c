@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+
+#include "index.h"
+#include "record.h"
+#include "format.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * An entry collected while serializing.  The pathname lives in names.
+ */
+struct collected {
+    uint64_t entryOffset;
+    uint64_t dataSize;
+    uint64_t pathOffset;
+    uint32_t entrySize;
+    uint32_t pathLength;
+};
+
+static int collecting;
+static struct collected *entries;
+static size_t count;
+static size_t capacity;
+static char *names;
+static size_t namesLength;
+static size_t namesCapacity;
+
+/*
+ * Pathname of the latest entry at each depth: levels[d] is the length of
+ * the prefix of current that names the directory entered at depth d.
+ */
+static char current[PATH_MAX];
+static size_t *levels;
+static size_t levelCount;
+
+int index_begin() {
+    collecting = 1;
+    count = 0;
+    namesLength = 0;
+    return 0;
+}
+
+// Grow a buffer to hold at least want elements of size bytes each
+static int grow(void **buffer, size_t *have, size_t want, size_t size) {
+    if (want <= *have) {
+        return 0;
+    }
+    size_t next = *have ? *have * 2 : 1024;
+    while (next < want) {
+        next *= 2;
+    }
+    void *bigger = realloc(*buffer, next * size);
+    if (bigger == NULL) {
+        return -1;
+    }
+    *buffer = bigger;
+    *have = next;
+    return 0;
+}
+
+int index_add(uint32_t depth, const char *name, size_t nameLength, uint64_t offset, uint32_t size) {
+    if (!collecting) {
+        return 0;
+    }
+    if (depth == 0 || grow((void **)&levels, &levelCount, depth + 1, sizeof(size_t)) == -1) {
+        return -1;
+    }
+
+    // Replace whatever followed the parent directory with this name
+    size_t length = depth == 1 ? 0 : *(levels + depth - 1);
+    if (depth > 1) {
+        current[length++] = '/';
+    }
+    if (length + nameLength >= PATH_MAX) {
+        return -1;
+    }
+    memcpy(current + length, name, nameLength);
+    length += nameLength;
+    *(levels + depth) = length;
+
+    if (grow((void **)&entries, &capacity, count + 1, sizeof(struct collected)) == -1
+        || grow((void **)&names, &namesCapacity, namesLength + length, 1) == -1) {
+        return -1;
+    }
+    struct collected *c = entries + count++;
+    c->entryOffset = offset;
+    c->dataSize = 0;
+    c->pathOffset = namesLength;
+    c->entrySize = size;
+    c->pathLength = length;
+    memcpy(names + namesLength, current, length);
+    namesLength += length;
+    return 0;
+}
+
+void index_data(uint64_t size) {
+    if (collecting && count > 0) {
+        entries[count - 1].dataSize = size;
+    }
+}
+
+// Bytewise pathname order, shorter first on a common prefix
+static int compare_paths(const char *a, size_t aLength, const char *b, size_t bLength) {
+    int order = memcmp(a, b, aLength < bLength ? aLength : bLength);
+    if (order != 0) {
+        return order;
+    }
+    return (aLength > bLength) - (aLength < bLength);
+}
+
+static int compare_collected(const void *a, const void *b) {
+    const struct collected *x = a;
+    const struct collected *y = b;
+    return compare_paths(names + x->pathOffset, x->pathLength, names + y->pathOffset, y->pathLength);
+}
+
+int index_finish() {
+    if (!collecting) {
+        return 0;
+    }
+    collecting = 0;
+
+    qsort(entries, count, sizeof(struct collected), compare_collected);
+
+    uint64_t indexOffset = writer_offset();
+    uint64_t indexSize = HEADER_SIZE + 8 + (uint64_t)count * INDEX_SLOT_SIZE + namesLength;
+    char slotBuf[INDEX_SLOT_SIZE];
+    int getReturn = put_header(INDEX, 0, indexSize);
+
+    store_be64(slotBuf, count);
+    if (getReturn == 0) {
+        getReturn = put_data(slotBuf, 8);
+    }
+
+    // Slots in pathname order, then the names in the order they were seen
+    for (size_t i = 0; i < count && getReturn == 0; i++) {
+        struct collected *c = entries + i;
+        store_be64(slotBuf, c->entryOffset);
+        store_be64(slotBuf + 8, c->dataSize);
+        store_be64(slotBuf + 16, c->pathOffset);
+        store_be32(slotBuf + 24, c->entrySize);
+        store_be32(slotBuf + 28, c->pathLength);
+        getReturn = put_data(slotBuf, INDEX_SLOT_SIZE);
+    }
+    if (getReturn == 0) {
+        getReturn = put_data(names, namesLength);
+    }
+
+    // Footer pointing back at the index
+    if (getReturn == 0) {
+        getReturn = put_header(INDEX_FOOTER, 0, INDEX_FOOTER_SIZE);
+    }
+    if (getReturn == 0) {
+        store_be64(slotBuf, indexOffset);
+        store_be64(slotBuf + 8, indexSize);
+        getReturn = put_data(slotBuf, INDEX_FOOTER_SIZE - HEADER_SIZE);
+    }
+
+    free(entries);
+    free(names);
+    free(levels);
+    entries = NULL;
+    names = NULL;
+    levels = NULL;
+    capacity = 0;
+    namesCapacity = 0;
+    levelCount = 0;
+    count = 0;
+    return getReturn;
+}
+
+/*
+ * Loaded index: the data of the INDEX record, minus its header.
+ */
+static char *loaded;
+static uint64_t loadedCount;
+static uint64_t loadedNames;
+static uint64_t loadedNamesLength;
+
+// Read exactly length bytes at offset, 0 on success and -1 otherwise
+static int read_at(int fd, void *dest, size_t length, off_t offset) {
+    char *pointer = dest;
+    while (length > 0) {
+        ssize_t done = pread(fd, pointer, length, offset);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return -1;
+        }
+        pointer += done;
+        length -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+// Check a header at p has the magic, type and depth 0 expected
+static int check_header(const char *p, int type) {
+    return (unsigned char)p[0] == MAGIC0 && (unsigned char)p[1] == MAGIC1
+        && (unsigned char)p[2] == MAGIC2 && (unsigned char)p[3] == type
+        && load_be32(p + 4) == 0 ? 0 : -1;
+}
+
+int index_load(int fd) {
+    index_unload();
+
+    struct stat stat_buf;
+    char tail[INDEX_FOOTER_SIZE + HEADER_SIZE + CHECKSUM_SIZE];
+    if (fstat(fd, &stat_buf) == -1 || stat_buf.st_size < sizeof(tail) + HEADER_SIZE) {
+        return -1;
+    }
+
+    // Footer and END_OF_TRANSMISSION are the last two records, the latter
+    // carrying a checksum if the stream has them
+    if (read_at(fd, tail, sizeof(tail), stat_buf.st_size - sizeof(tail)) == -1) {
+        return -1;
+    }
+    char *footer = tail + CHECKSUM_SIZE;
+    if (check_header(footer + INDEX_FOOTER_SIZE, END_OF_TRANSMISSION) == -1
+        || load_be64(footer + INDEX_FOOTER_SIZE + 8) != HEADER_SIZE) {
+        footer = tail;
+        if (check_header(footer + INDEX_FOOTER_SIZE, END_OF_TRANSMISSION) == -1
+            || load_be64(footer + INDEX_FOOTER_SIZE + 8) != HEADER_SIZE + CHECKSUM_SIZE) {
+            return -1;
+        }
+    }
+    if (check_header(footer, INDEX_FOOTER) == -1 || load_be64(footer + 8) != INDEX_FOOTER_SIZE) {
+        return -1;
+    }
+    uint64_t footerOffset = stat_buf.st_size - sizeof(tail) + (footer - tail);
+    uint64_t indexOffset = load_be64(footer + HEADER_SIZE);
+    uint64_t indexSize = load_be64(footer + HEADER_SIZE + 8);
+    if (indexSize < HEADER_SIZE + 8 || indexOffset + indexSize > footerOffset) {
+        return -1;
+    }
+
+    // Read the whole record and check it against its own header
+    char *record = malloc(indexSize);
+    if (record == NULL) {
+        return -1;
+    }
+    if (read_at(fd, record, indexSize, indexOffset) == -1 || check_header(record, INDEX) == -1
+        || load_be64(record + 8) != indexSize) {
+        free(record);
+        return -1;
+    }
+    uint64_t entryCount = load_be64(record + HEADER_SIZE);
+    if (entryCount > (indexSize - HEADER_SIZE - 8) / INDEX_SLOT_SIZE) {
+        free(record);
+        return -1;
+    }
+
+    loaded = record;
+    loadedCount = entryCount;
+    loadedNames = HEADER_SIZE + 8 + entryCount * INDEX_SLOT_SIZE;
+    loadedNamesLength = indexSize - loadedNames;
+    return 0;
+}
+
+int index_find(const char *path, size_t length, struct index_entry *entry) {
+    uint64_t low = 0;
+    uint64_t high = loadedCount;
+
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        const char *slot = loaded + HEADER_SIZE + 8 + middle * INDEX_SLOT_SIZE;
+        uint64_t pathOffset = load_be64(slot + 16);
+        uint32_t pathLength = load_be32(slot + 28);
+        if (pathOffset + pathLength > loadedNamesLength) {
+            return -1;
+        }
+
+        int order = compare_paths(path, length, loaded + loadedNames + pathOffset, pathLength);
+        if (order == 0) {
+            entry->entry_offset = load_be64(slot);
+            entry->data_size = load_be64(slot + 8);
+            entry->entry_size = load_be32(slot + 24);
+            return 0;
+        }
+        if (order < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return -1;
+}
+
+void index_unload() {
+    free(loaded);
+    loaded = NULL;
+    loadedCount = 0;
+}
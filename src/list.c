@@ -0,0 +1,282 @@
+#include "list.h"
+#include "const.h"
+#include "record.h"
+#include "compress.h"
+#include "sparse.h"
+#include "stats.h"
+#include "debug.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static int printing;
+static int verifying;
+
+// Pathname of the current entry relative to the serialized directory
+static char path[PATH_MAX];
+static size_t pathLength;
+
+// What stands in for the contents of the current file, printed after it
+static const char *note;
+static char target[PATH_MAX];
+static size_t targetLength;
+
+// Report the first problem found, with the entry it is in
+static int bad(const char *what) {
+    if (verifying) {
+        fprintf(stderr, "transplant: %.*s: %s\n", (int)(pathLength == 0 ? 1 : pathLength),
+                pathLength == 0 ? "." : path, what);
+    }
+    return -1;
+}
+
+// Read the name of an entry and append it to path, returning the length to go back to
+static long push(uint64_t nameLength) {
+    if (nameLength == 0 || nameLength >= NAME_MAX || pathLength + 1 + nameLength >= PATH_MAX) {
+        return bad("bad entry name");
+    }
+    long parentLength = pathLength;
+    if (pathLength != 0) {
+        path[pathLength++] = '/';
+    }
+    if (reader_read(path + pathLength, nameLength) == -1) {
+        return bad("input ends in an entry name");
+    }
+    const char *name = path + pathLength;
+    pathLength += nameLength;
+
+    // A single component, which -d would otherwise refuse or resolve elsewhere
+    if (memchr(name, '/', nameLength) != NULL || memchr(name, '\0', nameLength) != NULL
+        || (nameLength == 1 && name[0] == '.') || (nameLength == 2 && name[0] == '.' && name[1] == '.')) {
+        return bad("bad entry name");
+    }
+    return parentLength;
+}
+
+// Print the line for an entry
+static void print_entry(mode_t mode, off_t size) {
+    if (!printing) {
+        return;
+    }
+    char perms[11];
+    const char *letters = "rwxrwxrwx";
+    perms[0] = S_ISDIR(mode) ? 'd' : '-';
+    for (int i = 0; i < 9; i++) {
+        perms[i + 1] = (mode & (0400 >> i)) ? letters[i] : '-';
+    }
+    perms[10] = '\0';
+    printf("%s %12lld %.*s", perms, (long long)size, (int)pathLength, path);
+    if (note != NULL && targetLength != 0) {
+        printf(" %s %.*s", note, (int)targetLength, target);
+    } else if (note != NULL) {
+        printf(" %s", note);
+    }
+    putchar('\n');
+}
+
+// Read what follows the DIRECTORY_ENTRY of a regular file
+static int list_contents(uint32_t depth, off_t size) {
+    struct record_header header;
+    note = NULL;
+    targetLength = 0;
+    if (peek_header(&header) == -1) {
+        return bad("bad record after entry");
+    }
+    if (header.depth != depth) {
+        return bad("contents at the wrong depth");
+    }
+
+    switch (header.type) {
+    case UNCHANGED:
+        note = "unchanged";
+        return read_header(&header);
+    case FILE_DATA:
+        if (read_header(&header) == -1) {
+            return -1;
+        }
+        if (verifying && header.size - HEADER_SIZE != (uint64_t)size) {
+            return bad("contents do not match the size of the entry");
+        }
+        if (reader_skip(header.size - HEADER_SIZE) == -1) {
+            return bad("input ends in contents");
+        }
+
+        // Their CHECKSUM record is checked on the way to the next header
+        if (reader_checking() && peek_header(&header) == -1) {
+            return bad("contents do not match their checksum");
+        }
+        return 0;
+    case COMPRESSED_BLOCK: {
+        // Blocks are only decoded to be checked, and otherwise just skipped
+        uint64_t total = 0;
+        int last = 0;
+        while (!last) {
+            char *data;
+            long length = read_block(depth, verifying ? &data : NULL, &last);
+            if (length == -1) {
+                return bad("bad compressed block");
+            }
+            total += length;
+        }
+        if (verifying && total != (uint64_t)size) {
+            return bad("contents do not match the size of the entry");
+        }
+        return 0;
+    }
+    case SPARSE_DATA:
+        if (verifying) {
+            return check_sparse(depth, size) == -1 ? bad("bad sparse file") : 0;
+        }
+        return restore_sparse(depth, -1);
+    case REFERENCE:
+    case HARD_LINK:
+        if (read_header(&header) == -1) {
+            return -1;
+        }
+        note = header.type == HARD_LINK ? "->" : "=";
+        targetLength = header.size - HEADER_SIZE;
+        if (targetLength == 0 || targetLength >= PATH_MAX) {
+            return bad("bad reference");
+        }
+        return reader_read(target, targetLength);
+    default:
+        return bad("no contents after entry");
+    }
+}
+
+// Walk the records of a directory, from its START_OF_DIRECTORY to its END_OF_DIRECTORY
+static int list_directory(uint32_t depth) {
+    struct record_header header;
+    if (read_header(&header) == -1 || header.type != START_OF_DIRECTORY || header.depth != depth) {
+        return bad("directory does not start properly");
+    }
+
+    while (1) {
+        if (read_header(&header) == -1) {
+            return bad("bad record");
+        }
+        if (header.depth != depth) {
+            return bad("record at the wrong depth");
+        }
+        if (header.type == END_OF_DIRECTORY) {
+            return 0;
+        }
+
+        // Padding, and checksums that are not being checked, hold nothing to list
+        if (header.type == PADDING || (header.type == CHECKSUM && !reader_checking())) {
+            if (reader_skip(header.size - HEADER_SIZE) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (header.type == DELETED) {
+            long parentLength = push(header.size - HEADER_SIZE);
+            if (parentLength == -1) {
+                return -1;
+            }
+            if (printing) {
+                printf("deleted %.*s\n", (int)pathLength, path);
+            }
+            pathLength = parentLength;
+            continue;
+        }
+        if (header.type != DIRECTORY_ENTRY) {
+            return bad("unexpected record");
+        }
+
+        char *metadata = reader_view(ENTRY_METADATA_SIZE);
+        if (metadata == NULL) {
+            return bad("input ends in an entry");
+        }
+        mode_t mode = load_be32(metadata);
+        off_t size = load_be64(metadata + 4);
+        stats_entry(mode);
+        long parentLength = push(header.size - HEADER_SIZE - ENTRY_METADATA_SIZE);
+        if (parentLength == -1) {
+            return -1;
+        }
+
+        if (S_ISDIR(mode)) {
+            note = NULL;
+            print_entry(mode, size);
+            if (list_directory(depth + 1) == -1) {
+                return -1;
+            }
+        } else if (S_ISREG(mode)) {
+            if (list_contents(depth, size) == -1) {
+                return -1;
+            }
+            print_entry(mode, size);
+        } else {
+            return bad("neither a file nor a directory");
+        }
+        pathLength = parentLength;
+    }
+}
+
+// Step over any index to END_OF_TRANSMISSION, checking the stream's checksum if it has one
+static int list_end() {
+    if (reader_checking()) {
+        return read_end() == -1 ? bad("checksum of the stream does not match") : 0;
+    }
+    struct record_header header;
+    while (1) {
+        if (read_header(&header) == -1 || header.depth != 0) {
+            return bad("stream does not end properly");
+        }
+        if (reader_skip(header.size - HEADER_SIZE) == -1) {
+            return -1;
+        }
+        if (header.type == END_OF_TRANSMISSION
+            || (header.type == LEGACY_END_OF_TRANSMISSION && header.size == HEADER_SIZE)) {
+            return 0;
+        }
+        if (header.type != INDEX && header.type != INDEX_FOOTER) {
+            return bad("stream does not end properly");
+        }
+    }
+}
+
+int list_archive(int print, int verify) {
+    printing = print;
+    verifying = verify;
+    pathLength = 0;
+
+    // Read from the named file if there is one, otherwise stdin
+    int fd = STDIN_FILENO;
+    if (input_path != NULL) {
+        fd = open(input_path, O_RDONLY);
+        if (fd == -1) {
+            return -1;
+        }
+    }
+    reader_open(fd);
+    if (read_start() == -1) {
+        reader_close();
+        return bad("not a serialized stream");
+    }
+
+    // Only verifying needs the contents read
+    if (!verifying) {
+        reader_skim();
+    }
+    int getReturn = list_directory(1);
+    if (getReturn == 0 && verifying) {
+        getReturn = list_end();
+
+        // Nothing may follow the stream
+        if (getReturn == 0 && reader_view(1) != NULL) {
+            getReturn = bad("data after the end of the stream");
+        }
+    }
+    reader_close();
+    if (fflush(stdout) == EOF) {
+        return -1;
+    }
+    return getReturn;
+}
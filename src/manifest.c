@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+
+#include "manifest.h"
+#include "hash.h"
+#include "record.h"
+#include "format.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The base manifest, kept in memory as read, with entries pointing into it.
+ * Entries are sorted by parent directory and then by name, so the entries of
+ * one directory are adjacent.
+ */
+static char *baseText;
+static struct manifest_entry *base;
+static size_t baseCount;
+
+// Manifest being written
+static FILE *output;
+
+// Bytewise order, shorter first on a common prefix
+static int compare_bytes(const char *a, size_t aLength, const char *b, size_t bLength) {
+    int order = memcmp(a, b, aLength < bLength ? aLength : bLength);
+    if (order != 0) {
+        return order;
+    }
+    return (aLength > bLength) - (aLength < bLength);
+}
+
+// Length of the parent directory's pathname within path
+static size_t parent_length(const char *path, size_t length) {
+    const char *slash = memrchr(path, '/', length);
+    return slash == NULL ? 0 : slash - path;
+}
+
+// Order of two pathnames by parent directory, then name
+static int compare_keys(const char *a, size_t aLength, size_t aParent,
+                        const char *b, size_t bLength, size_t bParent) {
+    int order = compare_bytes(a, aParent, b, bParent);
+    if (order != 0) {
+        return order;
+    }
+    return compare_bytes(a + aParent, aLength - aParent, b + bParent, bLength - bParent);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const struct manifest_entry *x = a;
+    const struct manifest_entry *y = b;
+    return compare_keys(x->path, x->path_length, x->parent_length,
+                        y->path, y->path_length, y->parent_length);
+}
+
+// Read all of a file into memory, with a terminator after it
+static char *slurp(char *file, size_t *length) {
+    int fd = open(file, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    char *text = malloc(stat_buf.st_size + 1);
+    size_t have = 0;
+    while (text != NULL && have < stat_buf.st_size) {
+        ssize_t done = read(fd, text + have, stat_buf.st_size - have);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            free(text);
+            text = NULL;
+            break;
+        }
+        have += done;
+    }
+    close(fd);
+
+    if (text != NULL) {
+        text[have] = '\0';
+        *length = have;
+    }
+    return text;
+}
+
+int manifest_load(char *file) {
+    size_t length;
+    baseText = slurp(file, &length);
+    if (baseText == NULL) {
+        return -1;
+    }
+
+    size_t capacity = 0;
+    char *pointer = baseText;
+    char *end = baseText + length;
+    while (pointer < end) {
+        if (baseCount == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            struct manifest_entry *bigger = realloc(base, capacity * sizeof(struct manifest_entry));
+            if (bigger == NULL) {
+                return -1;
+            }
+            base = bigger;
+        }
+
+        // Fixed fields, then a pathname of known length and a newline
+        struct manifest_entry *e = base + baseCount;
+        unsigned int mode;
+        long long size;
+        long long sec;
+        unsigned long long ino;
+        unsigned long long hash;
+        size_t pathLength;
+        int used;
+        if (sscanf(pointer, "%o %lld %lld %ld %llu %llx %zu %n", &mode, &size, &sec,
+                   &e->mtime_nsec, &ino, &hash, &pathLength, &used) != 7
+            || pathLength == 0 || pathLength >= end - pointer - used
+            || pointer[used + pathLength] != '\n') {
+            debug("malformed manifest line %zu", baseCount + 1);
+            return -1;
+        }
+        e->mode = mode;
+        e->size = size;
+        e->mtime_sec = sec;
+        e->ino = ino;
+        e->hash = hash;
+        e->path = pointer + used;
+        e->path_length = pathLength;
+        e->parent_length = parent_length(e->path, pathLength);
+        e->seen = 0;
+        baseCount++;
+        pointer += used + pathLength + 1;
+    }
+
+    qsort(base, baseCount, sizeof(struct manifest_entry), compare_entries);
+    return 0;
+}
+
+// First entry not ordered before the key
+static size_t lower_bound(const char *path, size_t length, size_t parent) {
+    size_t low = 0;
+    size_t high = baseCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        struct manifest_entry *e = base + middle;
+        if (compare_keys(e->path, e->path_length, e->parent_length, path, length, parent) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+struct manifest_entry *manifest_find(const char *path, size_t length) {
+    size_t parent = parent_length(path, length);
+    size_t i = lower_bound(path, length, parent);
+    if (i < baseCount && compare_bytes(base[i].path, base[i].path_length, path, length) == 0) {
+        return base + i;
+    }
+    return NULL;
+}
+
+// Hash the first size bytes of a file
+static int hash_file(char *path, off_t size, uint64_t *hash) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int getReturn = hash_fd(fd, size, hash);
+    close(fd);
+    return getReturn;
+}
+
+int manifest_unchanged(struct manifest_entry *entry, struct stat *stat_buf, char *path) {
+    if (entry->mode != stat_buf->st_mode || entry->size != stat_buf->st_size) {
+        return 0;
+    }
+    if (entry->mtime_sec == stat_buf->st_mtim.tv_sec && entry->mtime_nsec == stat_buf->st_mtim.tv_nsec
+        && entry->ino == stat_buf->st_ino) {
+        return 1;
+    }
+
+    // Touched or replaced, but possibly with the same contents
+    uint64_t hash;
+    return hash_file(path, stat_buf->st_size, &hash) == 0 && hash == entry->hash;
+}
+
+int manifest_emit_deleted(const char *dir, size_t dirLength, uint32_t depth) {
+    // Children of the top directory have no parent part to skip
+    size_t skip = dirLength == 0 ? 0 : dirLength + 1;
+
+    for (size_t i = lower_bound(dir, dirLength, dirLength); i < baseCount; i++) {
+        struct manifest_entry *e = base + i;
+        if (compare_bytes(e->path, e->parent_length, dir, dirLength) != 0) {
+            break;
+        }
+        if (e->seen) {
+            continue;
+        }
+        size_t nameLength = e->path_length - skip;
+        if (put_header(DELETED, depth, HEADER_SIZE + nameLength) == -1
+            || put_data(e->path + skip, nameLength) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int manifest_create(char *file) {
+    output = fopen(file, "w");
+    return output == NULL ? -1 : 0;
+}
+
+int manifest_add(const char *path, size_t length, struct stat *stat_buf, uint64_t hash) {
+    if (output == NULL) {
+        return 0;
+    }
+    fprintf(output, "%o %lld %lld %ld %llu %016llx %zu ", stat_buf->st_mode,
+            (long long)stat_buf->st_size, (long long)stat_buf->st_mtim.tv_sec,
+            stat_buf->st_mtim.tv_nsec, (unsigned long long)stat_buf->st_ino,
+            (unsigned long long)hash, length);
+    fwrite(path, 1, length, output);
+    return putc('\n', output) == EOF ? -1 : 0;
+}
+
+int manifest_close() {
+    if (output == NULL) {
+        return 0;
+    }
+    int getReturn = fclose(output) == EOF ? -1 : 0;
+    output = NULL;
+    return getReturn;
+}
+
+static int remove_entry(const char *path, const struct stat *stat_buf, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+int remove_tree(char *path) {
+    struct stat stat_buf;
+    if (lstat(path, &stat_buf) == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (!S_ISDIR(stat_buf.st_mode)) {
+        return unlink(path);
+    }
+
+    // Children first, without following symbolic links
+    return nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
@@ -0,0 +1,953 @@
+#define _GNU_SOURCE
+
+#include "const.h"
+#include "format.h"
+#include "debug.h"
+#include "bulk.h"
+#include "helpers.h"
+#include "parallel.h"
+#include "record.h"
+#include "index.h"
+#include "compress.h"
+#include "crc.h"
+#include "dedup.h"
+#include "sparse.h"
+#include "uring.h"
+#include "scan.h"
+#include "source.h"
+#include "stats.h"
+#include "writeback.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Kinds of traversal entries handed from the walker to the writer.
+ */
+#define JOB_START_DIR 0
+#define JOB_ENTRY 1
+#define JOB_END_DIR 2
+#define JOB_FINISH 3
+
+/*
+ * States of a slot in the window.  Regular file entries are published as
+ * SLOT_PENDING and become SLOT_READY once a worker has read their contents,
+ * every other entry is published as SLOT_READY straight away.
+ */
+#define SLOT_FREE 0
+#define SLOT_PENDING 1
+#define SLOT_BUSY 2
+#define SLOT_READY 3
+
+/*
+ * A directory being walked, shared by the jobs for the files in it so that
+ * each is opened by name relative to it, as serialize_file() does.
+ */
+struct walk_dir {
+    int fd;
+    int refs;
+};
+
+struct job {
+    int kind;
+    int state;
+    int depth;
+    int error;
+    mode_t mode;
+    off_t size;
+    char *name;
+    struct walk_dir *dir;
+    char *link;
+    int holes;
+    int fd;
+    char *data;
+    size_t dataLength;
+    size_t rawLength;
+    uint32_t crc;
+    long reserved;
+};
+
+/*
+ * Ring of traversal entries.  Entries with sequence numbers in [head, tail)
+ * are in flight; workers hand out file reads in sequence order starting at
+ * dispatch, and the writer always consumes the slot at head.
+ */
+static struct job *window;
+static unsigned long head;
+static unsigned long tail;
+static unsigned long dispatch;
+
+// Prefetch bytes still available to the workers
+static long budget;
+
+// Set when the walker has published its final entry
+static int walkDone;
+
+// Set when the writer gives up, so that every thread winds down
+static int aborting;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walkerCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workerCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writerCond = PTHREAD_COND_INITIALIZER;
+
+// The walker's own copy of the current path, and the length of its root
+static char walkPath[PATH_MAX];
+static size_t walkLength;
+static size_t walkRoot;
+
+static struct job *slot(unsigned long seq) {
+    return window + (seq % PARALLEL_WINDOW);
+}
+
+// Wait for room in the window and return the next slot to fill
+static struct job *walk_slot() {
+    pthread_mutex_lock(&lock);
+    while (!aborting && tail - head >= PARALLEL_WINDOW) {
+        pthread_cond_wait(&walkerCond, &lock);
+    }
+    if (aborting) {
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    struct job *j = slot(tail);
+    pthread_mutex_unlock(&lock);
+
+    j->state = SLOT_FREE;
+    j->depth = 0;
+    j->error = 0;
+    j->mode = 0;
+    j->size = 0;
+    j->name = NULL;
+    j->dir = NULL;
+    j->link = NULL;
+    j->holes = 0;
+    j->fd = -1;
+    j->data = NULL;
+    j->dataLength = 0;
+    j->rawLength = 0;
+    j->crc = 0;
+    j->reserved = 0;
+    return j;
+}
+
+// Make a filled slot visible to the workers and the writer
+static void walk_publish(struct job *j, int state) {
+    pthread_mutex_lock(&lock);
+    j->state = state;
+    tail++;
+    if (state == SLOT_PENDING) {
+        pthread_cond_signal(&workerCond);
+    } else {
+        pthread_cond_signal(&writerCond);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Publish an entry that only carries its kind and depth
+static int walk_marker(int kind, int depth) {
+    struct job *j = walk_slot();
+    if (j == NULL) {
+        return -1;
+    }
+    j->kind = kind;
+    j->depth = depth;
+    walk_publish(j, SLOT_READY);
+    return 0;
+}
+
+// Let go of a directory, closing it once no job needs it any more
+static void walk_dir_release(struct walk_dir *shared) {
+    if (shared != NULL && __atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(shared->fd);
+        free(shared);
+    }
+}
+
+// Give a job a hold on the directory its file is in, sharing it from the first file on
+static int walk_dir_attach(struct job *j, struct scan *dir, struct walk_dir **shared) {
+    if (*shared == NULL) {
+        // The scan closes its own descriptor when it is done, which may be before the job's turn
+        struct walk_dir *created = malloc(sizeof(struct walk_dir));
+        if (created == NULL) {
+            return -1;
+        }
+        created->fd = fcntl(scan_fd(dir), F_DUPFD_CLOEXEC, 0);
+        if (created->fd == -1) {
+            free(created);
+            return -1;
+        }
+        created->refs = 1;
+        *shared = created;
+    }
+    __atomic_add_fetch(&(*shared)->refs, 1, __ATOMIC_RELAXED);
+    j->dir = *shared;
+    return 0;
+}
+
+// Same traversal as serialize_directory(), publishing entries instead of records
+static int walk_directory(int dirfd, const char *dirName, int depth) {
+    // The scan stats each entry relative to the directory and sorts them, as the single thread does
+    int scanFlags = 0;
+    if ((global_options & OPTION_BY_NAME) == OPTION_BY_NAME) {
+        scanFlags = SCAN_BY_NAME;
+    } else if ((global_options & OPTION_BY_INODE) == OPTION_BY_INODE) {
+        scanFlags = SCAN_BY_INODE;
+    }
+    struct scan *dir = scan_open(dirfd, dirName, scanFlags);
+    if (dir == NULL) {
+        return -1;
+    }
+    struct walk_dir *shared = NULL;
+
+    if (walk_marker(JOB_START_DIR, depth) == -1) {
+        scan_close(dir);
+        return -1;
+    }
+
+    char *name;
+    struct stat stat_buf;
+    int getReturn;
+    while ((getReturn = scan_next(dir, &name, &stat_buf)) == 1) {
+        // Push the name onto the walker's path
+        size_t nameLength = strlen(name);
+        size_t savedLength = walkLength;
+        if (walkLength + nameLength + 2 > PATH_MAX) {
+            walk_dir_release(shared);
+            scan_close(dir);
+            return -1;
+        }
+        walkPath[walkLength] = '/';
+        memcpy(walkPath + walkLength + 1, name, nameLength + 1);
+        walkLength += nameLength + 1;
+
+        struct job *j = walk_slot();
+        if (j == NULL) {
+            walk_dir_release(shared);
+            scan_close(dir);
+            return -1;
+        }
+        j->kind = JOB_ENTRY;
+        j->depth = depth;
+        j->mode = stat_buf.st_mode;
+        j->size = stat_buf.st_size;
+        j->name = strdup(name);
+
+        // Further links to a file are ready now with -H, as they carry no contents
+        const char *original;
+        size_t originalLength;
+        uint64_t hash;
+        if (S_ISREG(stat_buf.st_mode) && stat_buf.st_nlink > 1 && (global_options & 0x2000000) == 0x2000000) {
+            if (dedup_link_find(stat_buf.st_dev, stat_buf.st_ino, &original, &originalLength, &hash)) {
+                j->link = strndup(original, originalLength);
+            } else {
+                dedup_link_add(stat_buf.st_dev, stat_buf.st_ino, 0, walkPath + walkRoot + 1,
+                               walkLength - walkRoot - 1);
+            }
+        }
+
+        // Files to be read are opened by name in the directory, which stays open for them
+        if (S_ISREG(stat_buf.st_mode) && j->link == NULL && walk_dir_attach(j, dir, &shared) == -1) {
+            j->error = 1;
+        }
+
+        // Files that may have holes are mapped by the writer when their turn comes, with -S
+        if (S_ISREG(stat_buf.st_mode) && j->link == NULL && (global_options & 0x4000000) == 0x4000000
+            && stat_buf.st_size > 0
+            && (off_t)stat_buf.st_blocks * 512 < stat_buf.st_size) {
+            j->holes = 1;
+            walk_publish(j, SLOT_READY);
+        }
+        // Regular files wait for a worker, everything else is ready now
+        else if (S_ISREG(stat_buf.st_mode) && j->link == NULL && !j->error) {
+            walk_publish(j, SLOT_PENDING);
+        } else {
+            walk_publish(j, SLOT_READY);
+        }
+
+        if (S_ISDIR(stat_buf.st_mode) && walk_directory(scan_fd(dir), name, depth + 1) == -1) {
+            walk_dir_release(shared);
+            scan_close(dir);
+            return -1;
+        }
+
+        walkLength = savedLength;
+        walkPath[walkLength] = '\0';
+    }
+    walk_dir_release(shared);
+    scan_close(dir);
+    if (getReturn == -1) {
+        return -1;
+    }
+
+    return walk_marker(JOB_END_DIR, depth);
+}
+
+static void *walker_main(void *arg) {
+    int depth = *(int *)arg;
+    int getReturn = walk_directory(AT_FDCWD, walkPath, depth);
+
+    // Tell the writer how the traversal ended
+    struct job *j = walk_slot();
+    if (j != NULL) {
+        j->kind = JOB_FINISH;
+        j->error = getReturn == -1;
+        walk_publish(j, SLOT_READY);
+    }
+
+    pthread_mutex_lock(&lock);
+    walkDone = 1;
+    pthread_cond_broadcast(&workerCond);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// Open a file and read up to want bytes of it into the slot
+static void read_job(struct job *j, long want) {
+    int fd = openat(j->dir->fd, j->name, O_RDONLY);
+    if (fd == -1) {
+        j->error = 1;
+        return;
+    }
+
+    if (want > 0) {
+        j->data = malloc(want);
+        if (j->data == NULL) {
+            close(fd);
+            j->error = 1;
+            return;
+        }
+    }
+
+    // Not enough data bytes in the file is an error, as in serialize_file()
+    struct source source;
+    source_begin(&source, fd, want, 0);
+    uint64_t since = stats_clock();
+    while (j->dataLength < want) {
+        ssize_t done = source_read(&source, j->data + j->dataLength, want - j->dataLength);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            source_end(&source);
+            close(fd);
+            j->error = 1;
+            return;
+        }
+        j->dataLength += done;
+    }
+    stats_charge(STATS_READ, since);
+    source_end(&source);
+
+    // With -z the prefetched blocks are compressed here, in parallel
+    j->rawLength = j->dataLength;
+    if ((global_options & 0x400) == 0x400) {
+        // The CHECKSUM record after the blocks covers the contents before they were compressed
+        if (writer_checking()) {
+            j->crc = crc32c(0, j->data, j->dataLength);
+        }
+        char *records = malloc(compress_bound(j->dataLength));
+        if (records == NULL) {
+            close(fd);
+            j->error = 1;
+            return;
+        }
+        j->dataLength = compress_records(j->data, j->dataLength, j->depth, j->size == want, records);
+        free(j->data);
+        j->data = records;
+    }
+
+    // Keep the file open if the writer has to stream the rest
+    if (j->size > want) {
+        j->fd = fd;
+    } else {
+        close(fd);
+    }
+}
+
+static void *worker_main(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (!aborting) {
+        // Find the earliest file still waiting to be read
+        while (dispatch < tail && slot(dispatch)->state != SLOT_PENDING) {
+            dispatch++;
+        }
+        if (dispatch == tail) {
+            if (walkDone) {
+                break;
+            }
+            pthread_cond_wait(&workerCond, &lock);
+            continue;
+        }
+
+        unsigned long seq = dispatch++;
+        struct job *j = slot(seq);
+        j->state = SLOT_BUSY;
+
+        // Wait for budget, except for the entry the writer is waiting on
+        long want = j->size < PARALLEL_PREFETCH_MAX ? j->size : PARALLEL_PREFETCH_MAX;
+        while (!aborting && want > budget && seq != head) {
+            pthread_cond_wait(&workerCond, &lock);
+        }
+        if (aborting) {
+            break;
+        }
+        budget -= want;
+        j->reserved = want;
+        pthread_mutex_unlock(&lock);
+
+        read_job(j, want);
+
+        pthread_mutex_lock(&lock);
+        j->state = SLOT_READY;
+        if (seq == head) {
+            pthread_cond_signal(&writerCond);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// Emit the records for one traversal entry
+static int emit_job(struct job *j) {
+    if (j->kind == JOB_START_DIR) {
+        return put_header(START_OF_DIRECTORY, j->depth, HEADER_SIZE);
+    }
+    if (j->kind == JOB_END_DIR) {
+        return put_header(END_OF_DIRECTORY, j->depth, HEADER_SIZE);
+    }
+
+    // Directory entry with its metadata and name
+    if (put_entry(j->depth, j->mode, j->size, j->name, strlen(j->name)) == -1) {
+        return -1;
+    }
+
+    if (!S_ISREG(j->mode)) {
+        return 0;
+    }
+    if (j->link != NULL) {
+        size_t linkLength = strlen(j->link);
+        if (put_header(HARD_LINK, j->depth, HEADER_SIZE + linkLength) == -1) {
+            return -1;
+        }
+        return put_data(j->link, linkLength);
+    }
+
+    // Files that may have holes were left unread
+    if (j->holes) {
+        j->fd = openat(j->dir->fd, j->name, O_RDONLY);
+        if (j->fd == -1) {
+            return -1;
+        }
+        int sparse = put_sparse(j->fd, j->size, j->depth, NULL);
+        if (sparse != 0) {
+            return sparse == 1 ? 0 : -1;
+        }
+    }
+
+    // Compressed blocks, the prefetched ones already encoded by the worker
+    if ((global_options & 0x400) == 0x400) {
+        index_data(j->size);
+        if (put_data(j->data, j->dataLength) == -1) {
+            return -1;
+        }
+        if (j->size > j->rawLength) {
+            return put_compressed(j->fd, j->size - j->rawLength, j->depth, NULL, j->crc);
+        }
+        return put_checksum(j->depth, j->crc);
+    }
+
+    // File data, prefetched part first and then whatever is left in the file
+    if (put_header(FILE_DATA, j->depth, HEADER_SIZE + j->size) == -1) {
+        return -1;
+    }
+    if (put_data(j->data, j->dataLength) == -1) {
+        return -1;
+    }
+    if (j->size > j->rawLength) {
+        return put_payload(j->fd, j->size - j->rawLength);
+    }
+    return 0;
+}
+
+static void release_job(struct job *j) {
+    free(j->name);
+    walk_dir_release(j->dir);
+    free(j->link);
+    free(j->data);
+    if (j->fd != -1) {
+        close(j->fd);
+    }
+    j->name = NULL;
+    j->dir = NULL;
+    j->link = NULL;
+    j->data = NULL;
+    j->fd = -1;
+    j->state = SLOT_FREE;
+}
+
+int serialize_parallel(int depth, int workers) {
+    if (path_length + 1 > PATH_MAX) {
+        return -1;
+    }
+    window = calloc(PARALLEL_WINDOW, sizeof(struct job));
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    if (window == NULL || threads == NULL) {
+        free(window);
+        free(threads);
+        return -1;
+    }
+
+    memcpy(walkPath, path_buf, path_length + 1);
+    walkLength = path_length;
+    walkRoot = path_length;
+    head = 0;
+    tail = 0;
+    dispatch = 0;
+    budget = (long)workers * PARALLEL_WORKER_BUDGET;
+    walkDone = 0;
+    aborting = 0;
+
+    // Start the walker and the readers
+    pthread_t walker;
+    int getReturn = 0;
+    if (pthread_create(&walker, NULL, walker_main, &depth) != 0) {
+        free(window);
+        free(threads);
+        return -1;
+    }
+    int started = 0;
+    while (started < workers) {
+        if (pthread_create(threads + started, NULL, worker_main, NULL) != 0) {
+            getReturn = -1;
+            break;
+        }
+        started++;
+    }
+
+    // Emit entries strictly in traversal order
+    while (getReturn == 0) {
+        pthread_mutex_lock(&lock);
+        while (slot(head)->state != SLOT_READY) {
+            pthread_cond_wait(&writerCond, &lock);
+        }
+        pthread_mutex_unlock(&lock);
+
+        struct job *j = slot(head);
+        if (j->kind == JOB_FINISH) {
+            getReturn = j->error ? -1 : 0;
+            break;
+        }
+        if (j->error || emit_job(j) == -1) {
+            getReturn = -1;
+            break;
+        }
+        release_job(j);
+
+        pthread_mutex_lock(&lock);
+        budget += j->reserved;
+        head++;
+        pthread_cond_broadcast(&workerCond);
+        pthread_cond_signal(&walkerCond);
+        pthread_mutex_unlock(&lock);
+    }
+
+    // Wind every thread down and drop whatever is still in flight
+    pthread_mutex_lock(&lock);
+    aborting = 1;
+    pthread_cond_broadcast(&walkerCond);
+    pthread_cond_broadcast(&workerCond);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(walker, NULL);
+    for (int i = 0; i < started; i++) {
+        pthread_join(*(threads + i), NULL);
+    }
+    for (unsigned long seq = head; seq < tail; seq++) {
+        release_job(slot(seq));
+    }
+
+    free(window);
+    free(threads);
+    window = NULL;
+    return getReturn;
+}
+
+/*
+ * A file queued for the writer pool, a directory queued on the ring, or a
+ * mode deferred until the end.
+ */
+struct write_job {
+    char *path;
+    mode_t mode;
+    char *data;
+    size_t length;
+    struct uring_io io;
+    struct write_job *next;
+};
+
+static struct write_job *queueHead;
+static struct write_job *queueTail;
+static struct write_job *deferred;
+static struct write_job *deferredTail;
+static long queuedBytes;
+static long queueBudget;
+static int activeWriters;
+static int poolClosing;
+static int poolFailed;
+static int poolSize;
+static pthread_t *poolThreads;
+
+// Nonzero if the queue holds writes in flight on the ring rather than work for threads
+static int poolRing;
+
+// The last directory queued on the ring while it is still in flight, otherwise NULL
+static struct write_job *lastDir;
+
+// The process's umask, which the modes things are created with pass through
+static mode_t poolUmask;
+
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drainCond = PTHREAD_COND_INITIALIZER;
+
+// Flags to create a file with, following the ``clobber'' option
+static int create_flags() {
+    if ((global_options & 0x8) == 0x8) {
+        return O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    return O_WRONLY | O_CREAT | O_EXCL;
+}
+
+// Create, fill and chmod one file
+static int write_file(struct write_job *w) {
+    int fd = open(w->path, create_flags(), 0666);
+    if (fd == -1) {
+        return -1;
+    }
+    if (bulk_write(fd, w->data, w->length) == -1) {
+        close(fd);
+        return -1;
+    }
+    writeback_release(fd);
+    if (close(fd) == -1) {
+        return -1;
+    }
+    return chmod(w->path, w->mode & 0777);
+}
+
+static void free_write_job(struct write_job *w) {
+    free(w->path);
+    free(w->data);
+    free(w);
+}
+
+static void *writer_main(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (queueHead == NULL && !poolClosing) {
+            pthread_cond_wait(&queueCond, &lock);
+        }
+        if (queueHead == NULL) {
+            break;
+        }
+
+        struct write_job *w = queueHead;
+        queueHead = w->next;
+        if (queueHead == NULL) {
+            queueTail = NULL;
+        }
+        activeWriters++;
+        pthread_mutex_unlock(&lock);
+
+        int getReturn = write_file(w);
+        long length = w->length;
+        free_write_job(w);
+
+        pthread_mutex_lock(&lock);
+        activeWriters--;
+        queuedBytes -= length;
+        if (getReturn == -1) {
+            poolFailed = 1;
+        }
+        pthread_cond_broadcast(&drainCond);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int restore_pool_start(int workers) {
+    queueHead = NULL;
+    queueTail = NULL;
+    deferred = NULL;
+    deferredTail = NULL;
+    queuedBytes = 0;
+    queueBudget = (long)workers * PARALLEL_WORKER_BUDGET;
+    activeWriters = 0;
+    poolClosing = 0;
+    poolFailed = 0;
+    lastDir = NULL;
+    poolUmask = umask(0);
+    umask(poolUmask);
+
+    // The ring stands in for the threads when it can be had
+    poolRing = (global_options & 0x2000) == 0x2000 && uring_start() == 0;
+    if (poolRing) {
+        return 0;
+    }
+    poolThreads = calloc(workers, sizeof(pthread_t));
+    if (poolThreads == NULL) {
+        return -1;
+    }
+    for (poolSize = 0; poolSize < workers; poolSize++) {
+        if (pthread_create(poolThreads + poolSize, NULL, writer_main, NULL) != 0) {
+            restore_pool_finish();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Build a job holding its own copy of the path
+static struct write_job *new_write_job(char *path, mode_t mode) {
+    struct write_job *w = calloc(1, sizeof(struct write_job));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->path = strdup(path);
+    if (w->path == NULL) {
+        free(w);
+        return NULL;
+    }
+    w->mode = mode;
+    return w;
+}
+
+// Check whether creating with the permission bits of mode leaves them as they are
+static int creates_mode(mode_t mode) {
+    if (S_ISDIR(mode) && (mode & 0700) != 0700) {
+        // A directory has to stay open to its owner until its contents are in
+        return 0;
+    }
+    return (mode & 0777 & poolUmask) == 0;
+}
+
+// Add a mode to those applied once everything has landed
+static int defer_mode(char *path, mode_t mode) {
+    struct write_job *w = new_write_job(path, mode);
+    if (w == NULL) {
+        return -1;
+    }
+
+    // Only the parser touches this list, so no locking is needed
+    if (deferredTail == NULL) {
+        deferred = w;
+    } else {
+        deferredTail->next = w;
+    }
+    deferredTail = w;
+    return 0;
+}
+
+// Finish the oldest write or directory in flight on the ring, waiting for it if need be
+static void ring_complete() {
+    struct write_job *w = queueHead;
+    queueHead = w->next;
+    if (queueHead == NULL) {
+        queueTail = NULL;
+    }
+    if (w == lastDir) {
+        lastDir = NULL;
+    }
+
+    // A file created with its mode needs no chmod, but one it already had does
+    int getReturn = uring_wait(&w->io);
+    int clobber = (global_options & 0x8) == 0x8;
+    if (S_ISDIR(w->mode) && getReturn == -1 && w->io.error == -EEXIST && clobber) {
+        // Clobber may reuse a directory, whose mode then waits for the end like the rest
+        getReturn = creates_mode(w->mode) ? defer_mode(w->path, w->mode) : 0;
+    } else if (!S_ISDIR(w->mode) && getReturn == 0 && (clobber || !creates_mode(w->mode))) {
+        getReturn = chmod(w->path, w->mode & 0777);
+    }
+    if (getReturn == -1) {
+        poolFailed = 1;
+    }
+    queuedBytes -= w->length;
+    free_write_job(w);
+}
+
+// Queue a write or a directory on the ring, first finishing what has to make room for it
+static int ring_submit(struct write_job *w) {
+    if (uring_poll() == -1) {
+        poolFailed = 1;
+    }
+    while (queueHead != NULL && (queueHead->io.pending == 0
+                                 || queuedBytes + (long)w->length > queueBudget)) {
+        ring_complete();
+    }
+
+    // Made with its final mode when that comes out right, so no chmod has to follow
+    mode_t mode = creates_mode(w->mode) ? w->mode & 0777 : S_ISDIR(w->mode) ? 0700 : 0666;
+    int getReturn = poolFailed ? -1 : 0;
+    if (getReturn == 0 && S_ISDIR(w->mode)) {
+        getReturn = uring_mkdir(w->path, mode, &w->io);
+    } else if (getReturn == 0) {
+        getReturn = uring_write(w->path, create_flags(), mode, w->data, w->length, &w->io);
+    }
+    if (getReturn == -1) {
+        poolFailed = 1;
+        free_write_job(w);
+        return -1;
+    }
+    if (queueTail == NULL) {
+        queueHead = w;
+    } else {
+        queueTail->next = w;
+    }
+    queueTail = w;
+    queuedBytes += w->length;
+    if (S_ISDIR(w->mode)) {
+        lastDir = w;
+    }
+    return 0;
+}
+
+int restore_pool_submit(char *path, mode_t mode, char *data, size_t length) {
+    struct write_job *w = new_write_job(path, mode);
+    if (w == NULL) {
+        free(data);
+        return -1;
+    }
+    w->data = data;
+    w->length = length;
+    if (poolRing) {
+        return ring_submit(w);
+    }
+
+    // Hold the parser back while too much is queued
+    pthread_mutex_lock(&lock);
+    while (!poolFailed && queuedBytes > 0 && queuedBytes + (long)length > queueBudget) {
+        pthread_cond_wait(&drainCond, &lock);
+    }
+    if (poolFailed) {
+        pthread_mutex_unlock(&lock);
+        free_write_job(w);
+        return -1;
+    }
+    if (queueTail == NULL) {
+        queueHead = w;
+    } else {
+        queueTail->next = w;
+    }
+    queueTail = w;
+    queuedBytes += length;
+    pthread_cond_signal(&queueCond);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int restore_pool_read(char *path, mode_t mode, int depth, size_t length, int compressed) {
+    char *data = NULL;
+    if (length > 0) {
+        data = malloc(length);
+        if (data == NULL) {
+            return -1;
+        }
+    }
+    int getReturn;
+    if (compressed) {
+        getReturn = restore_blocks(depth, -1, data, length) == (long)length ? 0 : -1;
+    } else {
+        getReturn = reader_read(data, length);
+    }
+    if (getReturn == -1) {
+        free(data);
+        return -1;
+    }
+    return restore_pool_submit(path, mode, data, length);
+}
+
+int restore_pool_mkdir(char *path, mode_t mode) {
+    if (!poolRing) {
+        return 1;
+    }
+    struct write_job *w = new_write_job(path, mode);
+    if (w == NULL) {
+        return -1;
+    }
+    return ring_submit(w);
+}
+
+int restore_pool_settle() {
+    if (!poolRing) {
+        return 0;
+    }
+    while (lastDir != NULL) {
+        ring_complete();
+    }
+    return poolFailed ? -1 : 0;
+}
+
+int restore_pool_chmod(char *path, mode_t mode) {
+    // A directory the ring made with its mode already has it, and one it found has it deferred
+    if (poolRing && S_ISDIR(mode) && creates_mode(mode)) {
+        return 0;
+    }
+    return defer_mode(path, mode);
+}
+
+int restore_pool_defer_mode(char *path, mode_t mode) {
+    return defer_mode(path, mode);
+}
+
+int restore_pool_drain() {
+    if (poolRing) {
+        while (queueHead != NULL) {
+            ring_complete();
+        }
+        return poolFailed ? -1 : 0;
+    }
+    pthread_mutex_lock(&lock);
+    while (!poolFailed && (queueHead != NULL || activeWriters > 0)) {
+        pthread_cond_wait(&drainCond, &lock);
+    }
+    int getReturn = poolFailed ? -1 : 0;
+    pthread_mutex_unlock(&lock);
+    return getReturn;
+}
+
+int restore_pool_finish() {
+    if (poolRing) {
+        restore_pool_drain();
+        uring_stop();
+        poolRing = 0;
+    }
+
+    // Let the writers drain the queue and exit
+    pthread_mutex_lock(&lock);
+    poolClosing = 1;
+    pthread_cond_broadcast(&queueCond);
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < poolSize; i++) {
+        pthread_join(*(poolThreads + i), NULL);
+    }
+    free(poolThreads);
+    poolThreads = NULL;
+    poolSize = 0;
+
+    // Modes were recorded children first, so parents are locked down last
+    int getReturn = poolFailed ? -1 : 0;
+    while (deferred != NULL) {
+        struct write_job *w = deferred;
+        deferred = w->next;
+        chmod(w->path, w->mode & 0777);
+        free_write_job(w);
+    }
+    deferredTail = NULL;
+    return getReturn;
+}
@@ -0,0 +1,915 @@
+#define _GNU_SOURCE
+
+#include "record.h"
+#include "bulk.h"
+#include "crc.h"
+#include "hash.h"
+#include "index.h"
+#include "debug.h"
+#include "source.h"
+#include "stats.h"
+#include "writeback.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+ * Input buffer.  Bytes in [start, end) of input have been read but not yet
+ * consumed.  input points at inBuffer, or at the whole of the archive when
+ * it has been mapped, in which case start is the offset in the archive.
+ */
+static char inBuffer[READER_BUFFER_SIZE] __attribute__((aligned(4096)));
+static char *input = inBuffer;
+static size_t start;
+static size_t end;
+
+// Set when input is a mapping rather than inBuffer
+static int mapped;
+
+// Offset in a mapped archive at which the stream starts
+static size_t origin;
+
+// Descriptor the serialized data is read from, stdin unless told otherwise
+static int inFd = STDIN_FILENO;
+
+/*
+ * Checksums being verified, when the stream has them.  Consumed bytes are
+ * added lazily: those in [summed, start) of input are still to be added, and
+ * summedTotal counts the ones that have been, from the end of the
+ * START_OF_TRANSMISSION record.  The contents of the current FILE_DATA record
+ * are [inContentStart, inContentEnd) in that count.
+ */
+static int verifying;
+static uint32_t inStreamCrc;
+static size_t summed;
+static uint64_t summedTotal;
+static int inContentOpen;
+static uint64_t inContentStart;
+static uint64_t inContentEnd;
+static uint32_t inContentCrc;
+static uint32_t inContentDepth;
+
+// Count of the bytes consumed, in the same terms as summedTotal
+static uint64_t consumed() {
+    return summedTotal + (start - summed);
+}
+
+// Add the bytes consumed since the last call to the checksums
+static void sum_input() {
+    while (verifying && summed < start) {
+        const char *data = input + summed;
+        size_t piece = start - summed;
+        int inside = inContentOpen && summedTotal >= inContentStart && summedTotal < inContentEnd;
+        if (inside && piece > inContentEnd - summedTotal) {
+            piece = inContentEnd - summedTotal;
+        } else if (inContentOpen && summedTotal < inContentStart && piece > inContentStart - summedTotal) {
+            piece = inContentStart - summedTotal;
+        }
+
+        // File contents are checksummed once and the result folded into both
+        if (inside) {
+            uint32_t crc = crc32c(0, data, piece);
+            inContentCrc = crc32c_combine(inContentCrc, crc, piece);
+            inStreamCrc = crc32c_combine(inStreamCrc, crc, piece);
+        } else {
+            inStreamCrc = crc32c(inStreamCrc, data, piece);
+        }
+        summed += piece;
+        summedTotal += piece;
+    }
+}
+
+void reader_open(int fd) {
+    inFd = fd;
+    input = inBuffer;
+    start = 0;
+    end = 0;
+    mapped = 0;
+    verifying = 0;
+    inContentOpen = 0;
+
+    // Regular files are mapped whole and parsed in place
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) == -1 || !S_ISREG(stat_buf.st_mode) || stat_buf.st_size == 0) {
+        return;
+    }
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1 || offset >= stat_buf.st_size) {
+        return;
+    }
+    char *map = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        debug("mmap failed with errno %d, reading instead", errno);
+        return;
+    }
+    madvise(map, stat_buf.st_size, MADV_SEQUENTIAL);
+
+    input = map;
+    start = offset;
+    origin = offset;
+    end = stat_buf.st_size;
+    mapped = 1;
+}
+
+void reader_close() {
+    if (!mapped) {
+        return;
+    }
+
+    // Leave the descriptor where parsing stopped, as a read would have
+    lseek(inFd, start, SEEK_SET);
+    munmap(input, end);
+    input = inBuffer;
+    start = 0;
+    end = 0;
+    mapped = 0;
+}
+
+// Read until at least want bytes are buffered, 0 on success and -1 otherwise
+static int fill(size_t want) {
+    // A mapping already holds everything there is
+    if (mapped) {
+        return -1;
+    }
+
+    // Slide what is left to the front so the view stays contiguous
+    if (start > 0) {
+        sum_input();
+        memmove(inBuffer, inBuffer + start, end - start);
+        end -= start;
+        start = 0;
+        summed = 0;
+    }
+
+    uint64_t since = stats_clock();
+    while (end < want) {
+        ssize_t done = read(inFd, inBuffer + end, READER_BUFFER_SIZE - end);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            stats_charge(STATS_READ, since);
+            return -1;
+        }
+        end += done;
+    }
+    stats_charge(STATS_READ, since);
+    return 0;
+}
+
+char *reader_view(size_t length) {
+    if (end - start < length && (length > READER_BUFFER_SIZE || fill(length) == -1)) {
+        return NULL;
+    }
+
+    char *view = input + start;
+    start += length;
+    return view;
+}
+
+long reader_span(char **data, off_t max) {
+    if (start == end) {
+        if (mapped) {
+            return 0;
+        }
+        sum_input();
+        start = 0;
+        end = 0;
+        summed = 0;
+        ssize_t done;
+        uint64_t since = stats_clock();
+        do {
+            done = read(inFd, inBuffer, READER_BUFFER_SIZE);
+        } while (done == -1 && errno == EINTR);
+        stats_charge(STATS_READ, since);
+        if (done <= 0) {
+            return done;
+        }
+        end = done;
+    }
+
+    size_t length = end - start;
+    if (max < length) {
+        length = max;
+    }
+    *data = input + start;
+    start += length;
+    return length;
+}
+
+int reader_read(void *dest, off_t length) {
+    char *pointer = dest;
+
+    while (length > 0) {
+        char *data;
+        long done = reader_span(&data, length);
+        if (done <= 0) {
+            return -1;
+        }
+        memcpy(pointer, data, done);
+        sum_input();
+        pointer += done;
+        length -= done;
+    }
+    return 0;
+}
+
+// The work of reader_copy(), for one window of the payload
+static int copy_out(int fd, off_t length) {
+    // Large payloads of a mapped archive go from its extents to the file in
+    // the kernel, shared rather than copied where the file system can
+    if (mapped && length >= BULK_MIN_DIRECT && end - start >= length) {
+        if (bulk_copy_range(inFd, start, fd, length) == -1) {
+            return -1;
+        }
+        start += length;
+        sum_input();
+        return 0;
+    }
+
+    // Whatever is already buffered goes out first, in pieces that are still
+    // in the cache when they are checksummed
+    size_t buffered = end - start;
+    if (buffered > length) {
+        buffered = length;
+    }
+    while (buffered > 0) {
+        size_t piece = verifying && buffered > READER_BUFFER_SIZE ? READER_BUFFER_SIZE : buffered;
+        if (bulk_write(fd, input + start, piece) == -1) {
+            return -1;
+        }
+        start += piece;
+        sum_input();
+        length -= piece;
+        buffered -= piece;
+    }
+
+    // Everything in a mapping is buffered, so the input ended early
+    if (mapped && length > 0) {
+        return -1;
+    }
+
+    // Large remainders bypass the buffer entirely, unless they are to be checksummed
+    if (length >= BULK_MIN_DIRECT && !verifying) {
+        return bulk_copy(inFd, fd, length);
+    }
+
+    while (length > 0) {
+        char *data;
+        long done = reader_span(&data, length);
+        if (done <= 0) {
+            return -1;
+        }
+        if (bulk_write(fd, data, done) == -1) {
+            return -1;
+        }
+        sum_input();
+        length -= done;
+    }
+    return 0;
+}
+
+int reader_copy(int fd, off_t length) {
+    if (!writeback_on || length <= WRITEBACK_WINDOW) {
+        return copy_out(fd, length);
+    }
+
+    // With --nocache long payloads go out a window at a time, each pushed to
+    // disk while the next is copied
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    while (length > 0) {
+        off_t window = length < WRITEBACK_WINDOW ? length : WRITEBACK_WINDOW;
+        if (copy_out(fd, window) == -1) {
+            return -1;
+        }
+        writeback_window(fd, offset, window);
+        offset += window;
+        length -= window;
+    }
+    return 0;
+}
+
+int reader_skip(off_t length) {
+    size_t buffered = end - start;
+    if (buffered >= length) {
+        start += length;
+        return 0;
+    }
+    if (mapped) {
+        return -1;
+    }
+
+    // Seek over the rest, or drain it from a pipe, if it need not be checksummed,
+    // otherwise read it through the buffer
+    if (!verifying) {
+        length -= buffered;
+        start = 0;
+        end = 0;
+        if (lseek(inFd, length, SEEK_CUR) != -1) {
+            return 0;
+        }
+        return bulk_discard(inFd, length);
+    }
+    while (length > 0) {
+        char *data;
+        long done = reader_span(&data, length);
+        if (done <= 0) {
+            return -1;
+        }
+        length -= done;
+    }
+    return 0;
+}
+
+int reader_seek(uint64_t offset) {
+    // Checksums are summed in stream order, so a checked stream cannot be jumped about in
+    if (!mapped || verifying || offset > end - origin) {
+        return -1;
+    }
+    start = origin + offset;
+    return 0;
+}
+
+static int decode_header(const char *view, struct record_header *header);
+
+// Once the contents of a FILE_DATA record have been consumed, check the CHECKSUM record after them
+static int check_content() {
+    if (consumed() != inContentEnd) {
+        return -1;
+    }
+    sum_input();
+    inContentOpen = 0;
+
+    struct record_header header;
+    const char *view = reader_view(HEADER_SIZE + CHECKSUM_SIZE);
+    if (view == NULL || decode_header(view, &header) == -1 || header.type != CHECKSUM
+        || header.depth != inContentDepth) {
+        return -1;
+    }
+    stats_record(header.type, header.size);
+    if (load_be32(view + HEADER_SIZE) != inContentCrc) {
+        debug("checksum mismatch in file contents");
+        return -1;
+    }
+    return 0;
+}
+
+int read_header(struct record_header *header) {
+    if (inContentOpen && check_content() == -1) {
+        return -1;
+    }
+    const char *view = reader_view(HEADER_SIZE);
+    if (view == NULL || decode_header(view, header) == -1) {
+        return -1;
+    }
+    stats_record(header->type, header->size);
+
+    // The contents start here and are checked once they have been consumed
+    if (verifying && header->type == FILE_DATA) {
+        inContentOpen = 1;
+        inContentStart = consumed();
+        inContentEnd = inContentStart + header->size - HEADER_SIZE;
+        inContentCrc = 0;
+        inContentDepth = header->depth;
+    }
+    return 0;
+}
+
+int read_start() {
+    struct record_header header;
+    verifying = 0;
+    if (read_header(&header) == -1 || header.type != START_OF_TRANSMISSION) {
+        return -1;
+    }
+    if (header.size == HEADER_SIZE) {
+        return 0;
+    }
+
+    // Flags this reader does not know mean a stream it cannot read properly
+    const char *view = reader_view(STREAM_FLAGS_SIZE);
+    if (view == NULL || (load_be32(view) & ~STREAM_CHECKSUMS) != 0) {
+        return -1;
+    }
+    if (load_be32(view) & STREAM_CHECKSUMS) {
+        verifying = 1;
+        inStreamCrc = 0;
+        summed = start;
+        summedTotal = 0;
+    }
+    return 0;
+}
+
+void reader_skim() {
+    verifying = 0;
+    inContentOpen = 0;
+    if (mapped) {
+        madvise(input, end, MADV_RANDOM);
+    }
+}
+
+int reader_checking() {
+    return verifying;
+}
+
+int read_end() {
+    if (!verifying) {
+        return 0;
+    }
+
+    // Step over the index, if there is one, to END_OF_TRANSMISSION
+    struct record_header header;
+    while (1) {
+        if (read_header(&header) == -1) {
+            return -1;
+        }
+        if (header.type == END_OF_TRANSMISSION) {
+            break;
+        }
+        if ((header.type != INDEX && header.type != INDEX_FOOTER) || header.depth != 0
+            || reader_skip(header.size - HEADER_SIZE) == -1) {
+            return -1;
+        }
+    }
+    if (header.size != HEADER_SIZE + CHECKSUM_SIZE) {
+        return -1;
+    }
+
+    // Everything up to the END_OF_TRANSMISSION header is covered, the header itself is not
+    start -= HEADER_SIZE;
+    sum_input();
+    start += HEADER_SIZE;
+    verifying = 0;
+    const char *view = reader_view(CHECKSUM_SIZE);
+    if (view == NULL) {
+        return -1;
+    }
+    if (load_be32(view) != inStreamCrc) {
+        debug("checksum mismatch in the stream");
+        return -1;
+    }
+    return 0;
+}
+
+int read_checksum(uint32_t depth, uint32_t crc) {
+    if (!verifying) {
+        return 0;
+    }
+    struct record_header header;
+    if (read_header(&header) == -1 || header.type != CHECKSUM || header.depth != depth) {
+        return -1;
+    }
+    const char *view = reader_view(CHECKSUM_SIZE);
+    if (view == NULL) {
+        return -1;
+    }
+    if (load_be32(view) != crc) {
+        debug("checksum mismatch in file contents");
+        return -1;
+    }
+    return 0;
+}
+
+int peek_header(struct record_header *header) {
+    if (inContentOpen && check_content() == -1) {
+        return -1;
+    }
+    const char *view = reader_view(HEADER_SIZE);
+    if (view == NULL) {
+        return -1;
+    }
+
+    // The view is still in the buffer, so just give it back
+    start -= HEADER_SIZE;
+    return decode_header(view, header);
+}
+
+// Check and decode the header at view
+static int decode_header(const char *view, struct record_header *header) {
+
+    // Magic sequence
+    if ((unsigned char)view[0] != MAGIC0 || (unsigned char)view[1] != MAGIC1
+        || (unsigned char)view[2] != MAGIC2) {
+        debug("bad magic sequence");
+        return -1;
+    }
+
+    header->type = (unsigned char)view[3];
+    header->depth = load_be32(view + 4);
+    header->size = load_be64(view + 8);
+
+    // Markers are header only, entries carry at least their metadata
+    switch (header->type) {
+    case START_OF_TRANSMISSION:
+        return header->size == HEADER_SIZE || header->size == HEADER_SIZE + STREAM_FLAGS_SIZE ? 0 : -1;
+    case END_OF_TRANSMISSION:
+        return header->size == HEADER_SIZE || header->size == HEADER_SIZE + CHECKSUM_SIZE ? 0 : -1;
+    case START_OF_DIRECTORY:
+    case END_OF_DIRECTORY:
+        return header->size == HEADER_SIZE ? 0 : -1;
+    case DIRECTORY_ENTRY:
+        return header->size >= HEADER_SIZE + ENTRY_METADATA_SIZE ? 0 : -1;
+    case UNCHANGED:
+        return header->size == HEADER_SIZE ? 0 : -1;
+    case DELETED:
+        return header->size > HEADER_SIZE ? 0 : -1;
+    case REFERENCE:
+    case HARD_LINK:
+        return header->size > HEADER_SIZE && header->size < HEADER_SIZE + PATH_MAX ? 0 : -1;
+    case SPARSE_DATA:
+        return header->size >= HEADER_SIZE + 16 ? 0 : -1;
+    case CHECKSUM:
+        return header->size == HEADER_SIZE + CHECKSUM_SIZE ? 0 : -1;
+    case COMPRESSED_BLOCK:
+        return header->size >= HEADER_SIZE + 4 && header->size <= READER_BUFFER_SIZE ? 0 : -1;
+    default:
+        return header->size >= HEADER_SIZE ? 0 : -1;
+    }
+}
+
+/*
+ * Output buffer.  The first outLength bytes are waiting to be written.
+ */
+static char outBuffer[WRITER_BUFFER_SIZE] __attribute__((aligned(4096)));
+static size_t outLength;
+
+// Bytes emitted so far, whether or not they have been written yet
+static uint64_t outTotal;
+
+// Offset of the output descriptor when writing started, if it has one
+static uint64_t outBase;
+
+// Set by writer_align()
+static int aligning;
+
+// Descriptor the serialized data is written to, stdout unless told otherwise
+static int outFd = STDOUT_FILENO;
+
+/*
+ * Checksums being written, if put_start() asked for them.  outContentLeft
+ * bytes of the contents of the current FILE_DATA record are still to come
+ * while outContentOpen is set.
+ */
+static int checksumming;
+static uint32_t outStreamCrc;
+static int outContentOpen;
+static uint64_t outContentLeft;
+static uint32_t outContentCrc;
+static uint32_t outContentDepth;
+
+// Set while records written before a checkpoint are being replayed
+static int discarding;
+
+void writer_open(int fd) {
+    outFd = fd;
+    outLength = 0;
+    outTotal = 0;
+    checksumming = 0;
+    outContentOpen = 0;
+    aligning = 0;
+    discarding = 0;
+
+    // Alignment is of offsets in the file the stream lands in, where there is one
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    outBase = offset == -1 ? 0 : offset;
+}
+
+void writer_align() {
+    aligning = 1;
+}
+
+// Add bytes just appended to the output to the checksums
+static void sum_output(const char *data, size_t length) {
+    if (!checksumming) {
+        return;
+    }
+
+    // File contents are checksummed once and the result folded into both
+    size_t piece = outContentOpen && length > outContentLeft ? outContentLeft : length;
+    if (outContentOpen && piece > 0) {
+        uint32_t crc = crc32c(0, data, piece);
+        outContentCrc = crc32c_combine(outContentCrc, crc, piece);
+        outStreamCrc = crc32c_combine(outStreamCrc, crc, piece);
+        outContentLeft -= piece;
+        data += piece;
+        length -= piece;
+    }
+    outStreamCrc = crc32c(outStreamCrc, data, length);
+}
+
+uint64_t writer_offset() {
+    return outTotal;
+}
+
+int writer_checkpoint(uint64_t *base, uint32_t *crc) {
+    *base = outBase;
+    *crc = checksumming ? outStreamCrc : 0;
+    return writer_flush();
+}
+
+int writer_resume(uint64_t base, uint64_t total, int checksums, uint32_t crc) {
+    // The output has to be the file the stream was going to, cut where the checkpoint was made
+    struct stat stat_buf;
+    if (fstat(outFd, &stat_buf) == -1 || !S_ISREG(stat_buf.st_mode) || stat_buf.st_size < base + total) {
+        return -1;
+    }
+    if (ftruncate(outFd, base + total) == -1 || lseek(outFd, base + total, SEEK_SET) == -1) {
+        return -1;
+    }
+    outBase = base;
+    outTotal = total;
+    checksumming = checksums;
+    outStreamCrc = crc;
+    discarding = 1;
+    return 0;
+}
+
+void writer_replayed() {
+    discarding = 0;
+}
+
+int writer_flush() {
+    if (outLength == 0) {
+        return 0;
+    }
+    int getReturn = bulk_write(outFd, outBuffer, outLength);
+    outLength = 0;
+    return getReturn;
+}
+
+// Make sure length more bytes fit in the buffer, flushing it if needed
+static int reserve(size_t length) {
+    if (WRITER_BUFFER_SIZE - outLength < length) {
+        return writer_flush();
+    }
+    return 0;
+}
+
+// Encode a header at the end of the buffer, which must have room for it
+static void encode_header(int type, uint32_t depth, uint64_t size) {
+    char *pointer = outBuffer + outLength;
+    pointer[0] = MAGIC0;
+    pointer[1] = MAGIC1;
+    pointer[2] = MAGIC2;
+    pointer[3] = type;
+    store_be32(pointer + 4, depth);
+    store_be64(pointer + 8, size);
+    outLength += HEADER_SIZE;
+    outTotal += HEADER_SIZE;
+    sum_output(pointer, HEADER_SIZE);
+    stats_record(type, size);
+}
+
+// Append 4 bytes of record data, for which there must be room
+static void encode_be32(uint32_t value) {
+    store_be32(outBuffer + outLength, value);
+    sum_output(outBuffer + outLength, 4);
+    outLength += 4;
+    outTotal += 4;
+}
+
+// Once the contents of a FILE_DATA record are complete, follow them with their CHECKSUM record
+static int close_content() {
+    if (!outContentOpen || outContentLeft > 0) {
+        return 0;
+    }
+    outContentOpen = 0;
+    return put_checksum(outContentDepth, outContentCrc);
+}
+
+int writer_checking() {
+    return checksumming;
+}
+
+int put_checksum(uint32_t depth, uint32_t crc) {
+    if (!checksumming || discarding) {
+        return 0;
+    }
+    if (reserve(HEADER_SIZE + CHECKSUM_SIZE) == -1) {
+        return -1;
+    }
+    encode_header(CHECKSUM, depth, HEADER_SIZE + CHECKSUM_SIZE);
+    encode_be32(crc);
+    return 0;
+}
+
+int put_start(int checksums) {
+    checksumming = 0;
+    outContentOpen = 0;
+    if (!checksums) {
+        return put_header(START_OF_TRANSMISSION, 0, HEADER_SIZE);
+    }
+    if (reserve(HEADER_SIZE + STREAM_FLAGS_SIZE) == -1) {
+        return -1;
+    }
+    encode_header(START_OF_TRANSMISSION, 0, HEADER_SIZE + STREAM_FLAGS_SIZE);
+    encode_be32(STREAM_CHECKSUMS);
+    checksumming = 1;
+    outStreamCrc = 0;
+    return 0;
+}
+
+int put_end() {
+    if (!checksumming) {
+        return put_header(END_OF_TRANSMISSION, 0, HEADER_SIZE);
+    }
+    if (reserve(HEADER_SIZE + CHECKSUM_SIZE) == -1) {
+        return -1;
+    }
+
+    // The END_OF_TRANSMISSION record itself is not covered
+    uint32_t crc = outStreamCrc;
+    checksumming = 0;
+    encode_header(END_OF_TRANSMISSION, 0, HEADER_SIZE + CHECKSUM_SIZE);
+    encode_be32(crc);
+    return 0;
+}
+
+int put_header(int type, uint32_t depth, uint64_t size) {
+    if (discarding) {
+        return 0;
+    }
+    if (reserve(HEADER_SIZE) == -1) {
+        return -1;
+    }
+    if (type == FILE_DATA) {
+        index_data(size - HEADER_SIZE);
+    }
+    encode_header(type, depth, size);
+
+    // Contents are counted down to their CHECKSUM record, which an empty file gets at once
+    if (type == FILE_DATA && checksumming) {
+        outContentOpen = 1;
+        outContentLeft = size - HEADER_SIZE;
+        outContentCrc = 0;
+        outContentDepth = depth;
+        return close_content();
+    }
+    return 0;
+}
+
+// Pad the output so that the contents of a file whose entry comes next start on an ALIGN_SIZE boundary
+static int put_padding(uint32_t depth, size_t nameLength) {
+    uint64_t contents = outBase + outTotal + 2 * HEADER_SIZE + ENTRY_METADATA_SIZE + nameLength;
+    size_t gap = (ALIGN_SIZE - contents % ALIGN_SIZE) % ALIGN_SIZE;
+    if (gap == 0) {
+        return 0;
+    }
+    if (gap < HEADER_SIZE) {
+        gap += ALIGN_SIZE;
+    }
+    if (reserve(gap) == -1) {
+        return -1;
+    }
+    encode_header(PADDING, depth, gap);
+    memset(outBuffer + outLength, 0, gap - HEADER_SIZE);
+    sum_output(outBuffer + outLength, gap - HEADER_SIZE);
+    outLength += gap - HEADER_SIZE;
+    outTotal += gap - HEADER_SIZE;
+    return 0;
+}
+
+int put_entry(uint32_t depth, mode_t mode, off_t size, const char *name, size_t nameLength) {
+    if (nameLength >= NAME_MAX) {
+        return -1;
+    }
+    if (discarding) {
+        return 0;
+    }
+    if (aligning && S_ISREG(mode) && size >= ALIGN_MIN && put_padding(depth, nameLength) == -1) {
+        return -1;
+    }
+    if (reserve(HEADER_SIZE + ENTRY_METADATA_SIZE + nameLength) == -1) {
+        return -1;
+    }
+    if (index_add(depth, name, nameLength, outTotal, HEADER_SIZE + ENTRY_METADATA_SIZE + nameLength) == -1) {
+        return -1;
+    }
+
+    encode_header(DIRECTORY_ENTRY, depth, HEADER_SIZE + ENTRY_METADATA_SIZE + nameLength);
+    stats_entry(mode);
+    char *pointer = outBuffer + outLength;
+    store_be32(pointer, mode);
+    store_be64(pointer + 4, size);
+    memcpy(pointer + ENTRY_METADATA_SIZE, name, nameLength);
+    sum_output(pointer, ENTRY_METADATA_SIZE + nameLength);
+    outLength += ENTRY_METADATA_SIZE + nameLength;
+    outTotal += ENTRY_METADATA_SIZE + nameLength;
+    return 0;
+}
+
+int put_data(const void *data, size_t length) {
+    if (discarding) {
+        return 0;
+    }
+    outTotal += length;
+    sum_output(data, length);
+    if (WRITER_BUFFER_SIZE - outLength >= length) {
+        memcpy(outBuffer + outLength, data, length);
+        outLength += length;
+        return close_content();
+    }
+
+    // Send the buffer and the data together, finishing any short write
+    struct iovec iov[2] = {
+        { outBuffer, outLength },
+        { (void *)data, length }
+    };
+    ssize_t done;
+    uint64_t since = stats_clock();
+    do {
+        done = writev(outFd, iov, 2);
+    } while (done == -1 && errno == EINTR);
+    stats_charge(STATS_WRITE, since);
+    if (done == -1) {
+        return -1;
+    }
+    outLength = 0;
+
+    if (done < iov[0].iov_len) {
+        if (bulk_write(outFd, outBuffer + done, iov[0].iov_len - done) == -1) {
+            return -1;
+        }
+        done = iov[0].iov_len;
+    }
+    done -= iov[0].iov_len;
+    if (bulk_write(outFd, (const char *)data + done, length - done) == -1) {
+        return -1;
+    }
+    return close_content();
+}
+
+int put_payload(int fd, off_t length) {
+    // Checksummed payloads have to be seen, so they always pass through the buffer,
+    // as do files read without filling the cache
+    if (checksumming || source_mode != 0) {
+        return put_payload_hashed(fd, length, NULL);
+    }
+    outTotal += length;
+
+    // Large payloads never pass through the buffer
+    if (length >= BULK_MIN_DIRECT) {
+        if (writer_flush() == -1) {
+            return -1;
+        }
+        return bulk_copy(fd, outFd, length);
+    }
+
+    if (reserve(length) == -1) {
+        return -1;
+    }
+
+    // Read straight into the buffer behind the headers
+    uint64_t since = stats_clock();
+    while (length > 0) {
+        ssize_t done = read(fd, outBuffer + outLength, length);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            stats_charge(STATS_READ, since);
+            return -1;
+        }
+        outLength += done;
+        length -= done;
+    }
+    stats_charge(STATS_READ, since);
+    return 0;
+}
+
+int put_payload_hashed(int fd, off_t length, struct hash_state *state) {
+    outTotal += length;
+
+    // Read into whatever room the buffer has, hashing each piece as it lands
+    struct source source;
+    source_begin(&source, fd, length, 1);
+    while (length > 0) {
+        if (outLength == WRITER_BUFFER_SIZE && writer_flush() == -1) {
+            source_end(&source);
+            return -1;
+        }
+        size_t room = WRITER_BUFFER_SIZE - outLength;
+        uint64_t since = stats_clock();
+        ssize_t done = source_read(&source, outBuffer + outLength, length < room ? length : room);
+        stats_charge(STATS_READ, since);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            source_end(&source);
+            return -1;
+        }
+        if (state != NULL) {
+            hash_update(state, outBuffer + outLength, done);
+        }
+        sum_output(outBuffer + outLength, done);
+        outLength += done;
+        length -= done;
+    }
+    source_end(&source);
+    return close_content();
+}
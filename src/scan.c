@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+
+#include "scan.h"
+#include "uring.h"
+#include "stats.h"
+#include "debug.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+/*
+ * What has become of the contents of an entry.
+ */
+#define DATA_NONE 0
+#define DATA_READING 1
+#define DATA_READY 2
+
+/*
+ * Fields of statx(2) the serializer uses, before the times.
+ */
+#define SCAN_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_BLOCKS)
+
+/*
+ * A directory entry as getdents64(2) returns it.
+ */
+struct dirent64_record {
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+};
+
+/*
+ * An entry of a directory read whole to be sorted, its name kept in the
+ * arena at the given offset.
+ */
+struct sorted_entry {
+    size_t offset;
+    uint64_t ino;
+    unsigned char type;
+};
+
+struct scan {
+    int fd;
+    int batched;
+    int flags;
+    unsigned mask;
+
+    // Entries read from the directory in one go, and the next one to hand out
+    char *entries;
+    long entriesUsed;
+    long entriesNext;
+
+    // With a sort order, every entry read up front, names packed in one arena
+    struct sorted_entry *sorted;
+    size_t sortedCount;
+    size_t sortedCapacity;
+    size_t sortedNext;
+    char *arena;
+    size_t arenaUsed;
+    size_t arenaCapacity;
+
+    // The current window: names, their status, and contents read ahead
+    char *names;
+    size_t namesCapacity;
+    char **nameList;
+    int *statFlags;
+    struct statx *results;
+    struct stat *stats;
+    char **data;
+    int *states;
+    struct uring_io *ios;
+    size_t count;
+    int ended;
+
+    // Entry handed out last, plus one, and the next one to consider reading ahead
+    size_t next;
+    size_t ahead;
+};
+
+// Bytes that may still be read ahead, over all scans
+static long budget = SCAN_BUDGET;
+
+static int load_sorted(struct scan *scan);
+
+struct scan *scan_open(int dirfd, const char *name, int flags) {
+    struct scan *scan = calloc(1, sizeof(struct scan));
+    if (scan == NULL) {
+        return NULL;
+    }
+    scan->fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scan->fd == -1) {
+        free(scan);
+        return NULL;
+    }
+    scan->batched = uring_active();
+    scan->flags = flags;
+    scan->mask = SCAN_MASK;
+    if ((flags & SCAN_TIMES) == SCAN_TIMES) {
+        scan->mask |= STATX_MTIME;
+    }
+    scan->entries = malloc(SCAN_ENTRIES_SIZE);
+    if (scan->entries == NULL) {
+        scan_close(scan);
+        return NULL;
+    }
+    if ((flags & (SCAN_BY_NAME | SCAN_BY_INODE)) != 0 && load_sorted(scan) == -1) {
+        scan_close(scan);
+        return NULL;
+    }
+    if (!scan->batched) {
+        return scan;
+    }
+
+    scan->nameList = malloc(SCAN_WINDOW * sizeof(char *));
+    scan->statFlags = malloc(SCAN_WINDOW * sizeof(int));
+    scan->results = malloc(SCAN_WINDOW * sizeof(struct statx));
+    scan->stats = malloc(SCAN_WINDOW * sizeof(struct stat));
+    scan->data = calloc(SCAN_WINDOW, sizeof(char *));
+    scan->states = calloc(SCAN_WINDOW, sizeof(int));
+    scan->ios = calloc(SCAN_WINDOW, sizeof(struct uring_io));
+    if (scan->nameList == NULL || scan->statFlags == NULL || scan->results == NULL || scan->stats == NULL
+        || scan->data == NULL || scan->states == NULL || scan->ios == NULL) {
+        scan_close(scan);
+        return NULL;
+    }
+    return scan;
+}
+
+// Check for the names every directory has
+static int is_dots(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// Get the next entry other than "." and "..", reading another batch when this one is used up
+static int read_entry(struct scan *scan, struct dirent64_record **entry) {
+    while (1) {
+        if (scan->entriesNext >= scan->entriesUsed) {
+            uint64_t since = stats_clock();
+            long got = syscall(SYS_getdents64, scan->fd, scan->entries, SCAN_ENTRIES_SIZE);
+            stats_charge(STATS_TRAVERSE, since);
+            if (got <= 0) {
+                return got == 0 ? 0 : -1;
+            }
+            scan->entriesUsed = got;
+            scan->entriesNext = 0;
+        }
+        struct dirent64_record *record = (struct dirent64_record *)(scan->entries + scan->entriesNext);
+        scan->entriesNext += record->reclen;
+        if (!is_dots(record->name)) {
+            *entry = record;
+            return 1;
+        }
+    }
+}
+
+// Order entries bytewise by name
+static int by_name(const void *x, const void *y, void *arena) {
+    const struct sorted_entry *a = x;
+    const struct sorted_entry *b = y;
+    return strcmp((char *)arena + a->offset, (char *)arena + b->offset);
+}
+
+// Order entries by inode number, which roughly follows their place on disk
+static int by_inode(const void *x, const void *y, void *arena) {
+    const struct sorted_entry *a = x;
+    const struct sorted_entry *b = y;
+    if (a->ino != b->ino) {
+        return a->ino < b->ino ? -1 : 1;
+    }
+    return by_name(x, y, arena);
+}
+
+// Read the whole directory into the arena and sort it
+static int load_sorted(struct scan *scan) {
+    struct dirent64_record *entry;
+    int getReturn;
+    while ((getReturn = read_entry(scan, &entry)) == 1) {
+        size_t length = strlen(entry->name) + 1;
+        if (scan->arenaUsed + length > scan->arenaCapacity) {
+            size_t bigger = scan->arenaCapacity ? scan->arenaCapacity * 2 : 64 << 10;
+            while (scan->arenaUsed + length > bigger) {
+                bigger *= 2;
+            }
+            char *fresh = realloc(scan->arena, bigger);
+            if (fresh == NULL) {
+                return -1;
+            }
+            scan->arena = fresh;
+            scan->arenaCapacity = bigger;
+        }
+        if (scan->sortedCount == scan->sortedCapacity) {
+            size_t bigger = scan->sortedCapacity ? scan->sortedCapacity * 2 : 1024;
+            struct sorted_entry *fresh = realloc(scan->sorted, bigger * sizeof(struct sorted_entry));
+            if (fresh == NULL) {
+                return -1;
+            }
+            scan->sorted = fresh;
+            scan->sortedCapacity = bigger;
+        }
+        struct sorted_entry *e = scan->sorted + scan->sortedCount++;
+        e->offset = scan->arenaUsed;
+        e->ino = entry->ino;
+        e->type = entry->type;
+        memcpy(scan->arena + scan->arenaUsed, entry->name, length);
+        scan->arenaUsed += length;
+    }
+    if (getReturn == -1) {
+        return -1;
+    }
+
+    qsort_r(scan->sorted, scan->sortedCount, sizeof(struct sorted_entry),
+            (scan->flags & SCAN_BY_INODE) == SCAN_BY_INODE ? by_inode : by_name, scan->arena);
+    return 0;
+}
+
+// Get the next entry in the order asked for, its name valid until the next call
+static int next_entry(struct scan *scan, char **name, unsigned char *type) {
+    if ((scan->flags & (SCAN_BY_NAME | SCAN_BY_INODE)) != 0) {
+        if (scan->sortedNext == scan->sortedCount) {
+            return 0;
+        }
+        struct sorted_entry *e = scan->sorted + scan->sortedNext++;
+        *name = scan->arena + e->offset;
+        *type = e->type;
+        return 1;
+    }
+    struct dirent64_record *entry;
+    int getReturn = read_entry(scan, &entry);
+    if (getReturn == 1) {
+        *name = entry->name;
+        *type = entry->type;
+    }
+    return getReturn;
+}
+
+// Follow a symbolic link, as stat(2) does, unless the entry type rules one out
+static int stat_flags(unsigned char type) {
+    return type == DT_UNKNOWN || type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW;
+}
+
+// Copy what statx found into a struct stat
+static void from_statx(const struct statx *x, struct stat *stat_buf) {
+    memset(stat_buf, 0, sizeof(*stat_buf));
+    stat_buf->st_dev = makedev(x->stx_dev_major, x->stx_dev_minor);
+    stat_buf->st_ino = x->stx_ino;
+    stat_buf->st_mode = x->stx_mode;
+    stat_buf->st_nlink = x->stx_nlink;
+    stat_buf->st_size = x->stx_size;
+    stat_buf->st_blocks = x->stx_blocks;
+    stat_buf->st_mtim.tv_sec = x->stx_mtime.tv_sec;
+    stat_buf->st_mtim.tv_nsec = x->stx_mtime.tv_nsec;
+}
+
+// Stat one entry with a system call of its own, 0 on success and -1 otherwise
+static int stat_entry(struct scan *scan, const char *name, int flags, struct stat *stat_buf) {
+    struct statx x;
+    uint64_t since = stats_clock();
+    int getReturn = statx(scan->fd, name, flags, scan->mask, &x);
+    stats_charge(STATS_METADATA, since);
+    if (getReturn == -1) {
+        debug("cannot stat %s", name);
+        return -1;
+    }
+    from_statx(&x, stat_buf);
+    return 0;
+}
+
+// Drop whatever is held for entry i of the window
+static void release(struct scan *scan, size_t i) {
+    if (scan->states[i] == DATA_READING) {
+        uring_wait(scan->ios + i);
+    }
+    if (scan->states[i] != DATA_NONE) {
+        free(scan->data[i]);
+        scan->data[i] = NULL;
+        budget += scan->stats[i].st_size;
+        scan->states[i] = DATA_NONE;
+    }
+}
+
+// Gather the next window of names and stat them all at once
+static int load_window(struct scan *scan) {
+    size_t offsets[SCAN_WINDOW];
+    size_t used = 0;
+    scan->count = 0;
+    scan->next = 0;
+    scan->ahead = 0;
+
+    char *name;
+    unsigned char type;
+    int getReturn = 0;
+    while (scan->count < SCAN_WINDOW && (getReturn = next_entry(scan, &name, &type)) == 1) {
+        size_t length = strlen(name) + 1;
+        if (used + length > scan->namesCapacity) {
+            size_t bigger = scan->namesCapacity ? scan->namesCapacity * 2 : 16 << 10;
+            char *fresh = realloc(scan->names, bigger);
+            if (fresh == NULL) {
+                return -1;
+            }
+            scan->names = fresh;
+            scan->namesCapacity = bigger;
+        }
+        memcpy(scan->names + used, name, length);
+        offsets[scan->count] = used;
+        scan->statFlags[scan->count] = stat_flags(type);
+        scan->count++;
+        used += length;
+    }
+    if (getReturn == -1) {
+        return -1;
+    }
+    if (getReturn == 0) {
+        scan->ended = 1;
+    }
+
+    for (size_t i = 0; i < scan->count; i++) {
+        scan->nameList[i] = scan->names + offsets[i];
+    }
+    uint64_t since = stats_clock();
+    getReturn = uring_statx_batch(scan->fd, scan->nameList, scan->statFlags, scan->count,
+                              scan->mask, scan->results);
+    stats_charge(STATS_METADATA, since);
+    if (getReturn == -1) {
+        return -1;
+    }
+
+    // Anything the ring could not stat gets a second chance on its own
+    for (size_t i = 0; i < scan->count; i++) {
+        if (scan->results[i].stx_mask == 0) {
+            if (stat_entry(scan, scan->nameList[i], scan->statFlags[i], scan->stats + i) == -1) {
+                return -1;
+            }
+        } else {
+            from_statx(scan->results + i, scan->stats + i);
+        }
+    }
+    return 0;
+}
+
+// Start reading ahead the small files from the current entry on, as far as the budget goes
+static void read_ahead(struct scan *scan) {
+    if (scan->ahead < scan->next - 1) {
+        scan->ahead = scan->next - 1;
+    }
+    while (scan->ahead < scan->count) {
+        size_t i = scan->ahead;
+        struct stat *s = scan->stats + i;
+
+        // Files that may have holes are left to the sparse path
+        if (!S_ISREG(s->st_mode) || s->st_size == 0 || s->st_size > SCAN_PREFETCH_MAX
+            || (off_t)s->st_blocks * 512 < s->st_size) {
+            scan->ahead++;
+            continue;
+        }
+        if (s->st_size > budget) {
+            break;
+        }
+        scan->data[i] = malloc(s->st_size);
+        if (scan->data[i] == NULL) {
+            break;
+        }
+        if (uring_read(scan->fd, scan->nameList[i], scan->data[i], s->st_size, scan->ios + i) == -1) {
+            free(scan->data[i]);
+            scan->data[i] = NULL;
+            break;
+        }
+        budget -= s->st_size;
+        scan->states[i] = DATA_READING;
+        scan->ahead++;
+    }
+}
+
+int scan_next(struct scan *scan, char **name, struct stat *stat_buf) {
+    // One entry at a time, straight from the batch last read
+    if (!scan->batched) {
+        unsigned char type;
+        int getReturn = next_entry(scan, name, &type);
+        if (getReturn != 1) {
+            return getReturn;
+        }
+        return stat_entry(scan, *name, stat_flags(type), stat_buf) == -1 ? -1 : 1;
+    }
+
+    if (scan->next > 0) {
+        release(scan, scan->next - 1);
+    }
+    if (scan->next == scan->count) {
+        if (scan->ended) {
+            return 0;
+        }
+        if (load_window(scan) == -1) {
+            return -1;
+        }
+        if (scan->count == 0) {
+            return 0;
+        }
+    }
+
+    size_t i = scan->next++;
+    if ((scan->flags & SCAN_PREFETCH) == SCAN_PREFETCH) {
+        read_ahead(scan);
+    }
+
+    // A read that failed is left for the serializer to retry and report
+    if (scan->states[i] == DATA_READING) {
+        if (uring_wait(scan->ios + i) == 0) {
+            scan->states[i] = DATA_READY;
+        } else {
+            free(scan->data[i]);
+            scan->data[i] = NULL;
+            budget += scan->stats[i].st_size;
+            scan->states[i] = DATA_NONE;
+        }
+    }
+    *name = scan->nameList[i];
+    *stat_buf = scan->stats[i];
+    return 1;
+}
+
+int scan_fd(struct scan *scan) {
+    return scan->fd;
+}
+
+long scan_data(struct scan *scan, char **data) {
+    if (!scan->batched || scan->next == 0 || scan->states[scan->next - 1] != DATA_READY) {
+        return -1;
+    }
+    *data = scan->data[scan->next - 1];
+    return scan->stats[scan->next - 1].st_size;
+}
+
+void scan_close(struct scan *scan) {
+    if (scan->states != NULL) {
+        for (size_t i = 0; i < scan->count; i++) {
+            release(scan, i);
+        }
+    }
+    close(scan->fd);
+    free(scan->entries);
+    free(scan->sorted);
+    free(scan->arena);
+    free(scan->names);
+    free(scan->nameList);
+    free(scan->statFlags);
+    free(scan->results);
+    free(scan->stats);
+    free(scan->data);
+    free(scan->states);
+    free(scan->ios);
+    free(scan);
+}
@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+
+#include "select.h"
+#include "index.h"
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char **patterns;
+static int patternCount;
+
+int select_add(char *pattern) {
+    char **bigger = realloc(patterns, (patternCount + 1) * sizeof(char *));
+    if (bigger == NULL) {
+        return -1;
+    }
+    patterns = bigger;
+
+    // Match the pathnames as the archive spells them
+    while (pattern[0] == '.' && pattern[1] == '/') {
+        pattern += 2;
+    }
+    size_t length = strlen(pattern);
+    while (length > 1 && pattern[length - 1] == '/') {
+        pattern[--length] = '\0';
+    }
+    if (length == 0) {
+        return -1;
+    }
+
+    patterns[patternCount++] = pattern;
+    return 0;
+}
+
+int select_active() {
+    return patternCount > 0;
+}
+
+int select_match(char *path) {
+    if (patternCount == 0) {
+        return 1;
+    }
+
+    // FNM_LEADING_DIR also accepts everything below a matching directory
+    for (int i = 0; i < patternCount; i++) {
+        if (fnmatch(patterns[i], path, FNM_PATHNAME | FNM_LEADING_DIR) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Order located entries as they occur in the stream
+static int compare_located(const void *a, const void *b) {
+    const struct select_entry *x = a;
+    const struct select_entry *y = b;
+    return (x->location.entry_offset > y->location.entry_offset)
+        - (x->location.entry_offset < y->location.entry_offset);
+}
+
+// Check whether a pathname is a pattern's, or lies below it
+static int covers(const struct select_entry *outer, const struct select_entry *inner) {
+    return inner->length >= outer->length && memcmp(inner->path, outer->path, outer->length) == 0
+        && (inner->length == outer->length || inner->path[outer->length] == '/');
+}
+
+const struct select_entry *select_locate(long *count) {
+    static struct select_entry *located;
+    free(located);
+    located = malloc((patternCount + 1) * sizeof(struct select_entry));
+    if (located == NULL) {
+        return NULL;
+    }
+
+    // Only patterns naming a single pathname can be looked up
+    long found = 0;
+    for (int i = 0; i < patternCount; i++) {
+        if (strpbrk(patterns[i], "*?[\\") != NULL) {
+            return NULL;
+        }
+        struct select_entry *entry = located + found;
+        entry->path = patterns[i];
+        entry->length = strlen(patterns[i]);
+        if (index_find(entry->path, entry->length, &entry->location) == 0) {
+            found++;
+        }
+    }
+
+    // Entries inside another one selected are restored with it, so only once
+    long kept = 0;
+    for (long i = 0; i < found; i++) {
+        int inside = 0;
+        for (long j = 0; j < found && !inside; j++) {
+            inside = j != i && covers(located + j, located + i)
+                && (located[j].length < located[i].length || j < i);
+        }
+        if (!inside) {
+            located[kept++] = located[i];
+        }
+    }
+    qsort(located, kept, sizeof(struct select_entry), compare_located);
+    *count = kept;
+    return located;
+}
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+
+#include "source.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// From Linux 6.14, which the C library headers may predate
+#ifndef RWF_DONTCACHE
+#define RWF_DONTCACHE 0x00000080
+#endif
+
+int source_mode;
+
+static size_t window;
+
+// Aligned buffer for O_DIRECT reads, used by the thread that called source_start()
+static char *directBuffer;
+
+// Cleared once the kernel turns down RWF_DONTCACHE, which it then does for every file
+static int dontcache;
+
+int source_start(int mode, size_t size) {
+    window = size;
+    dontcache = 1;
+    if ((mode & SOURCE_DIRECT) && posix_memalign((void **)&directBuffer, SOURCE_ALIGN, window) != 0) {
+        directBuffer = NULL;
+        return -1;
+    }
+    source_mode = mode;
+    return 0;
+}
+
+void source_finish() {
+    free(directBuffer);
+    directBuffer = NULL;
+    source_mode = 0;
+}
+
+// Turn O_DIRECT on or off for a file
+static int set_direct(int fd, int on) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT);
+}
+
+void source_begin(struct source *s, int fd, off_t length, int direct) {
+    s->fd = fd;
+    s->direct = 0;
+    s->bufferStart = 0;
+    s->bufferEnd = 0;
+    if (source_mode == 0) {
+        return;
+    }
+    s->offset = lseek(fd, 0, SEEK_CUR);
+    s->advised = s->offset;
+    s->dropped = s->offset;
+
+    // O_DIRECT needs an aligned offset, and only pays for large files
+    if (direct && (source_mode & SOURCE_DIRECT) && length >= SOURCE_DIRECT_MIN
+        && s->offset % SOURCE_ALIGN == 0 && set_direct(fd, 1) == 0) {
+        s->direct = 1;
+        return;
+    }
+    posix_fadvise(fd, s->offset, length, POSIX_FADV_SEQUENTIAL);
+}
+
+// Read through the page cache without leaving anything new in it
+static ssize_t read_uncached(struct source *s, void *buf, size_t count) {
+    if (dontcache) {
+        struct iovec iov = { buf, count };
+        ssize_t done = preadv2(s->fd, &iov, 1, -1, RWF_DONTCACHE);
+        if (done != -1 || errno != EOPNOTSUPP) {
+            if (done > 0) {
+                s->offset += done;
+            }
+            return done;
+        }
+        dontcache = 0;
+    }
+
+    // Otherwise keep a window requested ahead and drop what is behind
+    if (s->advised < s->offset + (off_t)window) {
+        off_t from = s->advised > s->offset ? s->advised : s->offset;
+        s->advised = s->offset + 2 * (off_t)window;
+        posix_fadvise(s->fd, from, s->advised - from, POSIX_FADV_WILLNEED);
+    }
+    ssize_t done = read(s->fd, buf, count);
+    if (done > 0) {
+        s->offset += done;
+    }
+    if (s->offset - s->dropped >= (off_t)window) {
+        posix_fadvise(s->fd, s->dropped, s->offset - s->dropped, POSIX_FADV_DONTNEED);
+        s->dropped = s->offset;
+    }
+    return done;
+}
+
+// Read through the aligned buffer, a window at a time
+static ssize_t read_direct(struct source *s, void *buf, size_t count) {
+    if (s->bufferStart == s->bufferEnd) {
+        ssize_t done = read(s->fd, directBuffer, window);
+        if (done == -1 && errno == EINVAL) {
+            // The file system would not do it after all
+            set_direct(s->fd, 0);
+            s->direct = 0;
+            return read_uncached(s, buf, count);
+        }
+        if (done <= 0) {
+            return done;
+        }
+        s->bufferStart = 0;
+        s->bufferEnd = done;
+    }
+    size_t piece = s->bufferEnd - s->bufferStart;
+    if (piece > count) {
+        piece = count;
+    }
+    memcpy(buf, directBuffer + s->bufferStart, piece);
+    s->bufferStart += piece;
+    s->offset += piece;
+    return piece;
+}
+
+ssize_t source_read(struct source *s, void *buf, size_t count) {
+    if (s->direct) {
+        return read_direct(s, buf, count);
+    }
+    if (source_mode == 0) {
+        return read(s->fd, buf, count);
+    }
+    return read_uncached(s, buf, count);
+}
+
+void source_end(struct source *s) {
+    if (s->direct) {
+        // Put back what was read ahead into the buffer
+        set_direct(s->fd, 0);
+        lseek(s->fd, s->offset, SEEK_SET);
+    } else if (source_mode != 0 && !dontcache && s->offset > s->dropped) {
+        posix_fadvise(s->fd, s->dropped, s->offset - s->dropped, POSIX_FADV_DONTNEED);
+    }
+}
@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+
+#include "sparse.h"
+#include "bulk.h"
+#include "crc.h"
+#include "hash.h"
+#include "index.h"
+#include "record.h"
+#include "format.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Data extents of the file being emitted, as (offset, length) pairs.
+ */
+static off_t *extents;
+static size_t extentsCapacity;
+
+// Map the data extents of a file, returning how many there are or -1 if it has no holes
+static long map_extents(int fd, off_t size) {
+    // A file using all the blocks its size calls for has nowhere to keep a hole
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) == -1 || size == 0 || (off_t)stat_buf.st_blocks * 512 >= size) {
+        return -1;
+    }
+
+    long count = 0;
+    off_t offset = 0;
+    while (offset < size) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data == -1) {
+            // Nothing but a hole up to the end, or no way of telling
+            if (errno == ENXIO) {
+                break;
+            }
+            return -1;
+        }
+        if (data >= size) {
+            break;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1) {
+            return -1;
+        }
+        if (hole > size) {
+            hole = size;
+        }
+
+        if (count == SPARSE_MAX_EXTENTS) {
+            return -1;
+        }
+        if (2 * (count + 1) > extentsCapacity) {
+            size_t bigger = extentsCapacity ? extentsCapacity * 2 : 64;
+            off_t *fresh = realloc(extents, bigger * sizeof(off_t));
+            if (fresh == NULL) {
+                return -1;
+            }
+            extents = fresh;
+            extentsCapacity = bigger;
+        }
+        extents[2 * count] = data;
+        extents[2 * count + 1] = hole - data;
+        count++;
+        offset = hole;
+    }
+
+    // One extent covering everything means there was no hole after all
+    if (count == 1 && extents[0] == 0 && extents[1] == size) {
+        return -1;
+    }
+    return count;
+}
+
+// Add length zero bytes to a content hash, for a hole
+static void hash_zeros(struct hash_state *state, off_t length) {
+    static const char zeros[64 << 10];
+    while (length > 0) {
+        size_t chunk = length < sizeof(zeros) ? length : sizeof(zeros);
+        hash_update(state, zeros, chunk);
+        length -= chunk;
+    }
+}
+
+// Emit length bytes of fd from where it is, adding them to crc and state unless NULL
+static int put_extent(int fd, off_t length, uint32_t *crc, struct hash_state *state) {
+    static char chunk[64 << 10];
+    while (length > 0) {
+        ssize_t done = read(fd, chunk, length < sizeof(chunk) ? length : sizeof(chunk));
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0 || put_data(chunk, done) == -1) {
+            return -1;
+        }
+        if (crc != NULL) {
+            *crc = crc32c(*crc, chunk, done);
+        }
+        if (state != NULL) {
+            hash_update(state, chunk, done);
+        }
+        length -= done;
+    }
+    return 0;
+}
+
+int put_sparse(int fd, off_t size, uint32_t depth, struct hash_state *state) {
+    long count = map_extents(fd, size);
+    if (count == -1) {
+        return lseek(fd, 0, SEEK_SET) == -1 ? -1 : 0;
+    }
+
+    uint64_t dataSize = 0;
+    for (long i = 0; i < count; i++) {
+        dataSize += extents[2 * i + 1];
+    }
+
+    // Size and extent map first, then the bytes of each extent in turn
+    char field[SPARSE_EXTENT_SIZE];
+    if (put_header(SPARSE_DATA, depth, HEADER_SIZE + SPARSE_PREFIX_SIZE
+                   + (uint64_t)count * SPARSE_EXTENT_SIZE + dataSize) == -1) {
+        return -1;
+    }
+    index_data(size);
+    store_be64(field, size);
+    store_be64(field + 8, count);
+    if (put_data(field, SPARSE_PREFIX_SIZE) == -1) {
+        return -1;
+    }
+    for (long i = 0; i < count; i++) {
+        store_be64(field, extents[2 * i]);
+        store_be64(field + 8, extents[2 * i + 1]);
+        if (put_data(field, SPARSE_EXTENT_SIZE) == -1) {
+            return -1;
+        }
+    }
+    // With checksums or a content hash the extents are summed on the way, the holes between them as zeros
+    int checking = writer_checking();
+    uint32_t crc = 0;
+    off_t end = 0;
+    for (long i = 0; i < count; i++) {
+        if (lseek(fd, extents[2 * i], SEEK_SET) == -1) {
+            return -1;
+        }
+        if (checking) {
+            crc = crc32c_zeros(crc, extents[2 * i] - end);
+        }
+        if (state != NULL) {
+            hash_zeros(state, extents[2 * i] - end);
+        }
+        end = extents[2 * i] + extents[2 * i + 1];
+        if ((checking || state != NULL ? put_extent(fd, extents[2 * i + 1], checking ? &crc : NULL, state)
+             : put_payload(fd, extents[2 * i + 1])) == -1) {
+            return -1;
+        }
+    }
+    if (state != NULL) {
+        hash_zeros(state, size - end);
+    }
+    if (checking && put_checksum(depth, crc32c_zeros(crc, size - end)) == -1) {
+        return -1;
+    }
+    return 1;
+}
+
+// Read and check the extent map at the start of a SPARSE_DATA record's data, NULL if it is malformed
+static off_t *read_map(struct record_header *header, uint64_t *size, uint64_t *count) {
+    char field[SPARSE_EXTENT_SIZE];
+    if (header->size < HEADER_SIZE + SPARSE_PREFIX_SIZE || reader_read(field, SPARSE_PREFIX_SIZE) == -1) {
+        return NULL;
+    }
+    *size = load_be64(field);
+    *count = load_be64(field + 8);
+    uint64_t left = header->size - HEADER_SIZE - SPARSE_PREFIX_SIZE;
+    if (*count > SPARSE_MAX_EXTENTS || *count * SPARSE_EXTENT_SIZE > left) {
+        return NULL;
+    }
+    left -= *count * SPARSE_EXTENT_SIZE;
+
+    // The map has to be read whole, as the data only follows it
+    off_t *map = malloc(*count * 2 * sizeof(off_t) + 1);
+    if (map == NULL) {
+        return NULL;
+    }
+    uint64_t end = 0;
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < *count; i++) {
+        if (reader_read(field, SPARSE_EXTENT_SIZE) == -1) {
+            free(map);
+            return NULL;
+        }
+        uint64_t offset = load_be64(field);
+        uint64_t length = load_be64(field + 8);
+
+        // Extents are in order, apart and inside the file
+        if (offset < end || length > *size || offset > *size - length) {
+            free(map);
+            return NULL;
+        }
+        map[2 * i] = offset;
+        map[2 * i + 1] = length;
+        end = offset + length;
+        total += length;
+    }
+    if (total != left) {
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+// Consume length bytes of input, writing them to fd unless it is -1 and adding them to crc
+static int read_extent(int fd, uint64_t length, uint32_t *crc) {
+    while (length > 0) {
+        char *data;
+        long done = reader_span(&data, length);
+        if (done <= 0) {
+            return -1;
+        }
+        *crc = crc32c(*crc, data, done);
+        if (fd != -1 && bulk_write(fd, data, done) == -1) {
+            return -1;
+        }
+        length -= done;
+    }
+    return 0;
+}
+
+// Read the data extents after the map into fd, or only check them if fd is -1
+static int read_extents(uint32_t depth, int fd, const off_t *map, uint64_t count, uint64_t size) {
+    int checking = reader_checking();
+    uint32_t crc = 0;
+    uint64_t end = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        // Seeking past the end before each write leaves the gap unallocated
+        if (fd != -1 && lseek(fd, map[2 * i], SEEK_SET) == -1) {
+            return -1;
+        }
+        if (!checking) {
+            if (reader_copy(fd, map[2 * i + 1]) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        // Checked contents have to be seen, with the holes before them as zeros
+        crc = crc32c_zeros(crc, map[2 * i] - end);
+        end = map[2 * i] + map[2 * i + 1];
+        if (read_extent(fd, map[2 * i + 1], &crc) == -1) {
+            return -1;
+        }
+    }
+    return read_checksum(depth, crc32c_zeros(crc, size - end));
+}
+
+int restore_sparse(uint32_t depth, int fd) {
+    struct record_header header;
+    if (read_header(&header) == -1) {
+        return -1;
+    }
+    if (header.type != SPARSE_DATA || header.depth != depth) {
+        return -1;
+    }
+    if (fd == -1 && !reader_checking()) {
+        return reader_skip(header.size - HEADER_SIZE);
+    }
+
+    uint64_t size;
+    uint64_t count;
+    off_t *map = read_map(&header, &size, &count);
+    if (map == NULL) {
+        return -1;
+    }
+    int getReturn = read_extents(depth, fd, map, count, size);
+    free(map);
+    if (getReturn == 0 && fd != -1 && ftruncate(fd, size) == -1) {
+        getReturn = -1;
+    }
+    return getReturn;
+}
+
+int check_sparse(uint32_t depth, off_t size) {
+    struct record_header header;
+    if (read_header(&header) == -1) {
+        return -1;
+    }
+    if (header.type != SPARSE_DATA || header.depth != depth) {
+        return -1;
+    }
+    uint64_t recorded;
+    uint64_t count;
+    off_t *map = read_map(&header, &recorded, &count);
+    if (map == NULL) {
+        return -1;
+    }
+    if (recorded != size) {
+        free(map);
+        return -1;
+    }
+
+    // The extents fill the rest of the record, as read_map() made sure
+    int getReturn;
+    if (reader_checking()) {
+        getReturn = read_extents(depth, -1, map, count, recorded);
+    } else {
+        getReturn = reader_skip(header.size - HEADER_SIZE - SPARSE_PREFIX_SIZE - count * SPARSE_EXTENT_SIZE);
+    }
+    free(map);
+    return getReturn;
+}
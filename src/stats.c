@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+
+#include "stats.h"
+#include "format.h"
+#include "debug.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+
+int stats_on;
+
+static int reportWanted;
+static int progressWanted;
+static uint64_t startTime;
+
+static uint64_t records[STATS_RECORD_TYPES];
+static uint64_t streamBytes;
+static uint64_t contentBytes;
+static uint64_t files;
+static uint64_t directories;
+static uint64_t phaseTime[STATS_PHASES];
+
+// Progress thread, woken early when the run ends
+static pthread_t progressThread;
+static pthread_mutex_t progressLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progressCond = PTHREAD_COND_INITIALIZER;
+static int progressDone;
+
+static const char *phaseNames[STATS_PHASES] = {
+    "traverse", "metadata", "read", "write", "copy"
+};
+
+static const char *typeNames[STATS_RECORD_TYPES] = {
+    "START_OF_TRANSMISSION", "END_OF_TRANSMISSION", "START_OF_DIRECTORY", "END_OF_DIRECTORY",
+    "DIRECTORY_ENTRY", "FILE_DATA", "INDEX", "INDEX_FOOTER", "UNCHANGED", "DELETED",
+    "COMPRESSED_BLOCK", "REFERENCE", "HARD_LINK", "SPARSE_DATA", "CHECKSUM", "PADDING", "UNKNOWN"
+};
+
+static uint64_t now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static uint64_t load(uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void add(uint64_t *counter, uint64_t amount) {
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+void stats_record(int type, uint64_t size) {
+    if (!stats_on) {
+        return;
+    }
+    if (type < 0 || type >= STATS_RECORD_TYPES) {
+        type = STATS_RECORD_TYPES - 1;
+    }
+    add(records + type, 1);
+    add(&streamBytes, size);
+    if ((type == FILE_DATA || type == COMPRESSED_BLOCK || type == SPARSE_DATA) && size > HEADER_SIZE) {
+        add(&contentBytes, size - HEADER_SIZE);
+    }
+}
+
+void stats_entry(mode_t mode) {
+    if (!stats_on) {
+        return;
+    }
+    add(S_ISDIR(mode) ? &directories : &files, 1);
+}
+
+uint64_t stats_clock() {
+    return stats_on ? now() : 0;
+}
+
+void stats_charge(int phase, uint64_t since) {
+    if (!stats_on) {
+        return;
+    }
+    add(phaseTime + phase, now() - since);
+}
+
+// Print one progress line, with the throughput since the last one
+static void print_progress(uint64_t *lastBytes, uint64_t *lastTime) {
+    uint64_t time = now();
+    uint64_t bytes = load(&streamBytes);
+    double interval = (time - *lastTime) / 1e9;
+    fprintf(stderr, "transplant: %.0fs  %llu files  %llu dirs  %.1f MB  %.1f MB/s\n",
+            (time - startTime) / 1e9, (unsigned long long)load(&files),
+            (unsigned long long)load(&directories), bytes / 1e6,
+            interval > 0 ? (bytes - *lastBytes) / 1e6 / interval : 0.0);
+    *lastBytes = bytes;
+    *lastTime = time;
+}
+
+static void *progress_main(void *arg) {
+    uint64_t lastBytes = 0;
+    uint64_t lastTime = startTime;
+    pthread_mutex_lock(&progressLock);
+    while (!progressDone) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += STATS_PROGRESS_INTERVAL;
+        pthread_cond_timedwait(&progressCond, &progressLock, &deadline);
+        if (!progressDone) {
+            print_progress(&lastBytes, &lastTime);
+        }
+    }
+    pthread_mutex_unlock(&progressLock);
+    return NULL;
+}
+
+int stats_start(int report, int progress) {
+    reportWanted = report;
+    progressWanted = progress;
+    startTime = now();
+    stats_on = 1;
+    if (progress && pthread_create(&progressThread, NULL, progress_main, NULL) != 0) {
+        progressWanted = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void stats_finish() {
+    if (!stats_on) {
+        return;
+    }
+    if (progressWanted) {
+        pthread_mutex_lock(&progressLock);
+        progressDone = 1;
+        pthread_cond_signal(&progressCond);
+        pthread_mutex_unlock(&progressLock);
+        pthread_join(progressThread, NULL);
+        progressWanted = 0;
+    }
+    stats_on = 0;
+    if (!reportWanted) {
+        return;
+    }
+
+    double elapsed = (now() - startTime) / 1e9;
+    fprintf(stderr, "transplant: %.3f s, %llu files, %llu directories\n", elapsed,
+            (unsigned long long)files, (unsigned long long)directories);
+    fprintf(stderr, "transplant: stream %llu bytes (%.1f MB/s), file contents %llu bytes\n",
+            (unsigned long long)streamBytes, elapsed > 0 ? streamBytes / 1e6 / elapsed : 0.0,
+            (unsigned long long)contentBytes);
+    for (int i = 0; i < STATS_RECORD_TYPES; i++) {
+        if (records[i] > 0) {
+            fprintf(stderr, "transplant:   %-22s %llu\n", typeNames[i], (unsigned long long)records[i]);
+        }
+    }
+    for (int i = 0; i < STATS_PHASES; i++) {
+        fprintf(stderr, "transplant:   %-22s %.3f s\n", phaseNames[i], phaseTime[i] / 1e9);
+    }
+}
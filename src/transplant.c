@@ -1,8 +1,29 @@
 #include "const.h"
-#include "transplant.h"
+#include "format.h"
 #include "debug.h"
-
+#include "bulk.h"
+#include "helpers.h"
+#include "parallel.h"
+#include "record.h"
+#include "index.h"
+#include "select.h"
+#include "manifest.h"
+#include "hash.h"
+#include "compress.h"
+#include "dedup.h"
+#include "sparse.h"
+#include "scan.h"
+#include "uring.h"
+#include "stats.h"
+#include "writeback.h"
+#include "source.h"
+#include "checkpoint.h"
+#include "list.h"
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #ifdef _STRING_H
 #error "Do not #include <string.h>. You will get a ZERO."
@@ -16,13 +37,6 @@
 #error "Do not #include <ctype.h>. You will get a ZERO."
 #endif
 
-int stringCompare(char *string1, char *string2);
-int stringLength(char *string1);
-int checkMagicSeq();
-long getHexToDecimal(int length);
-void putChar4Bytes(int length);
-void putChar8Bytes(int length);
-
 
 /*
  * You may modify this file and/or move the functions contained here
@@ -41,6 +55,105 @@ void putChar8Bytes(int length);
  * YOU WILL GET A ZERO!
  */
 
+static int create_file();
+static long read_file_header(int depth);
+static int deserialize_entry(int depth, uint64_t recordSize);
+static int deserialize_indexed();
+static int restore_located(const struct select_entry *target);
+static int restore_parent_modes(const struct select_entry *target);
+static int deserialize_file_pooled(int depth, mode_t mode, off_t size);
+static int is_compressed();
+static int is_reference();
+static int is_sparse();
+static int restore_reference(int depth, mode_t mode);
+static int skip_file(int depth);
+static void make_parents();
+static int keep_file(int depth, int selected);
+static int delete_entry(long nameLength);
+static int push_name(long nameLength);
+static int at_dir();
+static char *at_name();
+static int enter_directory(int selected, mode_t mode);
+static int finish_file(int fd);
+static int restore_checkpoint(off_t size);
+static int serialize_checkpoint(char *relPath, int relLength);
+
+/*
+ * Length of the target directory's name at the start of path_buf, so that
+ * the rest of path_buf is the pathname within the archive.
+ */
+static int rootLength;
+
+/*
+ * Number of files and directories restored so far.
+ */
+static long restoredCount;
+
+/*
+ * Content hash of the file serialized last, for the manifest.
+ */
+static uint64_t fileHash;
+
+/*
+ * Contents of the file about to be serialized if they were read ahead by
+ * the I/O ring, otherwise NULL.
+ */
+static char *prefetched;
+static long prefetchedLength;
+
+/*
+ * Nonzero if regular files are being restored through the writer pool.
+ */
+static int pooled;
+
+/*
+ * Descriptor of the directory holding the current entry, whose name within
+ * it starts at entryName in path_buf.  While dirFd is -1 the entry is named
+ * by the whole of path_buf instead, as for the top directory itself.
+ */
+static int dirFd = -1;
+static char *entryName;
+
+/*
+ * Size recorded in the DIRECTORY_ENTRY of the file being restored.
+ */
+static off_t entrySize;
+
+/*
+ * Number of DIRECTORY_ENTRY records so far in the stream, how many of the
+ * first ones were done before the checkpoint resumed from, and the bytes of
+ * file contents restored, counted towards the next checkpoint.
+ */
+static uint64_t entryIndex;
+static uint64_t replayEntries;
+static uint64_t contentTotal;
+
+/*
+ * Number of worker threads selected with -j.
+ */
+int worker_count = 1;
+
+/*
+ * Bytes read ahead of each file with --nocache or --direct, set with --readahead.
+ */
+size_t read_window = SOURCE_WINDOW;
+
+/*
+ * File to deserialize from, selected with -i.
+ */
+char *input_path = NULL;
+
+/*
+ * Checkpoint file selected with --resume.
+ */
+char *checkpoint_path = NULL;
+
+/*
+ * Manifests selected with -m and -b.
+ */
+char *manifest_path = NULL;
+char *base_path = NULL;
+
 /*
  * A function that returns printable names for the record types, for use in
  * generating debugging printout.
@@ -59,6 +172,10 @@ static char *record_type_name(int i) {
     return "DIRECTORY_ENTRY";
     case FILE_DATA:
     return "FILE_DATA";
+    case CHECKSUM:
+    return "CHECKSUM";
+    case PADDING:
+    return "PADDING";
     default:
     return "UNKNOWN";
     }
@@ -125,11 +242,7 @@ int path_push(char *name) {
     }
 
     // Get to current null terminator position
-    char *pointer = path_buf;
-
-    while (*pointer != '\0') {
-        pointer++;
-    }
+    char *pointer = path_buf + path_length;
 
     // Add '/' where null terminator is
     *pointer = '/';
@@ -167,23 +280,17 @@ int path_pop() {
         return -1;
     }
 
-    // Pointer for iterating through array and saving last '/'
-    char *tempPointer = path_buf;
-    char *mainPointer = path_buf;
-
-    // Finding last occurance of '/' if any
-    while (*tempPointer != '\0') {
-        if (*tempPointer == *"/") {
-            mainPointer = tempPointer;
-        }
-        tempPointer++;
+    // Deleting elements from the end back to the last '/', if any, and that too
+    char *pointer = path_buf + path_length;
+    while (pointer != path_buf && *(pointer - 1) != *"/") {
+        pointer--;
+        *pointer = '\0';
+        path_length--;
     }
-
-    // Deleting all elements after last '/'
-    while (*mainPointer != '\0') {
-        *mainPointer = '\0';
+    if (pointer != path_buf) {
+        pointer--;
+        *pointer = '\0';
         path_length--;
-        mainPointer++;
     }
 
     // Return successfully
@@ -196,7 +303,8 @@ int path_pop() {
  * directory.  It reads (from the standard input) a sequence of DIRECTORY_ENTRY
  * records bracketed by a START_OF_DIRECTORY and END_OF_DIRECTORY record at the
  * same depth and it recreates the entries, leaving the deserialized files and
- * directories within the directory named by path_buf.
+ * directories within the directory named by path_buf.  Unless dirFd is -1 it
+ * is open on that directory, and entries are created relative to it.
  *
  * @param depth  The value of the depth field that is expected to be found in
  * each of the records processed.
@@ -208,183 +316,192 @@ int path_pop() {
  * directories.
  */
 int deserialize_directory(int depth) {
-    // Check if magic sequence exists
-    if (checkMagicSeq() == -1) {
-        return -1;
-    }
-
-    // Get type byte
-    int eofCheck = getchar();
-    if (eofCheck == EOF) {
-        return -1;
-    }
-    unsigned char current = eofCheck;
+    struct record_header header;
 
-    // Make sure first row is start of directory
-    if (current != START_OF_DIRECTORY) {
+    // Make sure first record is start of directory at this depth
+    if (read_header(&header) == -1) {
         return -1;
     }
-
-    // If depth does not match return error
-    unsigned int currDepth = getHexToDecimal(4);
-    if (currDepth != depth) {
+    if (header.type != START_OF_DIRECTORY || header.depth != depth) {
         return -1;
     }
 
-    // Iterate rest of directory entry
-    for (int i = 0; i < 8; i++) {
-        eofCheck = getchar();
-        if (eofCheck == EOF) {
+    // Loop until the matching end of directory is found
+    while (1) {
+        if (read_header(&header) == -1) {
             return -1;
         }
-    }
-
-
-    // Variable used for checking if method return is -1
-    int getReturn = 0;
 
-    // Boolean values, 0 for false 1 for true
-    int endOfCurrDir = 0;
-
-    // Loop for checking until end of directory is found
-    while (endOfCurrDir != 1) {
-        // Check if magic sequence exists
-        if (checkMagicSeq() == -1) {
+        // If not directory entry, deletion, padding or end, or depth does not match, return error
+        if (header.type != DIRECTORY_ENTRY && header.type != DELETED && header.type != PADDING
+            && header.type != END_OF_DIRECTORY) {
             return -1;
         }
-
-        // Get type byte
-        eofCheck = getchar();
-        if (eofCheck == EOF) {
+        if (header.depth != depth) {
             return -1;
         }
-        current = eofCheck;
 
-        // If first header not directory entry or end, return error
-        if (current != DIRECTORY_ENTRY && current != END_OF_DIRECTORY) {
-            return -1;
+        // Padding only serves to align the contents after it
+        if (header.type == PADDING) {
+            if (reader_skip(header.size - HEADER_SIZE) == -1) {
+                return -1;
+            }
+            continue;
         }
 
-        // If depth does not match return error
-        currDepth = getHexToDecimal(4);
-        if (currDepth != depth) {
-            return -1;
+        // End of directory, so we are done
+        if (header.type == END_OF_DIRECTORY) {
+            break;
         }
 
-        // Get header data
-        unsigned long currLength = getHexToDecimal(8);
-        int remLength = currLength - 16;
-
-        // If end of directory, then finish header and break out of it
-        if (current == END_OF_DIRECTORY) {
-            endOfCurrDir = 1;
-            if (getReturn == -1) {
+        // Entry removed since the run an incremental stream was made against
+        if (header.type == DELETED) {
+            if (delete_entry(header.size - HEADER_SIZE) == -1) {
                 return -1;
             }
-            break;
+            continue;
+        }
+
+        // Restore the directory entry and whatever follows it
+        if (deserialize_entry(depth, header.size) == -1) {
+            return -1;
         }
+    }
+
+    // Function done, so return success
+    return 0;
+}
+
+
+// Function for restoring the entry whose DIRECTORY_ENTRY header has just been read
+static int deserialize_entry(int depth, uint64_t recordSize) {
+    struct record_header header;
+
+    // Variable used for checking if method return is -1
+    int getReturn = 0;
+
+    // Get file meta data since it is a directory entry
+    char *metadata = reader_view(ENTRY_METADATA_SIZE);
+    if (metadata == NULL) {
+        return -1;
+    }
+    mode_t currType = load_be32(metadata);
+    off_t currSize = load_be64(metadata + 4);
+    entrySize = currSize;
+    stats_entry(currType);
+
+    // Read the name and updata path_buf
+    getReturn = push_name(recordSize - HEADER_SIZE - ENTRY_METADATA_SIZE);
+    if (getReturn == -1) {
+        return -1;
+    }
+
 
+    // Files done before the checkpoint of an interrupted run are skipped like unselected ones
+    int replay = entryIndex < replayEntries
+        ? checkpoint_replay(entryIndex, path_buf + rootLength + 1, path_length - rootLength - 1) : 0;
+    if (replay == -1) {
+        return -1;
+    }
+    entryIndex++;
+
+    // Entries outside the --only selection are parsed but not restored
+    int selected = select_match(path_buf + rootLength + 1) && !(replay && S_ISREG(currType));
+    if (selected && select_active()) {
+        make_parents();
+    }
 
-        // Get file meta data since it is a directory entry
-        eofCheck = getchar();
-        if (eofCheck == EOF) {
+    // Check if type is a file or directory
+    if (S_ISREG(currType) && peek_header(&header) == 0 && header.type == UNCHANGED) {
+        // Incremental streams leave unchanged files where they are
+        getReturn = keep_file(depth, selected);
+        if (getReturn == -1) {
             return -1;
         }
-        mode_t currType = eofCheck << 24;
-        eofCheck = getchar();
-        if (eofCheck == EOF) {
+        if (!selected) {
+            path_pop();
+            return 0;
+        }
+        restoredCount++;
+    } else if (S_ISREG(currType) && !selected) {
+        // Skip the payload without writing it
+        getReturn = skip_file(depth);
+        if (getReturn == -1) {
             return -1;
         }
-        mode_t tempType = eofCheck << 16;
-        currType |= tempType;
-        eofCheck = getchar();
-        if (eofCheck == EOF) {
+        path_pop();
+        return 0;
+    } else if (S_ISREG(currType) && is_reference()) {
+        // Contents already restored under another name, or another link
+        getReturn = restore_reference(depth, currType);
+        if (getReturn == -1) {
             return -1;
         }
-        tempType = eofCheck << 8;
-        currType |= tempType;
-        eofCheck = getchar();
-        if (eofCheck == EOF) {
+        if (getReturn == 1) {
+            // The earlier name was left out by --only, so this one is too
+            path_pop();
+            return 0;
+        }
+        restoredCount++;
+    } else if (S_ISREG(currType) && pooled) {
+        // Deserialize File on the writer pool, which also sets its mode
+        getReturn = deserialize_file_pooled(depth, currType, currSize);
+        if (getReturn == -1 || restore_checkpoint(currSize) == -1) {
             return -1;
         }
-        tempType = eofCheck;
-        currType |= tempType;
-
-        for (int i = 0; i < 8; i++) {
-            eofCheck = getchar();
-            if (eofCheck == EOF) {
-                return -1;
-            }
+        restoredCount++;
+        path_pop();
+        return 0;
+    } else if (S_ISREG(currType)) {
+        // Deserialize File
+        getReturn = deserialize_file(depth);
+        if (getReturn == -1) {
+            return -1;
         }
-
-        // Clear name_buf before using
-        char *pointer = name_buf;
-        for (int i = 0; i < NAME_MAX; i++) {
-            *pointer = '\0';
-            pointer++;
+        restoredCount++;
+    } else {
+        // Unselected directories are only created to hold selected entries
+        long restoredBefore = restoredCount;
+        int parentFd = dirFd;
+        char *name = entryName;
+        if (enter_directory(selected, currType) == -1) {
+            return -1;
         }
-
-        // For storing file name from stdin in name_buf
-        pointer = name_buf;
-        for (int i = 0; i < remLength - 12; i++) {
-            int eofCheck = getchar();
-            if (eofCheck == EOF) {
-                return -1;
-            }
-            unsigned char current = eofCheck;
-            *pointer = current;
-            pointer++;
+        if (selected) {
+            restoredCount++;
         }
 
-        // Updata path_buf
-        pointer = name_buf;
-        getReturn = path_push(pointer);
+        // Deserialize Directory, then get back to this one
+        getReturn = deserialize_directory(depth + 1);
+        if (dirFd != -1) {
+            close(dirFd);
+        }
+        dirFd = parentFd;
+        entryName = name;
         if (getReturn == -1) {
             return -1;
         }
-
-
-        // Check if type is a file or directory
-        if (S_ISREG(currType)) {
-            // Deserialize File
-            getReturn = deserialize_file(currDepth);
-            if (getReturn == -1) {
-                return -1;
-            }
-        } else {
-            // Try to open directory and deal accordingly
-            DIR *dir = opendir(path_buf);
-            if (dir) {
-                if ((global_options & 0x8) == 0x8) {
-                    // Clobber exists so make directory
-                    mkdir(path_buf, 0700);
-                } else {
-                    return -1;
-                }
-            } else {
-                // Make dir if does not exist
-                mkdir(path_buf, 0700);
-            }
-
-            // Deserialize Directory
-            getReturn = deserialize_directory(depth + 1);
-            if (getReturn == -1) {
-                return -1;
-            }
+        if (restoredCount == restoredBefore) {
+            path_pop();
+            return 0;
         }
-
-        // Set mode of directory/file
-        chmod(path_buf, currType & 0777);
-        path_pop();
     }
 
-
-    // Exit was not end of directory
-    if (endOfCurrDir != 1) {
+    // Set mode of directory/file, after all pending writes if pooled
+    if (pooled && !selected) {
+        // Directories made only to hold selected entries were not made by the pool
+        restore_pool_defer_mode(path_buf, currType);
+    } else if (pooled) {
+        restore_pool_chmod(path_buf, currType);
+    } else {
+        uint64_t since = stats_clock();
+        fchmodat(at_dir(), at_name(), currType & 0777, 0);
+        stats_charge(STATS_METADATA, since);
+    }
+    if (S_ISREG(currType) && restore_checkpoint(currSize) == -1) {
         return -1;
     }
-
-    // Function done, so return success
+    path_pop();
     return 0;
 }
 
@@ -408,278 +525,763 @@ int deserialize_directory(int depth) {
  */
 int deserialize_file(int depth) {
     // Create file and check if it exists to return error
-    FILE *f;
+    int fd = create_file();
+    if (fd == -1) {
+        return -1;
+    }
 
-    if ((global_options & 0x8) != 0x8) {
-        // Check if file exists, if so then return error
-        struct stat file_buf;
-        if (stat(path_buf, &file_buf) == 0) {
+    // Files with holes come as their data extents
+    if (is_sparse()) {
+        if (restore_sparse(depth, fd) == -1) {
+            close(fd);
             return -1;
         }
-        f = fopen(path_buf, "w");
-    } else {
-        // For clobber, so overwrite the file
-        f = fopen(path_buf, "w+");
+        return finish_file(fd);
     }
 
-    // Check if magic sequence exists
-    if (checkMagicSeq() == -1) {
+    // Reserve the blocks of the whole file before writing any
+    if (writeback_preallocate(fd, entrySize) == -1) {
+        close(fd);
         return -1;
     }
 
-
-    // Move pointer since magic sequence checked
-    int remBytes = 12;
-    int eofCheck = getchar();
-    if (eofCheck == EOF) {
-        return -1;
+    // Compressed contents come as a run of blocks
+    if (is_compressed()) {
+        if (restore_blocks(depth, fd, NULL, 0) == -1) {
+            close(fd);
+            return -1;
+        }
+        return finish_file(fd);
     }
-    unsigned char current = eofCheck;
 
-    // Byte should be 5 since FILE_DATA
-    if (current != FILE_DATA) {
+    // Get the payload length from the FILE_DATA header
+    long dataLength = read_file_header(depth);
+    if (dataLength == -1) {
+        close(fd);
         return -1;
     }
 
-    // Convert file depth
-    unsigned int fileDepth = getHexToDecimal(4);
-    remBytes -= 4;
-    if (fileDepth != depth) {
+    // Copy the payload across in blocks
+    if (reader_copy(fd, dataLength) == -1) {
+        close(fd);
         return -1;
     }
 
-    // Convert file length
-    unsigned long thisLength = getHexToDecimal(8);
-    remBytes -= 8;
-    if (thisLength == -1) {
+    // Close file and return success
+    return finish_file(fd);
+}
+
+
+// Function for creating the file in path_buf, honouring the clobber option
+static int create_file() {
+    // The directory may still be queued on the writer pool
+    if (pooled && restore_pool_settle() == -1) {
         return -1;
     }
-    remBytes = thisLength - 16;
+    int flags = O_WRONLY | O_CREAT;
+    if ((global_options & 0x8) == 0x8) {
+        // For clobber, so overwrite the file
+        flags |= O_TRUNC;
+    } else {
+        // Return error if file exists
+        flags |= O_EXCL;
+    }
+    uint64_t since = stats_clock();
+    int fd = openat(at_dir(), at_name(), flags, 0666);
+    stats_charge(STATS_METADATA, since);
+    return fd;
+}
 
 
-    // Iterate through the bytes
-    while (remBytes > 0) {
-        // Get next char and return error if none
-        eofCheck = getchar();
-        if (eofCheck == EOF) {
-            return -1;
-        }
-        current = eofCheck;
+// Function for closing a restored file, handing it to writeback first
+static int finish_file(int fd) {
+    writeback_release(fd);
+    return close(fd);
+}
+
 
-        // No error so put byte in file
-        fputc(current, f);
-        remBytes--;
+// Function for making a checkpoint, if one is due, once the file in path_buf is restored
+static int restore_checkpoint(off_t size) {
+    contentTotal += size;
+    if (!checkpoint_due(entryIndex, contentTotal)) {
+        return 0;
     }
 
-    // Close file and return success
-    fclose(f);
-    return 0;
+    // Whatever the checkpoint counts as done has to be on the file system
+    if (pooled && restore_pool_drain() == -1) {
+        return -1;
+    }
+    struct checkpoint state = { CHECKPOINT_DESERIALIZE, entryIndex, 0, contentTotal, 0 };
+    return checkpoint_save(&state, path_buf + rootLength + 1, path_length - rootLength - 1);
 }
 
 
-/**
- * @brief Reads serialized data from the standard input and reconstructs from it
- * a tree of files and directories.
- * @details  This function assumes path_buf has been initialized with the pathname
- * of a directory into which a tree of files and directories is to be placed.
- * If the directory does not already exist, it is created.  The function then reads
- * from from the standard input a sequence of bytes that represent a serialized tree
- * of files and directories in the format written by serialize() and it reconstructs
- * the tree within the specified directory.  Options that modify the behavior are
- * obtained from the global_options variable.
- *
- * @return 0 if deserialization completes without error, -1 if an error occurs.
- */
-int deserialize() {
-    // Check if magic sequence exists
-    if (checkMagicSeq() == -1) {
+// Function for reading a FILE_DATA header and returning its payload length
+static long read_file_header(int depth) {
+    struct record_header header;
+    if (read_header(&header) == -1) {
+        return -1;
+    }
+    if (header.type != FILE_DATA || header.depth != depth) {
         return -1;
     }
+    return header.size - HEADER_SIZE;
+}
+
+
+// Function for checking if the next record starts a run of compressed blocks
+static int is_compressed() {
+    struct record_header header;
+    return peek_header(&header) == 0 && header.type == COMPRESSED_BLOCK;
+}
+
+
+// Function for checking if the next record holds the extents of a file with holes
+static int is_sparse() {
+    struct record_header header;
+    return peek_header(&header) == 0 && header.type == SPARSE_DATA;
+}
+
+
+// Function for checking if the next record refers to an earlier file
+static int is_reference() {
+    struct record_header header;
+    return peek_header(&header) == 0 && (header.type == REFERENCE || header.type == HARD_LINK);
+}
+
 
-    // Get type byte
-    int eofCheck = getchar();
-    if (eofCheck == EOF) {
+// Function for restoring a file from a REFERENCE or HARD_LINK record
+static int restore_reference(int depth, mode_t mode) {
+    struct record_header header;
+    if (read_header(&header) == -1) {
+        return -1;
+    }
+    if ((header.type != REFERENCE && header.type != HARD_LINK) || header.depth != depth) {
         return -1;
     }
-    unsigned char current = eofCheck;
 
-    // If first header not start of transmission, return error
-    if (current != START_OF_TRANSMISSION) {
+    // The earlier file may still be queued on the writer pool
+    if (pooled && restore_pool_drain() == -1) {
         return -1;
     }
+    return dedup_restore(path_buf, rootLength, header.type, header.size - HEADER_SIZE, mode);
+}
 
-    // Since start of transmission go to next header
-    for (int i = 0; i < 12; i++) {
-        eofCheck = getchar();
-        if (eofCheck == EOF) {
+
+// Function for skipping a FILE_DATA record that is not being restored
+static int skip_file(int depth) {
+    if (is_compressed()) {
+        return restore_blocks(depth, -1, NULL, 0) == -1 ? -1 : 0;
+    }
+    if (is_sparse()) {
+        return restore_sparse(depth, -1);
+    }
+    struct record_header header;
+    if (is_reference()) {
+        if (read_header(&header) == -1 || header.depth != depth) {
             return -1;
         }
+        return reader_skip(header.size - HEADER_SIZE);
     }
-
-    // If directory does not exist, create it
-    DIR *dir = opendir(path_buf);
-    if (!dir) {
-        mkdir(path_buf, 0700);
+    long dataLength = read_file_header(depth);
+    if (dataLength == -1) {
+        return -1;
     }
+    return reader_skip(dataLength);
+}
 
-    // Call desrialize_directory function
-    int getReturn = deserialize_directory(1);
-    if (getReturn == -1) {
+
+// Function for keeping a file that an UNCHANGED record says is up to date
+static int keep_file(int depth, int selected) {
+    struct record_header header;
+    if (read_header(&header) == -1) {
+        return -1;
+    }
+    if (header.type != UNCHANGED || header.depth != depth) {
         return -1;
     }
 
-    // Done deserializing, so return success
+    // The file has to be there already, or the stream was applied to the wrong tree
+    if (selected && pooled && restore_pool_settle() == -1) {
+        return -1;
+    }
+    struct stat stat_buf;
+    if (selected && (fstatat(at_dir(), at_name(), &stat_buf, 0) == -1 || !S_ISREG(stat_buf.st_mode))) {
+        return -1;
+    }
     return 0;
 }
 
 
-/*
- * @brief  Serialize the contents of a directory as a sequence of records written
- * to the standard output.
- * @details  This function assumes that path_buf contains the name of an existing
- * directory to be serialized.  It serializes the contents of that directory as a
- * sequence of records that begins with a START_OF_DIRECTORY record, ends with an
- * END_OF_DIRECTORY record, and with the intervening records all of type DIRECTORY_ENTRY.
- *
- * @param depth  The value of the depth field that is expected to occur in the
- * START_OF_DIRECTORY, DIRECTORY_ENTRY, and END_OF_DIRECTORY records processed.
- * Note that this depth pertains only to the "top-level" records in the sequence:
- * DIRECTORY_ENTRY records may be recursively followed by similar sequence of
- * records describing sub-directories at a greater depth.
- * @return 0 in case of success, -1 otherwise.  A variety of errors can occur,
- * including failure to open files, failure to traverse directories, and I/O errors
- * that occur while reading file content and writing to standard output.
- */
-int serialize_directory(int depth) {
-    // Open the  directory since it is assumed it exists
-    DIR *dir = opendir(path_buf);
-    struct dirent *de;
-    int getReturn = 0;
-
-    // If directory does not open, return failure
-    if (dir == NULL) {
+// Function for removing the entry named by a DELETED record
+static int delete_entry(long nameLength) {
+    if (push_name(nameLength) == -1) {
         return -1;
     }
+    int getReturn = 0;
+    if (select_match(path_buf + rootLength + 1)) {
+        getReturn = pooled ? restore_pool_settle() : 0;
+        getReturn = getReturn == -1 ? -1 : remove_tree(path_buf);
+    }
+    path_pop();
+    return getReturn;
+}
 
-    // Serialize the current directory
-    putchar(0x0C);
-    putchar(0x0D);
-    putchar(0xED);
-    putchar(0x02);
-
-    // Calculate needed depth and store it
-    putChar4Bytes(depth);
 
-    // For needed length and store it
-    for (int i = 0; i < 7; i++) {
-        putchar(0x00);
+// Function for reading an entry name into name_buf and pushing it onto path_buf
+static int push_name(long nameLength) {
+    // Leave room for the terminator
+    if (nameLength >= NAME_MAX) {
+        return -1;
     }
-    putchar(0x10);
-
+    if (reader_read(name_buf, nameLength) == -1) {
+        return -1;
+    }
+    *(name_buf + nameLength) = '\0';
+    if (path_push(name_buf) == -1) {
+        return -1;
+    }
+    entryName = path_buf + path_length - nameLength;
+    return 0;
+}
 
-    // Traverse to directories
-    while ((de = readdir(dir)) != NULL) {
-        // Check for . or .. dirs
-        if (stringCompare(de->d_name, ".") == 0 || stringCompare(de->d_name, "..") == 0) {
-            continue;
-        }
 
-        // Get file name and push it to the path
-        char *namePoint = de->d_name;
-        char *namePoint2 = namePoint;
-        getReturn = path_push(namePoint);
-        if (getReturn == -1) {
-            return -1;
-        }
+// Function for getting the directory the current entry is resolved against
+static int at_dir() {
+    return dirFd == -1 ? AT_FDCWD : dirFd;
+}
 
-        // Creating stat struct for getting file meta daata
-        struct stat stat_buf;
-        stat(path_buf, &stat_buf);
 
-        // Get total and name length
-        int totalLength = 28;
-        int nameLength = stringLength(namePoint);
-        totalLength += nameLength - 1;
+// Function for getting the name of the current entry relative to at_dir()
+static char *at_name() {
+    return dirFd == -1 ? path_buf : entryName;
+}
 
 
-        // Serialize directory entry
-        putchar(0x0C);
-        putchar(0x0D);
-        putchar(0xED);
-        putchar(0x04);
+// Function for creating the directory entry being restored and opening it as dirFd
+static int enter_directory(int selected, mode_t mode) {
+    if (!selected) {
+        // Nothing is made here, so entries below go by their whole path
+        dirFd = -1;
+        return 0;
+    }
+    if (pooled) {
+        // On the ring it is queued ahead of the writes into it, which go by whole path
+        int getReturn = restore_pool_mkdir(path_buf, mode);
+        if (getReturn != 1) {
+            dirFd = -1;
+            return getReturn;
+        }
+    }
+    uint64_t since = stats_clock();
+    if (mkdirat(at_dir(), at_name(), 0700) == -1 && (errno != EEXIST || (global_options & 0x8) == 0)) {
+        // Only clobber may reuse a directory that exists
+        return -1;
+    }
+    dirFd = openat(at_dir(), at_name(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stats_charge(STATS_METADATA, since);
+    return dirFd == -1 ? -1 : 0;
+}
 
-        // Get depth char and store it in 4 bytes
-        putChar4Bytes(depth);
 
-        // Get length char and store it in 8 bytes
-        putChar8Bytes(totalLength);
+// Function for creating the directories above path_buf that are missing
+static void make_parents() {
+    char *pointer = path_buf + rootLength + 1;
+    if (pooled) {
+        // Those queued on the writer pool have to be there first, or one would be made twice
+        restore_pool_settle();
+    }
+
+    // Cut the path at each separator in turn and create that prefix
+    while (*pointer != '\0') {
+        if (*pointer == '/') {
+            *pointer = '\0';
+            mkdir(path_buf, 0700);
+            *pointer = '/';
+        }
+        pointer++;
+    }
+}
 
-        // Get depth char and store it in 4 bytes
-        mode_t type = stat_buf.st_mode;
-        putchar((type & 0xFF000000) >> 24);
-        putchar((type & 0xFF0000) >> 16);
-        putchar((type & 0xFF00) >> 8);
-        putchar(type & 0xFF);
 
-        // Get length char and store it in 8 bytes
-        off_t size = stat_buf.st_size;
-        putchar((size & 0xFF00000000000000) >> 56);
-        putchar((size & 0xFF000000000000) >> 48);
-        putchar((size & 0xFF0000000000) >> 40);
-        putchar((size & 0xFF00000000) >> 32);
-        putchar((size & 0xFF000000) >> 24);
-        putchar((size & 0xFF0000) >> 16);
-        putchar((size & 0xFF00) >> 8);
-        putchar(size & 0xFF);
+// Function for deserializing a file through the writer pool
+static int deserialize_file_pooled(int depth, mode_t mode, off_t size) {
+    int getReturn;
 
-        // Get name char and store it in leftover bytes
-        while (*namePoint2 != '\0') {
-            putchar(*namePoint2);
-            namePoint2++;
+    // Files with holes are written here, seeking over the holes
+    if (is_sparse()) {
+        int fd = create_file();
+        if (fd == -1) {
+            return -1;
+        }
+        if (restore_sparse(depth, fd) == -1) {
+            close(fd);
+            return -1;
         }
+        if (finish_file(fd) == -1) {
+            return -1;
+        }
+        return fchmodat(at_dir(), at_name(), mode & 0777, 0);
+    }
 
+    // Compressed contents are decoded here and only the writing is handed out
+    int compressed = is_compressed();
+    long dataLength = size;
+    if (!compressed) {
+        dataLength = read_file_header(depth);
+        if (dataLength == -1) {
+            return -1;
+        }
+    }
 
-        // Check if file or directory
-        if (S_ISREG(stat_buf.st_mode)) {
-            // Now serialize file content
-            getReturn = serialize_file(depth, stat_buf.st_size);
-            if (path_pop() == -1) {
-                return -1;
+    // Large files are bandwidth bound, so write them here
+    if (dataLength > PARALLEL_PREFETCH_MAX) {
+        int fd = create_file();
+        if (fd == -1) {
+            return -1;
+        }
+        if (writeback_preallocate(fd, size) == -1) {
+            close(fd);
+            return -1;
+        }
+        if (compressed) {
+            getReturn = restore_blocks(depth, fd, NULL, 0) == -1 ? -1 : 0;
+        } else {
+            getReturn = reader_copy(fd, dataLength);
+        }
+        if (getReturn == -1) {
+            close(fd);
+            return -1;
+        }
+        if (finish_file(fd) == -1) {
+            return -1;
+        }
+        return fchmodat(at_dir(), at_name(), mode & 0777, 0);
+    }
+
+    // Read the whole payload and hand it to a writer
+    return restore_pool_read(path_buf, mode, depth, dataLength, compressed);
+}
+
+
+// The work of deserialize(), timed and counted as a whole when statistics are on
+static int deserialize_stream() {
+    // Resume from the checkpoint of an interrupted run, overwriting whatever it left half done
+    struct checkpoint resume;
+    entryIndex = 0;
+    replayEntries = 0;
+    contentTotal = 0;
+    if (checkpoint_path != NULL) {
+        int loaded = checkpoint_open(checkpoint_path, &resume);
+        if (loaded == -1) {
+            return -1;
+        }
+        if (loaded == 1) {
+            replayEntries = resume.entries;
+            global_options |= 0x8;
+        }
+
+        // Carry on the count of contents restored, unless -s made the checkpoint
+        if (loaded == 1 && resume.kind == CHECKPOINT_DESERIALIZE) {
+            contentTotal = resume.total;
+        } else if (loaded == 1) {
+            checkpoint_restart();
+        }
+    }
+
+    // Read from the named file if there is one, otherwise stdin
+    int fd = STDIN_FILENO;
+    if (input_path != NULL) {
+        fd = open(input_path, O_RDONLY);
+        if (fd == -1) {
+            return -1;
+        }
+    }
+    int fromStart = lseek(fd, 0, SEEK_CUR) == 0;
+    reader_open(fd);
+
+    // If first header not start of transmission, return error
+    if (read_start() == -1) {
+        reader_close();
+        return -1;
+    }
+
+    // An --only selection can use the index of an archive file that has one, unless it is checksummed
+    int indexed = select_active() && checkpoint_path == NULL && fromStart && !reader_checking()
+        && index_load(fd) == 0;
+
+    rootLength = path_length;
+    restoredCount = 0;
+
+    // If directory does not exist, create it, then work relative to it
+    mkdir(path_buf, 0700);
+    dirFd = open(path_buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd == -1) {
+        reader_close();
+        return -1;
+    }
+
+    // With --nocache restored files leave the page cache once written
+    if ((global_options & 0x100000) == 0x100000) {
+        writeback_start();
+    }
+
+    // Start the writer pool if asked for, on the I/O ring with -a
+    pooled = worker_count > 1 || (global_options & 0x2000) == 0x2000;
+    if (pooled && restore_pool_start(worker_count) == -1) {
+        writeback_finish();
+        reader_close();
+        close(dirFd);
+        dirFd = -1;
+        return -1;
+    }
+
+    // With an index, selected entries are read from where it says rather than found by walking
+    int getReturn;
+    if (indexed) {
+        getReturn = deserialize_indexed();
+    } else {
+        // Call desrialize_directory function, then check the whole stream if it is checksummed
+        getReturn = deserialize_directory(1);
+        if (getReturn == 0) {
+            getReturn = read_end();
+        }
+    }
+    index_unload();
+    reader_close();
+    close(dirFd);
+    dirFd = -1;
+
+    // Wait for the writers, even after an error, then for the writeback
+    if (pooled && restore_pool_finish() == -1) {
+        getReturn = -1;
+    }
+    writeback_finish();
+    if (getReturn == -1) {
+        return -1;
+    }
+
+    // Done deserializing, so return success
+    return 0;
+}
+
+
+// Function for restoring the --only selection from the entries the index points at
+static int deserialize_indexed() {
+    long count;
+    const struct select_entry *located = select_locate(&count);
+    if (located == NULL) {
+        // Patterns with wildcards have to be matched against the whole stream
+        return deserialize_directory(1);
+    }
+
+    // Entries are resolved by their whole path, each from the root
+    if (dirFd != -1) {
+        close(dirFd);
+        dirFd = -1;
+    }
+    for (long i = 0; i < count; i++) {
+        if (restore_located(located + i) == -1) {
+            return -1;
+        }
+    }
+
+    // The directories above them get their modes last, as a full restore does
+    for (long i = 0; i < count; i++) {
+        if (restore_parent_modes(located + i) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Function for restoring one entry found in the index, and everything below it
+static int restore_located(const struct select_entry *target) {
+    // Error if the whole pathname does not fit after the root
+    if (rootLength + 1 + target->length > PATH_MAX - 1) {
+        return -1;
+    }
+
+    // Put the whole pathname after the root and create the directories above it
+    char *pointer = path_buf + rootLength;
+    *pointer = '/';
+    int depth = 1;
+    int parentLength = rootLength;
+    for (size_t i = 0; i < target->length; i++) {
+        pointer++;
+        *pointer = *(target->path + i);
+        if (*pointer == '/') {
+            depth++;
+            parentLength = pointer - path_buf;
+        }
+    }
+    *(pointer + 1) = '\0';
+    path_length = pointer + 1 - path_buf;
+    make_parents();
+
+    // The entry's own name is pushed again as its record is read
+    *(path_buf + parentLength) = '\0';
+    path_length = parentLength;
+
+    struct record_header header;
+    if (reader_seek(target->location.entry_offset) == -1 || read_header(&header) == -1) {
+        return -1;
+    }
+    if (header.type != DIRECTORY_ENTRY || header.depth != depth) {
+        return -1;
+    }
+    return deserialize_entry(depth, header.size);
+}
+
+
+// Function for setting the modes the index records for the directories above an entry
+static int restore_parent_modes(const struct select_entry *target) {
+    // Deepest first, each prefix ending before a separator
+    for (size_t length = target->length; length > 0; length--) {
+        if (*(target->path + length) != '/') {
+            continue;
+        }
+        struct index_entry location;
+        struct record_header header;
+        if (index_find(target->path, length, &location) == -1) {
+            return -1;
+        }
+        if (reader_seek(location.entry_offset) == -1 || read_header(&header) == -1) {
+            return -1;
+        }
+        if (header.type != DIRECTORY_ENTRY) {
+            return -1;
+        }
+        char *metadata = reader_view(ENTRY_METADATA_SIZE);
+        if (metadata == NULL) {
+            return -1;
+        }
+        mode_t mode = load_be32(metadata);
+
+        // Put the prefix after the root, which restore_located already checked fits
+        char *pointer = path_buf + rootLength;
+        *pointer = '/';
+        for (size_t i = 0; i < length; i++) {
+            pointer++;
+            *pointer = *(target->path + i);
+        }
+        *(pointer + 1) = '\0';
+        path_length = pointer + 1 - path_buf;
+
+        // Set it after all pending writes if pooled
+        if (pooled) {
+            restore_pool_defer_mode(path_buf, mode);
+        } else {
+            uint64_t since = stats_clock();
+            chmod(path_buf, mode & 0777);
+            stats_charge(STATS_METADATA, since);
+        }
+    }
+    *(path_buf + rootLength) = '\0';
+    path_length = rootLength;
+    return 0;
+}
+
+
+/**
+ * @brief Reads serialized data from the standard input and reconstructs from it
+ * a tree of files and directories.
+ * @details  This function assumes path_buf has been initialized with the pathname
+ * of a directory into which a tree of files and directories is to be placed.
+ * If the directory does not already exist, it is created.  The function then reads
+ * from from the standard input a sequence of bytes that represent a serialized tree
+ * of files and directories in the format written by serialize() and it reconstructs
+ * the tree within the specified directory.  Options that modify the behavior are
+ * obtained from the global_options variable.
+ *
+ * @return 0 if deserialization completes without error, -1 if an error occurs.
+ */
+int deserialize() {
+    int statistics = (global_options & 0x30000) != 0;
+    if (statistics && stats_start((global_options & 0x10000) != 0, (global_options & 0x20000) != 0) == -1) {
+        return -1;
+    }
+    int getReturn;
+    if ((global_options & 0x1800000) != 0) {
+        // -l and -V walk the stream without restoring anything
+        getReturn = list_archive((global_options & 0x800000) != 0, (global_options & 0x1000000) != 0);
+    } else {
+        getReturn = deserialize_stream();
+    }
+    checkpoint_finish(getReturn == 0);
+    if (statistics) {
+        stats_finish();
+    }
+    return getReturn;
+}
+
+
+/*
+ * @brief  Serialize the contents of a directory as a sequence of records written
+ * to the standard output.
+ * @details  This function assumes that path_buf contains the name of an existing
+ * directory to be serialized.  It serializes the contents of that directory as a
+ * sequence of records that begins with a START_OF_DIRECTORY record, ends with an
+ * END_OF_DIRECTORY record, and with the intervening records all of type DIRECTORY_ENTRY.
+ * The directory is opened through at_dir() and at_name(), and its entries are
+ * then looked up relative to it rather than by their whole path.
+ *
+ * @param depth  The value of the depth field that is expected to occur in the
+ * START_OF_DIRECTORY, DIRECTORY_ENTRY, and END_OF_DIRECTORY records processed.
+ * Note that this depth pertains only to the "top-level" records in the sequence:
+ * DIRECTORY_ENTRY records may be recursively followed by similar sequence of
+ * records describing sub-directories at a greater depth.
+ * @return 0 in case of success, -1 otherwise.  A variety of errors can occur,
+ * including failure to open files, failure to traverse directories, and I/O errors
+ * that occur while reading file content and writing to standard output.
+ */
+int serialize_directory(int depth) {
+    // Open the  directory since it is assumed it exists, reading small files
+    // ahead unless most of them are going to be compared rather than emitted,
+    // and fetching modification times only when a manifest is involved
+    int scanFlags = (global_options & 0xA00) == 0 && entryIndex >= replayEntries ? SCAN_PREFETCH : 0;
+    if ((global_options & 0x300) != 0) {
+        scanFlags |= SCAN_TIMES;
+    }
+    if ((global_options & 0x4000) == 0x4000) {
+        scanFlags |= SCAN_BY_NAME;
+    } else if ((global_options & 0x8000) == 0x8000) {
+        scanFlags |= SCAN_BY_INODE;
+    }
+    struct scan *dir = scan_open(at_dir(), at_name(), scanFlags);
+    char *namePoint;
+    struct stat stat_buf;
+    int getReturn = 0;
+
+    // If directory does not open, return failure
+    if (dir == NULL) {
+        return -1;
+    }
+    dirFd = scan_fd(dir);
+
+    // Serialize the current directory
+    if (put_header(START_OF_DIRECTORY, depth, HEADER_SIZE) == -1) {
+        scan_close(dir);
+        return -1;
+    }
+
+
+    // Traverse to directories, each entry coming with its file meta data
+    while ((getReturn = scan_next(dir, &namePoint, &stat_buf)) == 1) {
+        // Push the file name to the path
+        getReturn = path_push(namePoint);
+        if (getReturn == -1) {
+            scan_close(dir);
+            return -1;
+        }
+        entryName = path_buf + path_length - stringLength(namePoint) + 1;
+
+        // Look the entry up in the base manifest of an incremental run
+        char *relPath = path_buf + rootLength + 1;
+        int relLength = path_length - rootLength - 1;
+        int nameLength = stringLength(namePoint) - 1;
+        struct manifest_entry *previous = manifest_find(relPath, relLength);
+        if (previous != NULL) {
+            previous->seen = 1;
+
+            // Changed between file and directory, so the old one goes first
+            if ((previous->mode & S_IFMT) != (stat_buf.st_mode & S_IFMT)) {
+                if (put_header(DELETED, depth, HEADER_SIZE + nameLength) == -1
+                    || put_data(namePoint, nameLength) == -1) {
+                    scan_close(dir);
+                    return -1;
+                }
+                previous = NULL;
             }
-            if (getReturn == -1) {
-                return -1;
+        }
+
+        // Entries done before the checkpoint of an interrupted run are walked again, not read
+        int replay = entryIndex < replayEntries ? checkpoint_replay(entryIndex, relPath, relLength) : 0;
+        if (replay == -1) {
+            scan_close(dir);
+            return -1;
+        }
+        entryIndex++;
+
+        // Serialize directory entry with its metadata and name
+        if (put_entry(depth, stat_buf.st_mode, stat_buf.st_size, namePoint, nameLength) == -1) {
+            scan_close(dir);
+            return -1;
+        }
+
+
+        // Check if file or directory
+        const char *original;
+        size_t originalLength;
+        if (replay && S_ISREG(stat_buf.st_mode)) {
+            // Contents sent before, unless the stream is being carried on where it stopped
+            getReturn = put_header(UNCHANGED, depth, HEADER_SIZE);
+            fileHash = 0;
+        } else if (S_ISREG(stat_buf.st_mode) && previous != NULL
+            && manifest_unchanged(previous, &stat_buf, path_buf)) {
+            // Contents are already at the destination
+            getReturn = put_header(UNCHANGED, depth, HEADER_SIZE);
+            fileHash = previous->hash;
+        } else if (S_ISREG(stat_buf.st_mode) && stat_buf.st_nlink > 1 && (global_options & 0x2000000) == 0x2000000
+                   && dedup_link_find(stat_buf.st_dev, stat_buf.st_ino, &original, &originalLength, &fileHash)) {
+            // Another name for a file already emitted
+            getReturn = put_header(HARD_LINK, depth, HEADER_SIZE + originalLength);
+            if (getReturn == 0) {
+                getReturn = put_data(original, originalLength);
             }
+        } else if (S_ISREG(stat_buf.st_mode)) {
+            // Now serialize file content, which may have been read ahead
+            prefetchedLength = scan_data(dir, &prefetched);
+            getReturn = serialize_file(depth, stat_buf.st_size);
+            prefetched = NULL;
         } else if (S_ISDIR(stat_buf.st_mode)) {
-            // Now serialize directory content
+            // Now serialize directory content, then get back to this one
             getReturn = serialize_directory(depth + 1);
-            if (path_pop() == -1) {
-                return -1;
-            }
-            if (getReturn == -1) {
-                return -1;
-            }
+            dirFd = scan_fd(dir);
+        }
+        if (getReturn == 0 && S_ISREG(stat_buf.st_mode) && stat_buf.st_nlink > 1
+            && (global_options & 0x2000000) == 0x2000000) {
+            dedup_link_add(stat_buf.st_dev, stat_buf.st_ino, fileHash, relPath, relLength);
+        }
+        if (getReturn == 0) {
+            getReturn = manifest_add(relPath, relLength, &stat_buf, S_ISREG(stat_buf.st_mode) ? fileHash : 0);
         }
-    }
-
 
-    // Complete end of directory entry
-    putchar(0x0C);
-    putchar(0x0D);
-    putchar(0xED);
-    putchar(0x03);
+        // Records after the last entry replayed are written again, and checkpoints made
+        if (replay && entryIndex == replayEntries) {
+            writer_replayed();
+        }
+        if (getReturn == 0 && !replay && S_ISREG(stat_buf.st_mode)
+            && checkpoint_due(entryIndex, writer_offset())) {
+            getReturn = serialize_checkpoint(relPath, relLength);
+        }
+        if (path_pop() == -1 || getReturn == -1) {
+            scan_close(dir);
+            return -1;
+        }
+    }
 
-    // Get depth char and store it in 4 bytes
-    putChar4Bytes(depth);
+    if (getReturn == -1) {
+        scan_close(dir);
+        return -1;
+    }
 
-    // Finish the length field
-    for (int i = 0; i < 7; i++) {
-        putchar(0x00);
+    // Entries of the base manifest that were not seen again are gone
+    if (path_length > rootLength) {
+        getReturn = manifest_emit_deleted(path_buf + rootLength + 1, path_length - rootLength - 1, depth);
+    } else {
+        getReturn = manifest_emit_deleted(path_buf, 0, depth);
+    }
+    if (getReturn == -1) {
+        scan_close(dir);
+        return -1;
     }
-    putchar(0x10);
 
-    // Done serializing directory, so return success
-    closedir(dir);
-    return 0;
+
+    // Complete end of directory entry
+    scan_close(dir);
+    return put_header(END_OF_DIRECTORY, depth, HEADER_SIZE);
 }
 
 
@@ -697,45 +1299,205 @@ int serialize_directory(int depth) {
  * from the file, and I/O errors reading the file data or writing to standard output.
  */
 int serialize_file(int depth, off_t size) {
+    // Contents already in memory need no file at all
+    int getReturn = 0;
+    if (prefetched != NULL && prefetchedLength == size) {
+        if ((global_options & 0x100) == 0x100) {
+            struct hash_state state;
+            hash_init(&state);
+            hash_update(&state, prefetched, size);
+            fileHash = hash_final(&state);
+        }
+        if ((global_options & 0x400) == 0x400) {
+            return put_compressed_data(prefetched, size, depth);
+        }
+        getReturn = put_header(FILE_DATA, depth, HEADER_SIZE + size);
+        if (getReturn == 0) {
+            getReturn = put_data(prefetched, size);
+        }
+        return getReturn;
+    }
+
     // Open the file and return error if it does not exist
-    FILE *f = fopen(path_buf, "r");
-    if (!f) {
+    int fd = openat(at_dir(), at_name(), O_RDONLY);
+    if (fd == -1) {
         return -1;
     }
 
-    // Calculate total length of file entry
-    long totalLength = 16 + size;
+    // Contents emitted before are referred to rather than repeated
+    if ((global_options & 0x800) == 0x800) {
+        const char *original;
+        size_t originalLength;
+        getReturn = dedup_find(fd, size, &fileHash, &original, &originalLength);
+        if (getReturn == 1) {
+            getReturn = put_header(REFERENCE, depth, HEADER_SIZE + originalLength);
+            if (getReturn == 0) {
+                getReturn = put_data(original, originalLength);
+            }
+            if (close(fd) == -1) {
+                return -1;
+            }
+            return getReturn;
+        }
+        if (getReturn == -1) {
+            close(fd);
+            return -1;
+        }
+    }
 
-    // Put basic directory file entry data
-    putchar(0x0C);
-    putchar(0x0D);
-    putchar(0xED);
-    putchar(0x05);
+    // Files with holes send only their data extents with -S, hashed with the holes as zeros
+    if ((global_options & 0x4000000) == 0x4000000) {
+        struct hash_state state;
+        hash_init(&state);
+        getReturn = put_sparse(fd, size, depth, (global_options & 0x900) != 0 ? &state : NULL);
+        if (getReturn != 0) {
+            fileHash = hash_final(&state);
+            if (close(fd) == -1) {
+                return -1;
+            }
+            if (getReturn == 1 && (global_options & 0x900) != 0) {
+                dedup_add(size, fileHash, path_buf + rootLength + 1, path_length - rootLength - 1);
+            }
+            return getReturn == 1 ? 0 : -1;
+        }
+    }
+
+    // Compressed contents replace the FILE_DATA record with blocks
+    if ((global_options & 0x400) == 0x400) {
+        struct hash_state state;
+        hash_init(&state);
+        index_data(size);
+        getReturn = put_compressed(fd, size, depth, &state, 0);
+        fileHash = hash_final(&state);
+        if (close(fd) == -1) {
+            return -1;
+        }
+        if (getReturn == 0) {
+            dedup_add(size, fileHash, path_buf + rootLength + 1, path_length - rootLength - 1);
+        }
+        return getReturn;
+    }
 
-    // Calculate needed depth and store it
-    putChar4Bytes(depth);
+    // Header goes into the same batch as the entry before it and the payload
+    getReturn = put_header(FILE_DATA, depth, HEADER_SIZE + size);
+    if (getReturn == 0 && (global_options & 0x900) != 0) {
+        // The manifest and deduplication need the content hash, so the payload is hashed on the way
+        struct hash_state state;
+        hash_init(&state);
+        getReturn = put_payload_hashed(fd, size, &state);
+        fileHash = hash_final(&state);
+        if (getReturn == 0) {
+            dedup_add(size, fileHash, path_buf + rootLength + 1, path_length - rootLength - 1);
+        }
+    } else if (getReturn == 0) {
+        getReturn = put_payload(fd, size);
+    }
 
-    // Calculate needed length and store it
-    putChar8Bytes(totalLength);
+    // Close file and return
+    if (close(fd) == -1) {
+        return -1;
+    }
+    return getReturn;
+}
 
 
-    // Put file content in file entry data
-    int eofCheck = 0;
-    for (int i = 0; i < size; i++) {
-        eofCheck = fgetc(f);
-        if (eofCheck == EOF) {
+// Function for making a checkpoint once the file in path_buf is serialized
+static int serialize_checkpoint(char *relPath, int relLength) {
+    struct checkpoint state = { CHECKPOINT_SERIALIZE, entryIndex, 0, writer_offset(), 0 };
+    if (writer_checkpoint(&state.base, &state.crc) == -1) {
+        return -1;
+    }
+    return checkpoint_save(&state, relPath, relLength);
+}
+
+
+// The work of serialize(), timed and counted as a whole when statistics are on
+static int serialize_stream() {
+    // Resume from the checkpoint of an interrupted run if there is one
+    struct checkpoint resume;
+    int loaded = 0;
+    entryIndex = 0;
+    replayEntries = 0;
+    if (checkpoint_path != NULL) {
+        loaded = checkpoint_open(checkpoint_path, &resume);
+        if (loaded == -1) {
             return -1;
         }
-        unsigned char current = eofCheck;
-        putchar(current);
+        if (loaded == 1) {
+            replayEntries = resume.entries;
+        }
     }
 
-    // Close file and return success
-    eofCheck = fclose(f);
-    if (eofCheck == EOF) {
+    writer_open(STDOUT_FILENO);
+    rootLength = path_length;
+
+    // Aligned contents can be cloned on restore, which compressed blocks cannot
+    if ((global_options & 0x80000) == 0x80000 && (global_options & 0x400) == 0) {
+        writer_align();
+    }
+
+    // Manifests to serialize against and to record this run in
+    if (base_path != NULL && manifest_load(base_path) == -1) {
         return -1;
     }
-    return 0;
+    if (manifest_path != NULL && manifest_create(manifest_path) == -1) {
+        return -1;
+    }
+
+    // Add start of transmission entry, turning on checksums if asked for, unless the
+    // stream an interrupted run left in the output can be carried on instead.  Otherwise
+    // the whole tree is sent again, with UNCHANGED in place of the contents sent before
+    int checksums = (global_options & 0x40000) == 0x40000;
+    if (loaded == 1 && resume.kind == CHECKPOINT_SERIALIZE
+        && writer_resume(resume.base, resume.total, checksums, resume.crc) == 0) {
+        debug("carrying on the stream from entry %llu", (unsigned long long)resume.entries);
+    } else if (put_start(checksums) == -1) {
+        return -1;
+    } else if (loaded == 1) {
+        checkpoint_restart();
+    }
+
+    // Remember the contents emitted if duplicates are to be referred to
+    if ((global_options & 0x800) == 0x800 && dedup_begin(path_buf) == -1) {
+        return -1;
+    }
+
+    // Collect the entries written from here on if an index was asked for
+    if ((global_options & 0x40) == 0x40 && index_begin() == -1) {
+        return -1;
+    }
+
+    // Call on serialize_directory, or hand the tree to the workers unless manifests,
+    // deduplication or checkpoints are involved, which only the single thread handles
+    int getReturn = 0;
+    if (worker_count > 1 && (global_options & OPTION_SERIAL_ONLY) == 0) {
+        getReturn = serialize_parallel(1, worker_count);
+    } else {
+        // The ring is optional, the plain system calls do the same work without it
+        if ((global_options & 0x2000) == 0x2000) {
+            uring_start();
+        }
+        getReturn = serialize_directory(1);
+        dirFd = -1;
+        uring_stop();
+    }
+    dedup_end();
+    if (manifest_close() == -1) {
+        getReturn = -1;
+    }
+    if (getReturn == -1) {
+        writer_flush();
+        return -1;
+    }
+
+    // Add the index if any, then end of transmission entry and send the last batch
+    if (index_finish() == -1) {
+        return -1;
+    }
+    if (put_end() == -1) {
+        return -1;
+    }
+    return writer_flush();
 }
 
 
@@ -752,34 +1514,30 @@ int serialize_file(int depth, off_t size) {
  * @return 0 if serialization completes without error, -1 if an error occurs.
  */
 int serialize() {
-    // Add start of transmission entry
-    putchar(0x0C);
-    putchar(0x0D);
-    putchar(0xED);
-    for (int i = 0; i < 12; i++) {
-        putchar(0x00);
+    // Files are read around the page cache with --nocache or --direct
+    int mode = 0;
+    if ((global_options & 0x100000) == 0x100000) {
+        mode |= SOURCE_NOCACHE;
     }
-    putchar(0x10);
-
-    // Call on serialize_directory
-    int getReturn = serialize_directory(1);
-    if (getReturn == -1) {
+    if ((global_options & 0x200000) == 0x200000) {
+        mode |= SOURCE_DIRECT;
+    }
+    if (mode != 0 && source_start(mode, read_window) == -1) {
         return -1;
     }
 
-    // Add end of transmission entry
-    putchar(0x0C);
-    putchar(0x0D);
-    putchar(0xED);
-    putchar(0x10);
-    for (int i = 0; i < 11; i++) {
-        putchar(0x00);
+    int statistics = (global_options & 0x30000) != 0;
+    if (statistics && stats_start((global_options & 0x10000) != 0, (global_options & 0x20000) != 0) == -1) {
+        source_finish();
+        return -1;
     }
-    putchar(0x10);
-
-    // Serializing done so return success
-    fflush(stdout);
-    return -0;
+    int getReturn = serialize_stream();
+    checkpoint_finish(getReturn == 0);
+    if (statistics) {
+        stats_finish();
+    }
+    source_finish();
+    return getReturn;
 }
 
 
@@ -827,6 +1585,128 @@ int validargs(int argc, char **argv) {
                 if (stringCompare("-c", *argv) == 0) {
                     return -1;
                 }
+                // If -j flag
+                else if (stringCompare("-j", *argv) == 0) {
+                    // Need to check for worker count
+                    argv++;
+                    if (*argv == NULL) {
+                        return -1;
+                    }
+                    long count = stringToLong(*argv);
+                    if (count < 1 || count > PARALLEL_MAX_WORKERS) {
+                        return -1;
+                    }
+                    worker_count = count;
+                    global_options |= 0x10;
+                }
+                // If -x flag
+                else if (stringCompare("-x", *argv) == 0) {
+                    global_options |= 0x40;
+                }
+                // If -z flag
+                else if (stringCompare("-z", *argv) == 0) {
+                    global_options |= 0x400;
+                }
+                // If -u flag
+                else if (stringCompare("-u", *argv) == 0) {
+                    global_options |= 0x800;
+                }
+                // If -k flag
+                else if (stringCompare("-k", *argv) == 0) {
+                    global_options |= 0x40000;
+                }
+                // If -H flag
+                else if (stringCompare("-H", *argv) == 0) {
+                    global_options |= 0x2000000;
+                }
+                // If -S flag
+                else if (stringCompare("-S", *argv) == 0) {
+                    global_options |= 0x4000000;
+                }
+                // If --align flag
+                else if (stringCompare("--align", *argv) == 0) {
+                    global_options |= 0x80000;
+                }
+                // If --nocache flag
+                else if (stringCompare("--nocache", *argv) == 0) {
+                    global_options |= 0x100000;
+                }
+                // If --direct flag
+                else if (stringCompare("--direct", *argv) == 0) {
+                    global_options |= 0x200000;
+                }
+                // If --readahead flag
+                else if (stringCompare("--readahead", *argv) == 0) {
+                    // Need to check for the window in MiB
+                    argv++;
+                    if (*argv == NULL) {
+                        return -1;
+                    }
+                    long size = stringToLong(*argv);
+                    if (size < 1 || size > SOURCE_WINDOW_MAX >> 20) {
+                        return -1;
+                    }
+                    read_window = (size_t)size << 20;
+                }
+                // If -a flag
+                else if (stringCompare("-a", *argv) == 0) {
+                    global_options |= 0x2000;
+                }
+                // If --stats flag
+                else if (stringCompare("--stats", *argv) == 0) {
+                    global_options |= 0x10000;
+                }
+                // If --progress flag
+                else if (stringCompare("--progress", *argv) == 0) {
+                    global_options |= 0x20000;
+                }
+                // If --resume flag
+                else if (stringCompare("--resume", *argv) == 0) {
+                    // Need to check for FILE
+                    argv++;
+                    if (*argv == NULL) {
+                        return -1;
+                    }
+                    if (**argv == *"-") {
+                        return -1;
+                    }
+                    checkpoint_path = *argv;
+                    global_options |= 0x400000;
+                }
+                // If -o flag
+                else if (stringCompare("-o", *argv) == 0) {
+                    // Need to check for the order
+                    argv++;
+                    if (*argv == NULL) {
+                        return -1;
+                    }
+                    if (stringCompare("name", *argv) == 0) {
+                        global_options |= 0x4000;
+                    } else if (stringCompare("inode", *argv) == 0) {
+                        global_options |= 0x8000;
+                    } else {
+                        return -1;
+                    }
+                }
+                // If -m or -b flag
+                else if (stringCompare("-m", *argv) == 0 || stringCompare("-b", *argv) == 0) {
+                    // Need to check for FILE
+                    int base = stringCompare("-b", *argv) == 0;
+                    argv++;
+                    if (*argv == NULL) {
+                        return -1;
+                    }
+                    if (**argv == *"-") {
+                        return -1;
+                    }
+                    if (base) {
+                        base_path = *argv;
+                        global_options |= 0x200;
+                    } else {
+                        manifest_path = *argv;
+                        global_options |= 0x100;
+                    }
+                }
                 // If -p flag
                 else if (stringCompare("-p", *argv) == 0) {
                     // Need to check for DIR
@@ -851,6 +1731,16 @@ int validargs(int argc, char **argv) {
             }
         }
 
+        // A stream carried on from a checkpoint cannot have an index or manifests
+        if ((global_options & 0x400000) == 0x400000 && (global_options & 0x340) != 0) {
+            return -1;
+        }
+
+        // Manifests, deduplication and checkpoints are kept by the single thread only
+        if ((global_options & OPTION_JOBS) == OPTION_JOBS && (global_options & OPTION_SERIAL_ONLY) != 0) {
+            return -1;
+        }
+
         // Else set current directory for serialization
         if (pathInitiated == 0) {
             if (path_init(".") == -1) {
@@ -877,6 +1767,80 @@ int validargs(int argc, char **argv) {
                 if (stringCompare("-c", *argv) == 0) {
                     global_options |= 0x8;
                 }
+                // If -j flag
+                else if (stringCompare("-j", *argv) == 0) {
+                    // Need to check for worker count
+                    argv++;
+                    if (*argv == NULL) {
+                        return -1;
+                    }
+                    long count = stringToLong(*argv);
+                    if (count < 1 || count > PARALLEL_MAX_WORKERS) {
+                        return -1;
+                    }
+                    worker_count = count;
+                    global_options |= 0x10;
+                }
+                // If -L flag
+                else if (stringCompare("-L", *argv) == 0) {
+                    global_options |= 0x1000;
+                }
+                // If -a flag
+                else if (stringCompare("-a", *argv) == 0) {
+                    global_options |= 0x2000;
+                }
+                // If --stats flag
+                else if (stringCompare("--stats", *argv) == 0) {
+                    global_options |= 0x10000;
+                }
+                // If --progress flag
+                else if (stringCompare("--progress", *argv) == 0) {
+                    global_options |= 0x20000;
+                }
+                // If --resume flag
+                else if (stringCompare("--resume", *argv) == 0) {
+                    // Need to check for FILE
+                    argv++;
+                    if (*argv == NULL) {
+                        return -1;
+                    }
+                    if (**argv == *"-") {
+                        return -1;
+                    }
+                    checkpoint_path = *argv;
+                    global_options |= 0x400000;
+                }
+                // If --nocache flag
+                else if (stringCompare("--nocache", *argv) == 0) {
+                    global_options |= 0x100000;
+                }
+                // If -i flag
+                else if (stringCompare("-i", *argv) == 0) {
+                    // Need to check for FILE
+                    argv++;
+                    if (*argv == NULL) {
+                        return -1;
+                    }
+                    if (**argv == *"-") {
+                        return -1;
+                    }
+                    input_path = *argv;
+                    global_options |= 0x20;
+                }
+                // If --only flag
+                else if (stringCompare("--only", *argv) == 0) {
+                    // Need at least one PATH, taking every one up to the next flag
+                    if (*(argv + 1) == NULL || **(argv + 1) == *"-") {
+                        return -1;
+                    }
+                    while (*(argv + 1) != NULL && **(argv + 1) != *"-") {
+                        argv++;
+                        if (select_add(*argv) == -1) {
+                            return -1;
+                        }
+                    }
+                    global_options |= 0x80;
+                }
                 // If -p flag
                 else if (stringCompare("-p", *argv) == 0) {
                     // need to check for DIR
@@ -915,7 +1879,53 @@ int validargs(int argc, char **argv) {
     }
 
 
-    // First flag was neither -h, -s, or -d so return error
+    // If -l or -V flag, list or verify serialized data
+    if (stringCompare("-l", *argv) == 0 || stringCompare("-V", *argv) == 0) {
+        while (*argv != NULL) {
+            // If -l flag
+            if (stringCompare("-l", *argv) == 0) {
+                global_options |= 0x800000;
+            }
+            // If -V flag
+            else if (stringCompare("-V", *argv) == 0) {
+                global_options |= 0x1000000;
+            }
+            // If --stats flag
+            else if (stringCompare("--stats", *argv) == 0) {
+                global_options |= 0x10000;
+            }
+            // If --progress flag
+            else if (stringCompare("--progress", *argv) == 0) {
+                global_options |= 0x20000;
+            }
+            // If -i flag
+            else if (stringCompare("-i", *argv) == 0) {
+                // Need to check for FILE
+                argv++;
+                if (*argv == NULL) {
+                    return -1;
+                }
+                if (**argv == *"-") {
+                    return -1;
+                }
+                input_path = *argv;
+                global_options |= 0x20;
+            }
+            // If other return error
+            else {
+                return -1;
+            }
+
+            argv++;
+        }
+
+        // Set global options and return, the stream being read as -d reads it
+        global_options |= 0x4;
+        return 0;
+    }
+
+
+    // First flag was neither -h, -s, -d, -l or -V so return error
     return -1;
 }
 
@@ -943,79 +1953,18 @@ int stringLength(char *string1) {
 }
 
 
-// Function for checking magic sequence in file
-int checkMagicSeq() {
-    // Create needed pointers using getchar() since stdin
-    int firstEOF = getchar();
-    int secondEOF = getchar();
-    int thirdEOF= getchar();
-
-    // Check if above chars do not exist
-    if (firstEOF == EOF || secondEOF == EOF || thirdEOF == EOF) {
-        return -1;
-    }
-
-    // Set to unsigned chars for no errors
-    unsigned char first = firstEOF;
-    unsigned char second = secondEOF;
-    unsigned char third = thirdEOF;
-
-    // First character
-    if (first != MAGIC0) {
-        return -1;
-    }
-    // Second character
-    if (second != MAGIC1) {
-        return -1;
-    }
-    // Third character
-    if (third != MAGIC2) {
+// Function for parsing a non-negative decimal number
+long stringToLong(char *string1) {
+    long value = 0;
+    if (*string1 == '\0') {
         return -1;
     }
-
-    return 0;
-}
-
-
-// Function for getting the decimal value of hex bytes
-long getHexToDecimal(int length) {
-    unsigned long value = 0;
-
-    for (int i = 0; i < length; i++) {
-        int num = getchar();
-        // Make sure num if not eof
-        if (num == EOF) {
+    while (*string1 != '\0') {
+        if (*string1 < '0' || *string1 > '9' || value > 0xFFFFFFFF) {
             return -1;
         }
-        value |= num;
-        // Do not shift if last byte
-        if (i != length - 1) {
-            value = value << 8;
-        }
+        value = value * 10 + (*string1 - '0');
+        string1++;
     }
-
     return value;
 }
-
-
-// Function for putting 4 bytes to stdout
-void putChar4Bytes(int length) {
-    putchar((length & 0xFF000000) >> 24);
-    putchar((length & 0xFF0000) >> 16);
-    putchar((length & 0xFF00) >> 8);
-    putchar(length & 0xFF);
-}
-
-
-// Function for putting 8 bytes to stdout
-void putChar8Bytes(int length) {
-    putchar((length & 0xFF00000000000000) >> 56);
-    putchar((length & 0xFF000000000000) >> 48);
-    putchar((length & 0xFF0000000000) >> 40);
-    putchar((length & 0xFF00000000) >> 32);
-    putchar((length & 0xFF000000) >> 24);
-    putchar((length & 0xFF0000) >> 16);
-    putchar((length & 0xFF00) >> 8);
-    putchar(length & 0xFF);
-}
-
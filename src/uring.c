@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+ * Stages of an operation, kept in the low bits of the completion's
+ * user_data next to the address of its struct uring_io, which the size_t in
+ * it aligns to 8 bytes.
+ */
+#define STAGE_OPEN 0
+#define STAGE_TRANSFER 1
+#define STAGE_CLOSE 2
+#define STAGE_STATX 3
+#define STAGE_MKDIR 4
+#define STAGE_MASK 7
+
+static int ringFd = -1;
+
+// Submission ring, its entries and the completion ring, as mapped
+static char *sqRing;
+static size_t sqRingSize;
+static char *cqRing;
+static size_t cqRingSize;
+static struct io_uring_sqe *sqes;
+static size_t sqesSize;
+
+static unsigned *sqHead;
+static unsigned *sqTail;
+static unsigned *sqMask;
+static unsigned *sqArray;
+static unsigned sqEntries;
+static unsigned *cqHead;
+static unsigned *cqTail;
+static unsigned *cqMask;
+static struct io_uring_cqe *cqes;
+static unsigned cqEntries;
+
+// Entries filled but not yet submitted, and submitted but not yet reaped
+static unsigned queued;
+static unsigned inFlight;
+
+// Registered file slots not in use
+static int freeSlots[URING_SLOTS];
+static int freeCount;
+
+int uring_active() {
+    return ringFd != -1;
+}
+
+// Unmap the rings and close the ring descriptor
+static void teardown() {
+    if (sqes != NULL) {
+        munmap(sqes, sqesSize);
+    }
+    if (cqRing != NULL && cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+    if (sqRing != NULL) {
+        munmap(sqRing, sqRingSize);
+    }
+    if (ringFd != -1) {
+        close(ringFd);
+    }
+    sqes = NULL;
+    cqRing = NULL;
+    sqRing = NULL;
+    ringFd = -1;
+}
+
+int uring_start() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ringFd == -1) {
+        debug("io_uring_setup failed with errno %d", errno);
+        return -1;
+    }
+
+    // Both rings may live in the one mapping
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        if (cqRingSize > sqRingSize) {
+            sqRingSize = cqRingSize;
+        }
+        cqRingSize = sqRingSize;
+    }
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                  IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        sqRing = NULL;
+        teardown();
+        return -1;
+    }
+    if (single) {
+        cqRing = sqRing;
+    } else {
+        cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                      IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            cqRing = NULL;
+            teardown();
+            return -1;
+        }
+    }
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        sqes = NULL;
+        teardown();
+        return -1;
+    }
+
+    sqHead = (unsigned *)(sqRing + params.sq_off.head);
+    sqTail = (unsigned *)(sqRing + params.sq_off.tail);
+    sqMask = (unsigned *)(sqRing + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sqRing + params.sq_off.array);
+    sqEntries = params.sq_entries;
+    cqHead = (unsigned *)(cqRing + params.cq_off.head);
+    cqTail = (unsigned *)(cqRing + params.cq_off.tail);
+    cqMask = (unsigned *)(cqRing + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cqRing + params.cq_off.cqes);
+    cqEntries = params.cq_entries;
+
+    // An empty table of file slots, which also needs a kernel recent enough for every opcode used
+    struct io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = URING_SLOTS;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES2, &files, sizeof(files)) == -1) {
+        debug("registering file slots failed with errno %d", errno);
+        teardown();
+        return -1;
+    }
+    for (freeCount = 0; freeCount < URING_SLOTS; freeCount++) {
+        freeSlots[freeCount] = freeCount;
+    }
+    queued = 0;
+    inFlight = 0;
+    return 0;
+}
+
+// Submit whatever is queued and wait for at least wait completions
+static int enter(unsigned wait) {
+    while (1) {
+        int done = syscall(__NR_io_uring_enter, ringFd, queued, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                           NULL, 0);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done == -1) {
+            return -1;
+        }
+        queued -= done;
+        inFlight += done;
+        return 0;
+    }
+}
+
+// Account for one completion
+static void complete(struct io_uring_cqe *cqe) {
+    struct uring_io *io = (struct uring_io *)(uintptr_t)(cqe->user_data & ~(uint64_t)STAGE_MASK);
+    int stage = cqe->user_data & STAGE_MASK;
+
+    if (stage == STAGE_CLOSE) {
+        freeSlots[freeCount++] = io->slot;
+    } else if (cqe->res < 0) {
+        if (io->error == 0) {
+            io->error = cqe->res;
+        }
+    } else if (stage == STAGE_TRANSFER) {
+        io->result = cqe->res;
+        if (io->result != io->length && io->error == 0) {
+            io->error = -EIO;
+        }
+    }
+    io->pending--;
+}
+
+// Reap every completion that has arrived
+static void reap() {
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        complete(cqes + (head & *cqMask));
+        head++;
+        inFlight--;
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+// Wait for at least one completion and reap what has arrived
+static int reap_wait() {
+    if (enter(1) == -1) {
+        return -1;
+    }
+    reap();
+    return 0;
+}
+
+// Make sure count more entries can be queued and completed without entering in between
+static int make_room(unsigned count) {
+    // Never have more in flight than the completion ring can hold
+    while (inFlight + queued + count > cqEntries) {
+        if (reap_wait() == -1) {
+            return -1;
+        }
+    }
+    if (sqEntries - (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE)) < count && enter(0) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// Fill in the next submission entry, making room for it first
+static struct io_uring_sqe *next_sqe(struct uring_io *io, int stage) {
+    if (make_room(1) == -1) {
+        return NULL;
+    }
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    struct io_uring_sqe *sqe = sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)io | stage;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+    return sqe;
+}
+
+// Take a free file slot, waiting for a chain to close one if need be
+static int take_slot() {
+    while (freeCount == 0) {
+        if (reap_wait() == -1) {
+            return -1;
+        }
+    }
+    return freeSlots[--freeCount];
+}
+
+// Queue an openat/transfer/close chain on a file slot
+static int chain(int dirfd, const char *path, int flags, mode_t mode, int opcode, const char *buf,
+                 size_t length, struct uring_io *io) {
+    // The three entries go in together, as a link cannot span two submissions
+    int slot = take_slot();
+    if (slot == -1 || make_room(3) == -1) {
+        return -1;
+    }
+    io->pending = 3;
+    io->error = 0;
+    io->result = 0;
+    io->slot = slot;
+    io->length = length;
+
+    struct io_uring_sqe *sqe = next_sqe(io, STAGE_OPEN);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->len = mode;
+    sqe->open_flags = flags;
+    sqe->file_index = slot + 1;
+    sqe->flags = IOSQE_IO_HARDLINK;
+
+    sqe = next_sqe(io, STAGE_TRANSFER);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = slot;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = length;
+    sqe->off = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+    sqe = next_sqe(io, STAGE_CLOSE);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+    return 0;
+}
+
+int uring_read(int dirfd, const char *name, char *buf, size_t length, struct uring_io *io) {
+    return chain(dirfd, name, O_RDONLY, 0, IORING_OP_READ, buf, length, io);
+}
+
+int uring_write(const char *path, int flags, mode_t mode, const char *data, size_t length,
+                struct uring_io *io) {
+    return chain(AT_FDCWD, path, flags, mode, IORING_OP_WRITE, data, length, io);
+}
+
+int uring_mkdir(const char *path, mode_t mode, struct uring_io *io) {
+    io->pending = 1;
+    io->error = 0;
+    io->result = 0;
+    io->length = 0;
+    struct io_uring_sqe *sqe = next_sqe(io, STAGE_MKDIR);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    // Draining keeps it after everything before it and ahead of everything after it
+    sqe->opcode = IORING_OP_MKDIRAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->len = mode;
+    sqe->flags = IOSQE_IO_DRAIN;
+    return 0;
+}
+
+int uring_wait(struct uring_io *io) {
+    while (io->pending > 0) {
+        if (reap_wait() == -1) {
+            return -1;
+        }
+    }
+    return io->error == 0 ? 0 : -1;
+}
+
+int uring_poll() {
+    if (queued > 0 && enter(0) == -1) {
+        return -1;
+    }
+    reap();
+    return 0;
+}
+
+int uring_wait_all() {
+    while (queued > 0 || inFlight > 0) {
+        if (reap_wait() == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void uring_stop() {
+    if (ringFd == -1) {
+        return;
+    }
+    uring_wait_all();
+    teardown();
+}
+
+int uring_statx_batch(int dirfd, char **names, const int *flags, size_t count, unsigned mask,
+                      struct statx *results) {
+    if (count == 0) {
+        return 0;
+    }
+    struct uring_io *ios = malloc(count * sizeof(struct uring_io));
+    if (ios == NULL) {
+        return -1;
+    }
+
+    // Queue them all, the ring submitting as it fills, then collect in order
+    int getReturn = 0;
+    size_t submitted = 0;
+    for (; submitted < count; submitted++) {
+        struct uring_io *io = ios + submitted;
+        io->pending = 1;
+        io->error = 0;
+        struct io_uring_sqe *sqe = next_sqe(io, STAGE_STATX);
+        if (sqe == NULL) {
+            getReturn = -1;
+            break;
+        }
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirfd;
+        sqe->addr = (uint64_t)(uintptr_t)names[submitted];
+        sqe->len = mask;
+        sqe->off = (uint64_t)(uintptr_t)(results + submitted);
+        sqe->statx_flags = flags[submitted];
+    }
+    int failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i >= submitted || failed || uring_wait(ios + i) == -1) {
+            failed |= i < submitted && ios[i].pending > 0;
+            results[i].stx_mask = 0;
+        }
+    }
+
+    // Nothing may still be writing into ios or results once they are handed back
+    if (failed && uring_wait_all() == -1) {
+        // The ring is broken, so cancel what is left by tearing it down; the kernel only
+        // carries ios as user_data and nothing reaps the ring after this, so ios can go
+        teardown();
+        free(ios);
+        return -1;
+    }
+    free(ios);
+    return getReturn;
+}
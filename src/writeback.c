@@ -0,0 +1,114 @@
+#define _GNU_SOURCE
+
+#include "writeback.h"
+#include "stats.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+int writeback_on;
+
+// Released files, oldest at ring[head], each on a descriptor of its own
+static int ring[WRITEBACK_DEPTH];
+static int head;
+static int count;
+
+// The last window of the payload being copied, not yet dropped
+static int windowFd = -1;
+static off_t windowOffset;
+static off_t windowLength;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+int writeback_preallocate(int fd, off_t size) {
+    if (size < WRITEBACK_PREALLOCATE_MIN) {
+        return 0;
+    }
+    uint64_t since = stats_clock();
+    int getReturn = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+    stats_charge(STATS_METADATA, since);
+    if (getReturn == -1 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+        return 0;
+    }
+    return getReturn;
+}
+
+void writeback_start() {
+    head = 0;
+    count = 0;
+    windowFd = -1;
+    writeback_on = 1;
+}
+
+// Wait for a range to be on disk, then drop it from the cache
+static void drop(int fd, off_t offset, off_t length) {
+    sync_file_range(fd, offset, length,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+void writeback_window(int fd, off_t offset, off_t length) {
+    if (!writeback_on) {
+        return;
+    }
+    sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WRITE);
+    pthread_mutex_lock(&lock);
+    int previous = windowFd == fd;
+    off_t previousOffset = windowOffset;
+    off_t previousLength = windowLength;
+    windowFd = fd;
+    windowOffset = offset;
+    windowLength = length;
+    pthread_mutex_unlock(&lock);
+    if (previous) {
+        drop(fd, previousOffset, previousLength);
+    }
+}
+
+void writeback_release(int fd) {
+    if (!writeback_on) {
+        return;
+    }
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    int held = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (held == -1) {
+        return;
+    }
+
+    // Make room by dropping the oldest file, whose writeback is likely over
+    int oldest = -1;
+    pthread_mutex_lock(&lock);
+    if (windowFd == fd) {
+        windowFd = -1;
+    }
+    if (count == WRITEBACK_DEPTH) {
+        oldest = ring[head];
+        ring[head] = held;
+        head = (head + 1) % WRITEBACK_DEPTH;
+    } else {
+        ring[(head + count) % WRITEBACK_DEPTH] = held;
+        count++;
+    }
+    pthread_mutex_unlock(&lock);
+    if (oldest != -1) {
+        drop(oldest, 0, 0);
+        close(oldest);
+    }
+}
+
+void writeback_finish() {
+    if (!writeback_on) {
+        return;
+    }
+    while (count > 0) {
+        drop(ring[head], 0, 0);
+        close(ring[head]);
+        head = (head + 1) % WRITEBACK_DEPTH;
+        count--;
+    }
+    windowFd = -1;
+    writeback_on = 0;
+}
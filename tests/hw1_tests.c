@@ -1,5 +1,9 @@
 #include <criterion/criterion.h>
 #include <criterion/logging.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
 #include "const.h"
 
 Test(basecode_tests_suite, validargs_help_test) {
@@ -48,3 +52,374 @@ Test(basecode_tests_suite, help_system_test) {
                  "Program exited with %d instead of EXIT_SUCCESS",
 		 return_code);
 }
+
+Test(basecode_tests_suite, validargs_extensions_test) {
+    char *serialize[] = {"bin/transplant", "-s", "-j", "4", "-x", "-o", "inode", "-z", "-H", "-S", "-k",
+                         "--align", "--direct", "--readahead", "16", NULL};
+    int ret = validargs(15, serialize);
+    int flag = 0x62C8452;
+    cr_assert_eq(ret, 0, "Invalid return for validargs with the -s flags.  Got: %d", ret);
+    cr_assert_eq(global_options & flag, flag, "The -s flag bits weren't set. Got: %x", global_options);
+    cr_assert_eq(worker_count, 4, "Wrong worker count. Got: %d", worker_count);
+    cr_assert_eq(read_window, 16 << 20, "Read-ahead window wasn't set. Got: %zu", read_window);
+
+    global_options = 0;
+    char *incremental[] = {"bin/transplant", "-s", "-u", "-m", "new.manifest", "-b", "old.manifest",
+                           "-o", "name", NULL};
+    ret = validargs(9, incremental);
+    flag = 0x4B02;
+    cr_assert_eq(ret, 0, "Invalid return for validargs with manifests.  Got: %d", ret);
+    cr_assert_eq(global_options & flag, flag, "The manifest flag bits weren't set. Got: %x", global_options);
+    cr_assert_str_eq(manifest_path, "new.manifest", "Wrong manifest. Got: %s", manifest_path);
+    cr_assert_str_eq(base_path, "old.manifest", "Wrong base manifest. Got: %s", base_path);
+
+    char *jobsDedup[] = {"bin/transplant", "-s", "-j", "2", "-u", NULL};
+    char *resumeIndex[] = {"bin/transplant", "-s", "--resume", "state", "-x", NULL};
+    cr_assert_eq(validargs(5, jobsDedup), -1, "-j was accepted with -u");
+    cr_assert_eq(validargs(5, resumeIndex), -1, "--resume was accepted with -x");
+
+    global_options = 0;
+    char *deserialize[] = {"bin/transplant", "-d", "-c", "-j", "2", "-a", "-L", "--nocache", "--stats",
+                           "--progress", "--resume", "state", "-i", "archive", "--only", "dir", "hello", NULL};
+    ret = validargs(17, deserialize);
+    flag = 0x5330BC;
+    cr_assert_eq(ret, 0, "Invalid return for validargs with the -d flags.  Got: %d", ret);
+    cr_assert_eq(global_options & flag, flag, "The -d flag bits weren't set. Got: %x", global_options);
+    cr_assert_str_eq(input_path, "archive", "Wrong input path. Got: %s", input_path);
+    cr_assert_str_eq(checkpoint_path, "state", "Wrong checkpoint file. Got: %s", checkpoint_path);
+
+    global_options = 0;
+    char *list[] = {"bin/transplant", "-l", "-V", "-i", "archive", NULL};
+    ret = validargs(5, list);
+    flag = 0x1800000;
+    cr_assert_eq(ret, 0, "Invalid return for validargs with -l -V.  Got: %d", ret);
+    cr_assert_eq(global_options & flag, flag, "List and verify bits weren't set. Got: %x", global_options);
+}
+
+/*
+ * Round trips through the binary, run from the top of the repository like
+ * help_system_test.  Each test works in a directory of its own under
+ * TEST_TMP, on a copy of rsrc/testdir to which make_fixture() adds a file
+ * for each kind of record: a duplicate for -u, a hard link, a sparse file,
+ * a large compressible file, and one with a marker to corrupt.
+ */
+#define TEST_TMP "/tmp/transplant_tests"
+
+// Run a shell command, returning its exit status
+static int run(const char *format, ...) {
+    char cmd[4096];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(cmd, sizeof(cmd), format, ap);
+    va_end(ap);
+    int status = system(cmd);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Build the fixture tree in TEST_TMP/name/src
+static void make_fixture(const char *name) {
+    int ret = run("T=" TEST_TMP "/%s; rm -rf $T && mkdir -p $T && cp -R rsrc/testdir $T/src && cd $T/src"
+                  " && cp hello dup && ln dir/goodbye link && printf 'PLAINMARKER\\n' > marked"
+                  " && truncate -s 1M sparse"
+                  " && printf HOLEMARKER | dd of=sparse bs=1 seek=524288 conv=notrunc 2>/dev/null"
+                  " && yes transplant | head -c 300000 > big", name);
+    cr_assert_eq(ret, 0, "Could not build the fixture for %s", name);
+}
+
+// Serialize the fixture with sopts to out.bin, restore that with dopts to dst and compare
+static int round_trip(const char *name, const char *sopts, const char *dopts) {
+    return run("T=" TEST_TMP "/%s; rm -rf $T/dst && bin/transplant -s %s -p $T/src > $T/out.bin"
+               " && bin/transplant -d %s -i $T/out.bin -p $T/dst && diff -r $T/src $T/dst",
+               name, sopts, dopts);
+}
+
+// Check that serializing the fixture with sopts emits records of a type
+static int emits(const char *name, const char *sopts, const char *type) {
+    return run("bin/transplant -s %s --stats -p " TEST_TMP "/%s/src 2>&1 >/dev/null | grep -q ' %s '",
+               sopts, name, type) == 0;
+}
+
+// Flip a byte of out.bin where marker first occurs in it
+static int corrupt(const char *name, const char *marker) {
+    return run("T=" TEST_TMP "/%s; offset=$(grep -obUa %s $T/out.bin | head -n 1 | cut -d: -f1)"
+               " && [ -n \"$offset\" ] && printf X | dd of=$T/out.bin bs=1 seek=$offset conv=notrunc 2>/dev/null",
+               name, marker);
+}
+
+// Check that the modes in the restored tree are those of the original
+static int same_modes(const char *name) {
+    return run("T=" TEST_TMP "/%s; (cd $T/src && find . -mindepth 1 -printf '%%m %%p\\n' | sort) > $T/modes"
+               " && (cd $T/dst && find . -mindepth 1 -printf '%%m %%p\\n' | sort) | cmp -s - $T/modes",
+               name) == 0;
+}
+
+Test(roundtrip_tests_suite, parallel_serialize_test) {
+    make_fixture("jobs");
+    int ret = run("T=" TEST_TMP "/jobs; bin/transplant -s -p $T/src > $T/one.bin"
+                  " && bin/transplant -s -j 4 -p $T/src | cmp -s - $T/one.bin");
+    cr_assert_eq(ret, 0, "-j 4 output differs from the single-threaded output");
+    ret = run("T=" TEST_TMP "/jobs; bin/transplant -s -z -p $T/src > $T/one.bin"
+              " && bin/transplant -s -j 4 -z -p $T/src | cmp -s - $T/one.bin");
+    cr_assert_eq(ret, 0, "-j 4 -z output differs from the single-threaded output");
+    ret = round_trip("jobs", "-j 4", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+}
+
+Test(roundtrip_tests_suite, parallel_restore_test) {
+    make_fixture("pool");
+    cr_assert_eq(run("cd " TEST_TMP "/pool/src && chmod 751 dir && chmod 600 hello"), 0, "Could not set modes");
+    int ret = round_trip("pool", "-z", "-j 4");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    cr_assert(same_modes("pool"), "-d -j 4 restored different modes");
+}
+
+Test(roundtrip_tests_suite, mapped_input_test) {
+    make_fixture("mapped");
+    int ret = round_trip("mapped", "", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original with -i. Got: %d", ret);
+    ret = run("T=" TEST_TMP "/mapped; bin/transplant -d -p $T/redirected < $T/out.bin"
+              " && diff -r $T/src $T/redirected");
+    cr_assert_eq(ret, 0, "Restoring from a redirected standard input failed. Got: %d", ret);
+    ret = run("T=" TEST_TMP "/mapped; cat $T/out.bin | bin/transplant -d -p $T/piped && diff -r $T/src $T/piped");
+    cr_assert_eq(ret, 0, "Restoring from a pipe failed. Got: %d", ret);
+    ret = run("T=" TEST_TMP "/mapped; head -c 1000 $T/out.bin > $T/short.bin"
+              " && bin/transplant -d -i $T/short.bin -p $T/short 2>/dev/null");
+    cr_assert_neq(ret, 0, "-d -i accepted a truncated stream");
+}
+
+Test(roundtrip_tests_suite, index_test) {
+    make_fixture("index");
+    cr_assert(!emits("index", "", "INDEX"), "An INDEX record was emitted without -x");
+    cr_assert(emits("index", "-x", "INDEX"), "-x emitted no INDEX records");
+    cr_assert(emits("index", "-x", "INDEX_FOOTER"), "-x emitted no INDEX_FOOTER record");
+    int ret = round_trip("index", "-x", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    ret = run("T=" TEST_TMP "/index; bin/transplant -V -i $T/out.bin && bin/transplant -l -i $T/out.bin > $T/indexed"
+              " && bin/transplant -s -p $T/src | bin/transplant -l | cmp -s - $T/indexed");
+    cr_assert_eq(ret, 0, "The indexed stream does not list as the plain one. Got: %d", ret);
+}
+
+Test(roundtrip_tests_suite, only_test) {
+    make_fixture("only");
+    int ret = run("T=" TEST_TMP "/only; chmod 750 $T/src/dir && bin/transplant -s -x -p $T/src > $T/out.bin"
+                  " && bin/transplant -d -i $T/out.bin -p $T/indexed --only dir/goodbye"
+                  " && bin/transplant -d -a -i $T/out.bin -p $T/pooled --only dir/goodbye"
+                  " && cat $T/out.bin | bin/transplant -d -p $T/streamed --only 'dir/g*'"
+                  " && for d in indexed pooled streamed; do cmp $T/src/dir/goodbye $T/$d/dir/goodbye"
+                  " && [ $(stat -c %%a $T/$d/dir) = 750 ] && [ ! -e $T/$d/hello ] || exit 1; done");
+    cr_assert_eq(ret, 0, "--only did not restore just dir/goodbye with the mode of dir. Got: %d", ret);
+    ret = run("T=" TEST_TMP "/only; bin/transplant -d -i $T/out.bin -p $T/dst --only dir"
+              " && diff -r $T/src/dir $T/dst/dir && [ ! -e $T/dst/hello ]");
+    cr_assert_eq(ret, 0, "--only dir did not restore just dir. Got: %d", ret);
+}
+
+Test(roundtrip_tests_suite, incremental_test) {
+    make_fixture("incremental");
+    int ret = round_trip("incremental", "-m " TEST_TMP "/incremental/manifest", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    ret = run("T=" TEST_TMP "/incremental; echo changed > $T/src/hello && rm $T/src/dup"
+              " && bin/transplant -s -b $T/manifest --stats -p $T/src 2>$T/stats > $T/delta.bin"
+              " && grep -q ' UNCHANGED ' $T/stats && grep -q ' DELETED ' $T/stats"
+              " && bin/transplant -d -c -i $T/delta.bin -p $T/dst && diff -r $T/src $T/dst");
+    cr_assert_eq(ret, 0, "Applying the incremental stream did not give the changed tree. Got: %d", ret);
+}
+
+Test(roundtrip_tests_suite, roundtrip_plain_test) {
+    make_fixture("plain");
+    int ret = round_trip("plain", "", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+}
+
+Test(roundtrip_tests_suite, compress_test) {
+    make_fixture("compress");
+    cr_assert(!emits("compress", "", "COMPRESSED_BLOCK"), "A COMPRESSED_BLOCK record was emitted without -z");
+    cr_assert(emits("compress", "-z", "COMPRESSED_BLOCK"), "-z emitted no COMPRESSED_BLOCK records");
+    int ret = round_trip("compress", "-z", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    ret = run("T=" TEST_TMP "/compress; [ $(stat -c %%s $T/out.bin) -lt $(bin/transplant -s -p $T/src | wc -c) ]");
+    cr_assert_eq(ret, 0, "-z did not make the stream of the fixture smaller");
+}
+
+Test(roundtrip_tests_suite, dedup_test) {
+    make_fixture("dedup");
+    cr_assert(!emits("dedup", "", "REFERENCE"), "A REFERENCE record was emitted without -u");
+    cr_assert(emits("dedup", "-u", "REFERENCE"), "-u emitted no REFERENCE records");
+    int ret = round_trip("dedup", "-u", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    ret = round_trip("dedup", "-u", "-L");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original with -L. Got: %d", ret);
+    ret = run("[ $(stat -c %%i " TEST_TMP "/dedup/dst/dup) = $(stat -c %%i " TEST_TMP "/dedup/dst/hello) ]");
+    cr_assert_eq(ret, 0, "-L did not link the duplicate to the earlier file");
+}
+
+Test(roundtrip_tests_suite, hardlink_test) {
+    make_fixture("hardlink");
+    cr_assert(!emits("hardlink", "", "HARD_LINK"), "A HARD_LINK record was emitted without -H");
+    cr_assert(emits("hardlink", "-H", "HARD_LINK"), "-H emitted no HARD_LINK record for the link");
+    int ret = round_trip("hardlink", "-H", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    ret = run("[ $(stat -c %%i " TEST_TMP "/hardlink/dst/link) = $(stat -c %%i " TEST_TMP "/hardlink/dst/dir/goodbye) ]");
+    cr_assert_eq(ret, 0, "The hard link was not restored as one");
+    ret = round_trip("hardlink", "-H -j 4", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original with -j. Got: %d", ret);
+}
+
+Test(roundtrip_tests_suite, sparse_test) {
+    make_fixture("sparse");
+    cr_assert(!emits("sparse", "", "SPARSE_DATA"), "A SPARSE_DATA record was emitted without -S");
+    cr_assert(emits("sparse", "-S", "SPARSE_DATA"), "-S emitted no SPARSE_DATA record for the sparse file");
+    int ret = round_trip("sparse", "-S", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    ret = run("[ $(( $(stat -c %%b " TEST_TMP "/sparse/dst/sparse) * 512 )) -lt 1048576 ]");
+    cr_assert_eq(ret, 0, "The sparse file was restored without its holes");
+    ret = run("T=" TEST_TMP "/sparse; bin/transplant -s -m $T/plain.manifest -p $T/src > /dev/null"
+              " && bin/transplant -s -S -m $T/sparse.manifest -p $T/src > /dev/null"
+              " && cmp -s $T/plain.manifest $T/sparse.manifest");
+    cr_assert_eq(ret, 0, "-S changed the content hashes in the manifest");
+}
+
+Test(roundtrip_tests_suite, uring_test) {
+    make_fixture("uring");
+    int ret = run("T=" TEST_TMP "/uring; bin/transplant -s -o name -p $T/src > $T/plain.bin"
+                  " && bin/transplant -s -a -o name -p $T/src | cmp -s - $T/plain.bin");
+    cr_assert_eq(ret, 0, "-s -a output differs from the plain output");
+    cr_assert_eq(run("cd " TEST_TMP "/uring/src && chmod 751 dir && chmod 600 hello"), 0, "Could not set modes");
+    ret = round_trip("uring", "-a -z", "-a");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original with -a. Got: %d", ret);
+    cr_assert(same_modes("uring"), "-d -a restored different modes");
+}
+
+Test(roundtrip_tests_suite, sorted_order_test) {
+    make_fixture("order");
+    int ret = run("T=" TEST_TMP "/order; mkdir $T/copy"
+                  " && (cd $T/src && for f in $(ls -r); do cp -Rp $f $T/copy/; done)"
+                  " && bin/transplant -s -o name -p $T/src > $T/src.bin"
+                  " && bin/transplant -s -o name -p $T/copy | cmp -s - $T/src.bin"
+                  " && bin/transplant -s -o name -j 4 -p $T/copy | cmp -s - $T/src.bin");
+    cr_assert_eq(ret, 0, "-o name serialized the same tree to different bytes");
+    ret = round_trip("order", "-o inode", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original with -o inode. Got: %d", ret);
+}
+
+Test(roundtrip_tests_suite, stats_test) {
+    make_fixture("stats");
+    int ret = run("T=" TEST_TMP "/stats; bin/transplant -s --stats --progress -p $T/src 2>$T/s.stats > $T/out.bin"
+                  " && bin/transplant -s -p $T/src | cmp -s - $T/out.bin"
+                  " && bin/transplant -d --stats -i $T/out.bin -p $T/dst 2>$T/d.stats && diff -r $T/src $T/dst"
+                  " && entries=$(bin/transplant -l -i $T/out.bin | wc -l)"
+                  " && grep -q \" DIRECTORY_ENTRY  *$entries\\$\" $T/s.stats"
+                  " && grep -q \" DIRECTORY_ENTRY  *$entries\\$\" $T/d.stats"
+                  " && [ \"$(grep ' FILE_DATA ' $T/s.stats)\" = \"$(grep ' FILE_DATA ' $T/d.stats)\" ]");
+    cr_assert_eq(ret, 0, "--stats did not count the records of the stream. Got: %d", ret);
+}
+
+Test(roundtrip_tests_suite, checksum_test) {
+    make_fixture("checksum");
+    cr_assert(!emits("checksum", "", "CHECKSUM"), "A CHECKSUM record was emitted without -k");
+    cr_assert(emits("checksum", "-k -z", "CHECKSUM"), "-k emitted no CHECKSUM records");
+    int ret = round_trip("checksum", "-k -z", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    ret = run("bin/transplant -V -i " TEST_TMP "/checksum/out.bin");
+    cr_assert_eq(ret, 0, "-V rejected an intact checksummed stream");
+}
+
+Test(roundtrip_tests_suite, checksum_corrupt_test) {
+    make_fixture("corrupt");
+    int ret = round_trip("corrupt", "-k", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    cr_assert_eq(corrupt("corrupt", "PLAINMARKER"), 0, "Could not find the contents to corrupt");
+    ret = run("rm -rf " TEST_TMP "/corrupt/dst && bin/transplant -d -i " TEST_TMP "/corrupt/out.bin -p "
+              TEST_TMP "/corrupt/dst 2>/dev/null");
+    cr_assert_neq(ret, 0, "-d accepted corrupted file contents");
+    ret = run("bin/transplant -V -i " TEST_TMP "/corrupt/out.bin 2>/dev/null");
+    cr_assert_neq(ret, 0, "-V accepted corrupted file contents");
+}
+
+Test(roundtrip_tests_suite, checksum_corrupt_compressed_test) {
+    make_fixture("corrupt_z");
+    int ret = round_trip("corrupt_z", "-k -z", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    cr_assert_eq(corrupt("corrupt_z", "PLAINMARKER"), 0, "Could not find the contents to corrupt");
+    ret = run("bin/transplant -V -i " TEST_TMP "/corrupt_z/out.bin 2>/dev/null");
+    cr_assert_neq(ret, 0, "-V accepted corrupted compressed contents");
+}
+
+Test(roundtrip_tests_suite, checksum_corrupt_sparse_test) {
+    make_fixture("corrupt_sparse");
+    int ret = round_trip("corrupt_sparse", "-k -S", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    cr_assert_eq(corrupt("corrupt_sparse", "HOLEMARKER"), 0, "Could not find the contents to corrupt");
+    ret = run("bin/transplant -V -i " TEST_TMP "/corrupt_sparse/out.bin 2>/dev/null");
+    cr_assert_neq(ret, 0, "-V accepted corrupted sparse contents");
+}
+
+Test(roundtrip_tests_suite, align_test) {
+    make_fixture("align");
+    cr_assert(!emits("align", "", "PADDING"), "A PADDING record was emitted without --align");
+    cr_assert(emits("align", "--align", "PADDING"), "--align emitted no PADDING records");
+    int ret = round_trip("align", "--align", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    ret = round_trip("align", "--align -o inode", "-j 4");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original with -j. Got: %d", ret);
+}
+
+Test(roundtrip_tests_suite, restore_nocache_test) {
+    make_fixture("restore_nocache");
+    int ret = round_trip("restore_nocache", "-S", "--nocache");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original with --nocache. Got: %d", ret);
+    ret = run("[ $(( $(stat -c %%b " TEST_TMP "/restore_nocache/dst/sparse) * 512 )) -lt 1048576 ]");
+    cr_assert_eq(ret, 0, "Preallocation filled in the holes of the sparse file");
+    ret = round_trip("restore_nocache", "-z", "--nocache -j 4");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original with -j. Got: %d", ret);
+}
+
+Test(roundtrip_tests_suite, read_nocache_test) {
+    make_fixture("read_nocache");
+    int ret = run("T=" TEST_TMP "/read_nocache; truncate -s 3M $T/src/huge && bin/transplant -s -p $T/src > $T/plain.bin"
+                  " && bin/transplant -s --nocache -p $T/src | cmp -s - $T/plain.bin"
+                  " && bin/transplant -s --direct --readahead 1 -p $T/src | cmp -s - $T/plain.bin"
+                  " && bin/transplant -s --direct -j 4 -p $T/src | cmp -s - $T/plain.bin");
+    cr_assert_eq(ret, 0, "--nocache or --direct changed the output");
+}
+
+Test(roundtrip_tests_suite, resume_serialize_test) {
+    make_fixture("resume");
+    // Stop the stream after its first entry, big, as a checkpoint made there would have
+    int ret = run("T=" TEST_TMP "/resume; bin/transplant -s -o name -p $T/src > $T/full.bin"
+                  " && size=$(( 16 + 16 + 16 + 12 + 3 + 16 + $(stat -c %%s $T/src/big) ))"
+                  " && head -c $size $T/full.bin > $T/out.bin"
+                  " && printf 'transplant-checkpoint s 1 0 %%s 00000000 3 big\\n' $size > $T/state"
+                  " && bin/transplant -s -o name --resume $T/state -p $T/src >> $T/out.bin"
+                  " && [ ! -e $T/state ] && cmp -s $T/out.bin $T/full.bin"
+                  " && bin/transplant -d -i $T/out.bin -p $T/dst && diff -r $T/src $T/dst");
+    cr_assert_eq(ret, 0, "The resumed stream differs from an uninterrupted one. Got: %d", ret);
+    ret = run("T=" TEST_TMP "/resume; printf 'transplant-checkpoint s 1 0 100 00000000 3 dup\\n' > $T/state"
+              " && bin/transplant -s -o name --resume $T/state -p $T/src >> $T/out.bin 2>/dev/null");
+    cr_assert_neq(ret, 0, "-s resumed from a checkpoint made for another tree");
+}
+
+Test(roundtrip_tests_suite, resume_deserialize_test) {
+    make_fixture("resume_d");
+    // big was restored before the checkpoint, so it must be left alone, and the rest restored
+    int ret = round_trip("resume_d", "-o name", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    ret = run("T=" TEST_TMP "/resume_d; echo kept > $T/dst/big && rm $T/dst/hello && echo stale > $T/dst/marked"
+              " && printf 'transplant-checkpoint d 1 0 300000 00000000 3 big\\n' > $T/state"
+              " && bin/transplant -d --resume $T/state -i $T/out.bin -p $T/dst && [ ! -e $T/state ]"
+              " && [ \"$(cat $T/dst/big)\" = kept ] && cp $T/src/big $T/dst/big && diff -r $T/src $T/dst");
+    cr_assert_eq(ret, 0, "-d --resume did not carry on after the checkpoint. Got: %d", ret);
+}
+
+Test(roundtrip_tests_suite, list_verify_test) {
+    make_fixture("list");
+    int ret = round_trip("list", "-u -z", "");
+    cr_assert_eq(ret, 0, "Restored tree differs from the original. Got: %d", ret);
+    ret = run("T=" TEST_TMP "/list; bin/transplant -l -i $T/out.bin > $T/listing"
+              " && [ $(wc -l < $T/listing) = $(cd $T/src && find . -mindepth 1 | wc -l) ]"
+              " && grep -q ' dir/goodbye$' $T/listing");
+    cr_assert_eq(ret, 0, "-l did not list every entry");
+    ret = run("bin/transplant -V -i " TEST_TMP "/list/out.bin && bin/transplant -V -i outfile");
+    cr_assert_eq(ret, 0, "-V rejected an intact stream. Got: %d", ret);
+    ret = run("T=" TEST_TMP "/list; head -c 2000 $T/out.bin | bin/transplant -V 2>/dev/null");
+    cr_assert_neq(ret, 0, "-V accepted a truncated stream");
+}